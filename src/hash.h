@@ -1,14 +1,39 @@
 #ifndef HASH_H
 #define HASH_H
 #include <postgres.h>
-#include <uuid.h>
+#include <common/hashfn.h>
+#include <utils/uuid.h>
 
 /*
  * Hashtable key that defines the identity of a hashtable entry.  We separate
- * gates by uuid.
+ * gates by uuid.  The uuid of a gate is derived from its contents and the
+ * uuids of its operands, so two gates have the same uuid exactly when they
+ * describe the same subcircuit.
  */
 typedef struct probsqlHashKey {
     pg_uuid_t gate_id;
-    
-};
-#endif
\ No newline at end of file
+} probsqlHashKey;
+
+/*
+ * Hashtable entry that maps a gate to the position of its canonical copy in
+ * a serialized circuit.
+ */
+typedef struct probsqlHashEntry {
+    probsqlHashKey key;
+    int32 position;
+} probsqlHashEntry;
+
+/*
+ * Computes the uuid of a block of bytes.  The two halves of the uuid are
+ * hashed with different seeds, so accidental collisions are negligible.
+ */
+static inline void
+probsql_hash_bytes(const void *data, Size len, probsqlHashKey *key)
+{
+    uint64 low = hash_bytes_extended((const unsigned char *) data, len, 0);
+    uint64 high = hash_bytes_extended((const unsigned char *) data, len, UINT64CONST(0x9E3779B97F4A7C15));
+
+    memcpy(key->gate_id.data, &low, sizeof(uint64));
+    memcpy(key->gate_id.data + sizeof(uint64), &high, sizeof(uint64));
+}
+#endif
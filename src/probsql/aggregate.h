@@ -0,0 +1,363 @@
+// Methods for the state of gate aggregates.
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+#include "enums.h"
+#include "structs.h"
+#include "gate.h"
+#include "serialize.h"
+#include "arena.h"
+
+#include "postgres.h"
+#include "libpq/pqformat.h"
+#include "utils/hsearch.h"
+#include <math.h>
+
+// Flags recording which parts of a prob_sum state are in use.
+#define PROB_SUM_HAS_CONSTANT 0x01
+#define PROB_SUM_HAS_RESIDUAL 0x02
+
+// A base variable folded into the running sum, by its id.
+typedef struct
+{
+    pg_uuid_t variable_id;
+    serialized_gate_node node;
+} prob_sum_variable;
+
+/*
+ * The running state of prob_sum.
+ *
+ * Sums of independent Gaussians (or Poissons) are again Gaussian (or Poisson).
+ * So rather than chaining one SUM gate per row, rows holding a base variable are
+ * kept by id and folded into one Gaussian and one Poisson at the end, and only
+ * other rows are kept as gates. A variable is only independent of the others if
+ * it occurs once: a variable seen twice, or also used by a residual row, moves
+ * to the residual instead.
+ */
+typedef struct
+{
+    // Which of the parts below are in use.
+    uint8 flags;
+
+    // The sum of all constant rows.
+    double constant_sum;
+
+    // The base variables that occurred once, as prob_sum_variables.
+    HTAB *folded;
+
+    // The ids of the base variables used by residual, which cannot be folded.
+    HTAB *residual_variables;
+
+    // The sum of all other rows, or NULL if there were none.
+    Gate *residual;
+
+    // Where the gates of residual live. It goes away with the aggregate group.
+    GateArena *arena;
+} prob_sum_state;
+
+static HTAB *new_variable_set(const char *name, Size entrysize)
+{
+    HASHCTL ctl;
+    memset(&ctl, 0, sizeof(HASHCTL));
+    ctl.keysize = sizeof(pg_uuid_t);
+    ctl.entrysize = entrysize;
+    ctl.hcxt = CurrentMemoryContext;
+    return hash_create(name, 16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/**
+ * @brief Create an empty prob_sum state in the current memory context.
+ *
+ * @return prob_sum_state* The state
+ */
+prob_sum_state *new_prob_sum_state()
+{
+    prob_sum_state *state = (prob_sum_state *)palloc0(sizeof(prob_sum_state));
+    state->folded = new_variable_set("probsql prob_sum variables", sizeof(prob_sum_variable));
+    state->residual_variables = new_variable_set("probsql prob_sum residual variables", sizeof(pg_uuid_t));
+    state->residual = NULL;
+    state->arena = create_gate_arena(CurrentMemoryContext);
+    return state;
+}
+
+// The gate of a serialized base variable, with the same id.
+static Gate *base_variable_gate(serialized_gate_node *node)
+{
+    Gate *gate = alloc_gates(1);
+    gate->gate_type = BASE_VARIABLE;
+    gate->gate_info.base_variable.distribution_type = node->tag;
+    gate->gate_info.base_variable.base_variable_parameters = node->parameters;
+    gate->gate_info.base_variable.variable_id = node->variable_id;
+    return gate;
+}
+
+// Adds a gate, already in the state's arena, to the residual.
+static void add_residual_gate(prob_sum_state *state, Gate *gate)
+{
+    state->residual = state->residual == NULL ? gate : combine_prob_gates(state->residual, gate, SUM);
+    state->flags |= PROB_SUM_HAS_RESIDUAL;
+}
+
+// Records that the residual uses a variable. If the variable was folded, it is not
+// independent of the residual after all, so it moves to the residual as well.
+static void add_residual_variable(prob_sum_state *state, pg_uuid_t *variable_id)
+{
+    bool found;
+    hash_search(state->residual_variables, variable_id, HASH_ENTER, &found);
+    if (found)
+    {
+        return;
+    }
+
+    prob_sum_variable *folded = (prob_sum_variable *)hash_search(state->folded, variable_id, HASH_FIND, NULL);
+    if (folded != NULL)
+    {
+        add_residual_gate(state, base_variable_gate(&folded->node));
+        hash_search(state->folded, variable_id, HASH_REMOVE, NULL);
+    }
+}
+
+// Adds a serialized gate to the residual, along with the variables it uses.
+static void add_residual(prob_sum_state *state, SerializedGate *value)
+{
+    static const pg_uuid_t nil_id;
+
+    GateArena *previous = activate_gate_arena(state->arena);
+    PG_TRY();
+    {
+        add_residual_gate(state, deserialize_gate(value));
+        for (int i = 0; i < value->num_nodes; ++i)
+        {
+            serialized_gate_node *node = &value->nodes[i];
+            if (node->gate_type == BASE_VARIABLE && memcmp(&node->variable_id, &nil_id, sizeof(pg_uuid_t)) != 0)
+            {
+                add_residual_variable(state, &node->variable_id);
+            }
+        }
+    }
+    PG_FINALLY();
+    {
+        activate_gate_arena(previous);
+    }
+    PG_END_TRY();
+}
+
+// Adds a base variable with an id to the running sum. It is folded unless the
+// sum already uses it, in which case every occurrence goes to the residual.
+static void add_base_variable(prob_sum_state *state, serialized_gate_node *node)
+{
+    bool found = hash_search(state->residual_variables, &node->variable_id, HASH_FIND, NULL) != NULL;
+    if (!found)
+    {
+        prob_sum_variable *variable =
+            (prob_sum_variable *)hash_search(state->folded, &node->variable_id, HASH_ENTER, &found);
+        if (!found)
+        {
+            variable->node = *node;
+            return;
+        }
+    }
+
+    GateArena *previous = activate_gate_arena(state->arena);
+    PG_TRY();
+    {
+        add_residual_variable(state, &node->variable_id);
+        add_residual_gate(state, base_variable_gate(node));
+    }
+    PG_FINALLY();
+    {
+        activate_gate_arena(previous);
+    }
+    PG_END_TRY();
+}
+
+/**
+ * @brief Add a row to the running sum. Constants and base variables are taken
+ * straight from their serialized form; anything else is rebuilt in the state's
+ * arena and kept as a gate.
+ *
+ * @param state The state
+ * @param value The serialized gate to add
+ */
+void prob_sum_state_add(prob_sum_state *state, SerializedGate *value)
+{
+    serialized_gate_node *root = SERIALIZED_GATE_ROOT(value);
+    double constant_value;
+
+    if (is_constant_serialized_gate(value, &constant_value))
+    {
+        state->constant_sum += constant_value;
+        state->flags |= PROB_SUM_HAS_CONSTANT;
+    }
+    else if (root->gate_type == BASE_VARIABLE)
+    {
+        add_base_variable(state, root);
+    }
+    else
+    {
+        add_residual(state, value);
+    }
+}
+
+/**
+ * @brief Add the contents of another state, as when combining the partial sums of
+ * parallel workers. The gates of other are copied into the arena of state.
+ *
+ * @param state The state to add to
+ * @param other The state to add
+ */
+void prob_sum_state_merge(prob_sum_state *state, prob_sum_state *other)
+{
+    state->constant_sum += other->constant_sum;
+    state->flags |= other->flags & PROB_SUM_HAS_CONSTANT;
+
+    // The residual first, so that the variables it uses are not folded below.
+    if (other->residual != NULL)
+    {
+        SerializedGate *copy = serialize_gate(other->residual);
+        add_residual(state, copy);
+        pfree(copy);
+    }
+
+    HASH_SEQ_STATUS status;
+    prob_sum_variable *variable;
+    hash_seq_init(&status, other->folded);
+    while ((variable = (prob_sum_variable *)hash_seq_search(&status)) != NULL)
+    {
+        add_base_variable(state, &variable->node);
+    }
+}
+
+/**
+ * @brief The final sum of a state: one Gaussian, one Poisson and the residual rows.
+ *
+ * @param state The state, or NULL if the aggregate saw no rows
+ * @return Gate* The sum. An empty sum is zero.
+ */
+Gate *prob_sum_state_result(prob_sum_state *state)
+{
+    if (state == NULL || (state->flags == 0 && hash_get_num_entries(state->folded) == 0))
+    {
+        return constant(0);
+    }
+
+    double gaussian_mean = state->constant_sum;
+    double gaussian_variance = 0;
+    double poisson_lambda = 0;
+    bool has_gaussian = state->flags & PROB_SUM_HAS_CONSTANT;
+    bool has_poisson = false;
+
+    HASH_SEQ_STATUS status;
+    prob_sum_variable *variable;
+    hash_seq_init(&status, state->folded);
+    while ((variable = (prob_sum_variable *)hash_seq_search(&status)) != NULL)
+    {
+        if (variable->node.tag == GAUSSIAN)
+        {
+            const gaussian_parameters params = variable->node.parameters.gaussian_parameters;
+            gaussian_mean += params.mean;
+            gaussian_variance += params.stddev * params.stddev;
+            has_gaussian = true;
+        }
+        else
+        {
+            poisson_lambda += variable->node.parameters.poisson_parameters.lambda;
+            has_poisson = true;
+        }
+    }
+
+    Gate *result = NULL;
+
+    if (has_gaussian)
+    {
+        // Without any spread, the Gaussian rows were all constants.
+        result = gaussian_variance == 0 ? constant(gaussian_mean) : new_gaussian(gaussian_mean, sqrt(gaussian_variance));
+    }
+
+    if (has_poisson)
+    {
+        Gate *poisson = new_poisson(poisson_lambda);
+        result = result == NULL ? poisson : combine_prob_gates(result, poisson, SUM);
+    }
+
+    if (state->flags & PROB_SUM_HAS_RESIDUAL)
+    {
+        result = result == NULL ? state->residual : combine_prob_gates(result, state->residual, SUM);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Write a state in binary form, for sending it between parallel processes.
+ * The folded variables are written as they are kept, since both ends run the
+ * same build.
+ *
+ * @param state The state
+ * @return bytea* The binary form
+ */
+bytea *serialize_prob_sum_state(prob_sum_state *state)
+{
+    StringInfoData buf;
+    pq_begintypsend(&buf);
+    pq_sendbyte(&buf, state->flags);
+    pq_sendfloat8(&buf, state->constant_sum);
+
+    HASH_SEQ_STATUS status;
+    prob_sum_variable *variable;
+    pq_sendint32(&buf, hash_get_num_entries(state->folded));
+    hash_seq_init(&status, state->folded);
+    while ((variable = (prob_sum_variable *)hash_seq_search(&status)) != NULL)
+    {
+        pq_sendbytes(&buf, (char *)&variable->node, sizeof(serialized_gate_node));
+    }
+
+    // The residual goes last, as a serialized gate.
+    if (state->residual != NULL)
+    {
+        SerializedGate *residual = serialize_gate(state->residual);
+        pq_sendbytes(&buf, (char *)residual, VARSIZE(residual));
+    }
+
+    return pq_endtypsend(&buf);
+}
+
+/**
+ * @brief Read a state written by serialize_prob_sum_state.
+ *
+ * @param data The binary form
+ * @return prob_sum_state* The state, in the current memory context
+ */
+prob_sum_state *deserialize_prob_sum_state(bytea *data)
+{
+    StringInfoData buf;
+    buf.data = VARDATA(data);
+    buf.len = VARSIZE(data) - VARHDRSZ;
+    buf.maxlen = buf.len;
+    buf.cursor = 0;
+
+    prob_sum_state *state = new_prob_sum_state();
+    const uint8 flags = pq_getmsgbyte(&buf);
+    state->constant_sum = pq_getmsgfloat8(&buf);
+    state->flags = flags & PROB_SUM_HAS_CONSTANT;
+
+    const int32 num_folded = pq_getmsgint(&buf, 4);
+    for (int32 i = 0; i < num_folded; ++i)
+    {
+        serialized_gate_node node;
+        pq_copymsgbytes(&buf, (char *)&node, sizeof(serialized_gate_node));
+        add_base_variable(state, &node);
+    }
+
+    if (flags & PROB_SUM_HAS_RESIDUAL)
+    {
+        // Copy out of the message so that the gate is suitably aligned.
+        const int size = buf.len - buf.cursor;
+        SerializedGate *residual = (SerializedGate *)palloc(size);
+        pq_copymsgbytes(&buf, (char *)residual, size);
+        add_residual(state, residual);
+        pfree(residual);
+    }
+
+    return state;
+}
+#endif
@@ -0,0 +1,144 @@
+// Methods for allocating gates from a dedicated arena.
+#ifndef ARENA_H
+#define ARENA_H
+#include "structs.h"
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/memutils.h"
+
+// Number of gates in each slab of an arena.
+#define GATE_ARENA_SLAB_SIZE 256
+
+/*
+ * A bump allocator for gates. Gates are handed out from slabs that start on a
+ * cache line, and are never freed one by one: all of them go at once when the
+ * arena is reset, e.g. at the end of a call or of an aggregate group. The slabs
+ * live in their own memory context, ProbsqlGateContext, so the memory they use
+ * shows up separately in memory context dumps.
+ */
+typedef struct
+{
+    MemoryContext context;
+
+    // The unused part of the current slab.
+    Gate *next;
+    Gate *end;
+} GateArena;
+
+// The arena that gates are allocated from, or NULL to palloc them in
+// CurrentMemoryContext. Set it with activate_gate_arena.
+static GateArena *active_gate_arena = NULL;
+
+/**
+ * @brief Create an empty arena.
+ *
+ * @param parent The memory context that the arena belongs to. The arena is
+ * deleted along with it.
+ * @return GateArena* The arena
+ */
+GateArena *create_gate_arena(MemoryContext parent)
+{
+    GateArena *arena = (GateArena *)MemoryContextAlloc(parent, sizeof(GateArena));
+    arena->context = AllocSetContextCreate(parent, "ProbsqlGateContext", ALLOCSET_DEFAULT_SIZES);
+    arena->next = NULL;
+    arena->end = NULL;
+    return arena;
+}
+
+// Frees every gate of an arena at once.
+void reset_gate_arena(GateArena *arena)
+{
+    MemoryContextReset(arena->context);
+    arena->next = NULL;
+    arena->end = NULL;
+}
+
+// Allocates count consecutive gates from an arena.
+Gate *arena_alloc_gates(GateArena *arena, int count)
+{
+    if (arena->end - arena->next < count)
+    {
+        const Size slab = Max(count, GATE_ARENA_SLAB_SIZE);
+        char *block = (char *)MemoryContextAlloc(arena->context, slab * sizeof(Gate) + PG_CACHE_LINE_SIZE);
+        arena->next = (Gate *)TYPEALIGN(PG_CACHE_LINE_SIZE, block);
+        arena->end = arena->next + slab;
+    }
+
+    Gate *result = arena->next;
+    arena->next += count;
+    return result;
+}
+
+/**
+ * @brief Allocate count consecutive gates, from the active arena if there is one.
+ *
+ * @param count The number of gates
+ * @return Gate* The first gate
+ */
+Gate *alloc_gates(int count)
+{
+    if (active_gate_arena != NULL)
+    {
+        return arena_alloc_gates(active_gate_arena, count);
+    }
+    return (Gate *)palloc(count * sizeof(Gate));
+}
+
+/**
+ * @brief Allocate the operand list of ANDs and ORs, from the active arena if there is one.
+ *
+ * @param count The number of operands
+ * @return Gate** The list
+ */
+Gate **alloc_gate_operands(int count)
+{
+    if (active_gate_arena != NULL)
+    {
+        return (Gate **)MemoryContextAlloc(active_gate_arena->context, count * sizeof(Gate *));
+    }
+    return (Gate **)palloc(count * sizeof(Gate *));
+}
+
+/**
+ * @brief Make gates come from an arena until the next call. Callers must put
+ * back the previous arena even on error, i.e. in a PG_FINALLY block.
+ *
+ * @param arena The arena, or NULL to go back to palloc
+ * @return GateArena* The arena that was active before
+ */
+GateArena *activate_gate_arena(GateArena *arena)
+{
+    GateArena *previous = active_gate_arena;
+    active_gate_arena = arena;
+    return previous;
+}
+
+/**
+ * @brief The arena of a SQL function, emptied for this call. It is kept in
+ * fn_extra, so it lives as long as the function's FmgrInfo.
+ *
+ * @param fcinfo The call
+ * @return GateArena* The arena, or NULL if the call has no FmgrInfo
+ */
+GateArena *call_gate_arena(FunctionCallInfo fcinfo)
+{
+    if (fcinfo->flinfo == NULL)
+    {
+        return NULL;
+    }
+
+    GateArena *arena = (GateArena *)fcinfo->flinfo->fn_extra;
+    if (arena == NULL)
+    {
+        arena = create_gate_arena(fcinfo->flinfo->fn_mcxt);
+        fcinfo->flinfo->fn_extra = arena;
+    }
+    else
+    {
+        reset_gate_arena(arena);
+    }
+
+    return arena;
+}
+#endif
@@ -0,0 +1,416 @@
+// Methods for bounding the probability of a condition gate cheaply, and for
+// deciding threshold checks with as little work as possible.
+#ifndef BOUNDS_H
+#define BOUNDS_H
+#include "enums.h"
+#include "structs.h"
+#include "support.h"
+#include "serialize.h"
+#include "probability.h"
+#include "sampler.h"
+
+#include "postgres.h"
+#include "common/hashfn.h"
+#include <math.h>
+
+// Samples drawn between two checks of a sequential threshold test.
+#define THRESHOLD_SAMPLES_PER_ROUND (8 * SAMPLER_BATCH_SIZE)
+
+// The probability that a sequential threshold test stops on the wrong side.
+#define THRESHOLD_ERROR_RATE 1e-6
+
+// Everything the bounding pass knows about each gate of a serialized circuit,
+// indexed by position.
+typedef struct
+{
+    // For probability gates: the exact mean and an upper bound on the variance,
+    // when moments_known is set.
+    bool *moments_known;
+    double *means;
+    double *variances;
+
+    // For probability gates: every value the gate can take.
+    support_interval *supports;
+
+    // A set of 64 buckets holding the random variables each gate depends on. Gates
+    // whose sets do not intersect are independent.
+    uint64 *signatures;
+
+    // For condition gates: the probability that the condition holds lies between these.
+    double *lower;
+    double *upper;
+} bounds_context;
+
+// The variance of X + Y or X - Y, or an upper bound on it if X and Y may be dependent.
+static inline double combine_variances(double x, double y, bool independent)
+{
+    if (independent)
+    {
+        return x + y;
+    }
+
+    // Whatever the correlation, the standard deviation is at most the sum of the two.
+    const double stddev = sqrt(x) + sqrt(y);
+    return stddev * stddev;
+}
+
+// Works out the moments and support of a probability gate from its operands.
+void bound_prob_gate(bounds_context *ctx, SerializedGate *sg, int32 i)
+{
+    serialized_gate_node *node = &sg->nodes[i];
+
+    if (node->gate_type == BASE_VARIABLE)
+    {
+        ctx->moments_known[i] = true;
+        ctx->supports[i] = base_variable_support(node->tag, node->parameters);
+
+        if (node->tag == GAUSSIAN)
+        {
+            const gaussian_parameters params = node->parameters.gaussian_parameters;
+            ctx->means[i] = params.mean;
+            ctx->variances[i] = params.stddev * params.stddev;
+        }
+        else
+        {
+            ctx->means[i] = node->parameters.poisson_parameters.lambda;
+            ctx->variances[i] = node->parameters.poisson_parameters.lambda;
+        }
+
+        // Constants do not depend on anything.
+        ctx->signatures[i] = ctx->variances[i] == 0
+                                 ? 0
+                                 : UINT64CONST(1) << (hash_bytes(node->variable_id.data, UUID_LEN) & 63);
+        return;
+    }
+
+    const int32 l = node->left;
+    const int32 r = node->right;
+    const bool independent = (ctx->signatures[l] & ctx->signatures[r]) == 0;
+    const bool known = ctx->moments_known[l] && ctx->moments_known[r];
+
+    ctx->signatures[i] = ctx->signatures[l] | ctx->signatures[r];
+    ctx->supports[i] = combine_supports(node->tag, ctx->supports[l], ctx->supports[r]);
+    ctx->moments_known[i] = false;
+
+    if (!known)
+    {
+        return;
+    }
+
+    switch (node->tag)
+    {
+    case PLUS:
+    case SUM:
+    case MINUS:
+        ctx->moments_known[i] = true;
+        ctx->means[i] = node->tag == MINUS ? ctx->means[l] - ctx->means[r] : ctx->means[l] + ctx->means[r];
+        ctx->variances[i] = combine_variances(ctx->variances[l], ctx->variances[r], independent);
+        break;
+    case TIMES:
+        if (ctx->variances[l] == 0 || ctx->variances[r] == 0 || independent)
+        {
+            // Var(XY) = Var(X)Var(Y) + Var(X)E[Y]^2 + Var(Y)E[X]^2 for independent X and Y,
+            // which includes multiplying by a constant.
+            const double mx = ctx->means[l];
+            const double my = ctx->means[r];
+            ctx->moments_known[i] = true;
+            ctx->means[i] = mx * my;
+            ctx->variances[i] = ctx->variances[l] * ctx->variances[r] +
+                                ctx->variances[l] * my * my + ctx->variances[r] * mx * mx;
+        }
+        break;
+    case DIVIDE:
+        if (ctx->variances[r] == 0 && ctx->means[r] != 0)
+        {
+            const double c = ctx->means[r];
+            ctx->moments_known[i] = true;
+            ctx->means[i] = ctx->means[l] / c;
+            ctx->variances[i] = ctx->variances[l] / (c * c);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Works out the bounds on the probability of an AND or OR from its operands.
+// They are combined one at a time, each with all the ones before it.
+void bound_junction_gate(bounds_context *ctx, SerializedGate *sg, int32 i)
+{
+    serialized_gate_node *node = &sg->nodes[i];
+    const int32 *operands = SERIALIZED_GATE_OPERANDS(sg) + node->left;
+
+    double lower = ctx->lower[operands[0]];
+    double upper = ctx->upper[operands[0]];
+    uint64 signature = ctx->signatures[operands[0]];
+
+    for (int32 k = 1; k < node->right; ++k)
+    {
+        const int32 o = operands[k];
+        const bool independent = (signature & ctx->signatures[o]) == 0;
+
+        if (node->tag == AND)
+        {
+            // Independent conditions multiply; otherwise the Frechet bounds hold.
+            lower = independent ? lower * ctx->lower[o] : Max(0, lower + ctx->lower[o] - 1);
+            upper = independent ? upper * ctx->upper[o] : Min(upper, ctx->upper[o]);
+        }
+        else
+        {
+            lower = independent ? 1 - (1 - lower) * (1 - ctx->lower[o]) : Max(lower, ctx->lower[o]);
+            upper = independent ? 1 - (1 - upper) * (1 - ctx->upper[o]) : Min(1, upper + ctx->upper[o]);
+        }
+        signature |= ctx->signatures[o];
+    }
+
+    ctx->signatures[i] = signature;
+    ctx->lower[i] = Max(0, lower);
+    ctx->upper[i] = Min(1, upper);
+}
+
+// Works out the bounds on the probability of a condition gate from its operands.
+void bound_condition_gate(bounds_context *ctx, SerializedGate *sg, int32 i)
+{
+    serialized_gate_node *node = &sg->nodes[i];
+    double lower = 0;
+    double upper = 1;
+
+    if (is_placeholder_type(node->gate_type))
+    {
+        ctx->lower[i] = ctx->upper[i] = node->gate_type == PLACEHOLDER_TRUE;
+        ctx->signatures[i] = 0;
+        return;
+    }
+
+    if (is_junction_node(node))
+    {
+        bound_junction_gate(ctx, sg, i);
+        return;
+    }
+
+    const int32 l = node->left;
+    const int32 r = node->right;
+    const bool independent = (ctx->signatures[l] & ctx->signatures[r]) == 0;
+    ctx->signatures[i] = ctx->signatures[l] | ctx->signatures[r];
+
+    bool holds;
+    if (decide_comparison(node->tag, ctx->supports[l], ctx->supports[r], &holds))
+    {
+        ctx->lower[i] = ctx->upper[i] = holds;
+        return;
+    }
+
+    if (ctx->moments_known[l] && ctx->moments_known[r])
+    {
+        // Cantelli's inequality on D = L - R: P(D - mean >= t) <= var / (var + t^2) for t > 0.
+        const double mean = ctx->means[l] - ctx->means[r];
+        const double variance = combine_variances(ctx->variances[l], ctx->variances[r], independent);
+        const double tail = mean == 0 ? 1 : variance / (variance + mean * mean);
+
+        switch (node->tag)
+        {
+        case LESS_THAN:
+        case LESS_THAN_OR_EQUAL:
+            if (mean > 0)
+                upper = tail;
+            else if (mean < 0)
+                lower = 1 - tail;
+            break;
+        case MORE_THAN:
+        case MORE_THAN_OR_EQUAL:
+            if (mean < 0)
+                upper = tail;
+            else if (mean > 0)
+                lower = 1 - tail;
+            break;
+        case EQUAL_TO:
+            upper = tail;
+            break;
+        case NOT_EQUAL_TO:
+            lower = 1 - tail;
+            break;
+        default:
+            break;
+        }
+    }
+
+    ctx->lower[i] = Max(0, lower);
+    ctx->upper[i] = Min(1, upper);
+}
+
+// Allocates the arrays of a bounding pass over n gates.
+static void init_bounds_context(bounds_context *ctx, int32 n)
+{
+    ctx->moments_known = (bool *)palloc(n * sizeof(bool));
+    ctx->means = (double *)palloc(n * sizeof(double));
+    ctx->variances = (double *)palloc(n * sizeof(double));
+    ctx->supports = (support_interval *)palloc(n * sizeof(support_interval));
+    ctx->signatures = (uint64 *)palloc(n * sizeof(uint64));
+    ctx->lower = (double *)palloc(n * sizeof(double));
+    ctx->upper = (double *)palloc(n * sizeof(double));
+}
+
+static void free_bounds_context(bounds_context *ctx)
+{
+    pfree(ctx->moments_known);
+    pfree(ctx->means);
+    pfree(ctx->variances);
+    pfree(ctx->supports);
+    pfree(ctx->signatures);
+    pfree(ctx->lower);
+    pfree(ctx->upper);
+}
+
+// Runs the bounding pass over every gate of a serialized circuit, operands first.
+static void bound_serialized_gate(bounds_context *ctx, SerializedGate *sg)
+{
+    init_bounds_context(ctx, sg->num_nodes);
+
+    for (int32 i = 0; i < sg->num_nodes; ++i)
+    {
+        if (is_prob_type(sg->nodes[i].gate_type))
+        {
+            bound_prob_gate(ctx, sg, i);
+        }
+        else
+        {
+            bound_condition_gate(ctx, sg, i);
+        }
+    }
+}
+
+/**
+ * @brief Bound the probability that a condition gate holds, in one cheap pass:
+ * moments and supports are propagated through the arithmetic, comparisons are
+ * bounded with Cantelli's inequality, and AND/OR with the Frechet bounds, or
+ * exactly when their operands are independent.
+ *
+ * @param sg The serialized condition gate
+ * @param lower Receives a lower bound on the probability
+ * @param upper Receives an upper bound on the probability
+ */
+void probability_bounds(SerializedGate *sg, double *lower, double *upper)
+{
+    bounds_context ctx;
+    bound_serialized_gate(&ctx, sg);
+
+    *lower = ctx.lower[sg->num_nodes - 1];
+    *upper = ctx.upper[sg->num_nodes - 1];
+
+    free_bounds_context(&ctx);
+}
+
+/**
+ * @brief Bound the probability that two probability gates are equal, from the
+ * support and moments of each one alone, without building X == Y. Nothing is
+ * known about how X and Y depend on each other, so the variance of X - Y is
+ * bounded for any correlation.
+ *
+ * @param x The serialized probability gate X
+ * @param y The serialized probability gate Y
+ * @return double An upper bound on P(X == Y): 0 if their supports are disjoint,
+ * and Cantelli's bound when their means are apart
+ */
+double equality_probability_upper_bound(SerializedGate *x, SerializedGate *y)
+{
+    bounds_context cx, cy;
+    bound_serialized_gate(&cx, x);
+    bound_serialized_gate(&cy, y);
+
+    const int32 rx = x->num_nodes - 1;
+    const int32 ry = y->num_nodes - 1;
+    double upper = 1;
+    bool holds;
+
+    if (decide_comparison(EQUAL_TO, cx.supports[rx], cy.supports[ry], &holds))
+    {
+        upper = holds;
+    }
+    else if (cx.moments_known[rx] && cy.moments_known[ry])
+    {
+        const double mean = cx.means[rx] - cy.means[ry];
+        const double variance = combine_variances(cx.variances[rx], cy.variances[ry], false);
+        if (mean != 0)
+        {
+            upper = variance / (variance + mean * mean);
+        }
+    }
+
+    free_bounds_context(&cx);
+    free_bounds_context(&cy);
+    return upper;
+}
+
+/**
+ * @brief The probability of a condition gate, in closed form where there is one
+ * and by sampling otherwise.
+ *
+ * @param sg The serialized condition gate
+ * @return double The probability
+ */
+double evaluate_probability(SerializedGate *sg)
+{
+    double result;
+    if (!exact_probability(sg, &result))
+    {
+        result = sample_mean(sg, DEFAULT_MC_SAMPLES, 0);
+    }
+    return result;
+}
+
+/**
+ * @brief Decide whether a condition gate holds with at least some probability,
+ * refining only as far as needed: first the cheap bounds, then the closed form,
+ * and finally sampling in rounds until Hoeffding's inequality puts the estimate
+ * clearly on one side of the threshold, or the sample budget runs out.
+ *
+ * @param sg The serialized condition gate
+ * @param threshold The probability to compare against
+ * @return bool Whether the probability is at least threshold
+ */
+bool probability_at_least(SerializedGate *sg, double threshold)
+{
+    double lower, upper;
+    probability_bounds(sg, &lower, &upper);
+
+    if (lower >= threshold)
+    {
+        return true;
+    }
+    if (upper < threshold)
+    {
+        return false;
+    }
+
+    double exact;
+    if (exact_probability(sg, &exact))
+    {
+        return exact >= threshold;
+    }
+
+    sampler_state state;
+    init_sampler(&state, sg, 0);
+
+    double total = 0;
+    int64 samples = 0;
+    bool result;
+
+    for (;;)
+    {
+        total += draw_samples(&state, THRESHOLD_SAMPLES_PER_ROUND);
+        samples += THRESHOLD_SAMPLES_PER_ROUND;
+
+        const double mean = total / samples;
+        const double margin = sqrt(log(2 / THRESHOLD_ERROR_RATE) / (2.0 * samples));
+
+        if (mean - margin >= threshold || mean + margin < threshold || samples >= DEFAULT_MC_SAMPLES)
+        {
+            result = mean >= threshold;
+            break;
+        }
+    }
+
+    free_sampler(&state);
+    return result;
+}
+#endif
@@ -0,0 +1,96 @@
+// Methods for writing a circuit as a list of numbered gates, each stored once.
+// parse.h reads the list back.
+#ifndef DAG_H
+#define DAG_H
+#include "enums.h"
+#include "structs.h"
+#include "stringify.h"
+#include "gate.h"
+#include "serialize.h"
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+/**
+ * @brief Append a serialized circuit as a list of numbered gates, e.g.
+ * #1 = gaussian(1.00, 2.00); #2 = #1 + #1. Every gate is written once, in
+ * storage order, however many gates use it, and the root comes last.
+ *
+ * @param buf The buffer to append to
+ * @param sg The serialized circuit
+ * @param exact Whether to write base variables in full, with their ids, so that
+ * the text reads back as the same circuit. Otherwise parameters are rounded to
+ * two decimals, for display.
+ */
+void stringify_serialized_gate_dag(StringInfo buf, SerializedGate *sg, bool exact)
+{
+    for (int32 i = 0; i < sg->num_nodes; ++i)
+    {
+        serialized_gate_node *node = &sg->nodes[i];
+
+        if (i > 0)
+        {
+            appendStringInfoString(buf, "; ");
+        }
+        appendStringInfo(buf, "#%d = ", i + 1);
+
+        switch (node->gate_type)
+        {
+        case BASE_VARIABLE:
+        {
+            base_variable var;
+            var.distribution_type = node->tag;
+            var.base_variable_parameters = node->parameters;
+            var.variable_id = node->variable_id;
+            if (exact)
+            {
+                stringify_base_variable_exact(buf, &var);
+            }
+            else
+            {
+                stringify_base_variable(buf, &var);
+            }
+            break;
+        }
+        case PLACEHOLDER_TRUE:
+            appendStringInfoString(buf, "TRUE");
+            break;
+        case PLACEHOLDER_FALSE:
+            appendStringInfoString(buf, "FALSE");
+            break;
+        case COMPOSITE_VARIABLE:
+            if (is_aggregate_comp(node->tag))
+            {
+                appendStringInfo(buf, "%s(#%d, #%d)", composition_operator_string(node->tag),
+                                 node->left + 1, node->right + 1);
+            }
+            else
+            {
+                appendStringInfo(buf, "#%d %s #%d", node->left + 1, composition_operator_string(node->tag),
+                                 node->right + 1);
+            }
+            break;
+        case CONDITION:
+            if (is_junction_node(node))
+            {
+                const int32 *operands = SERIALIZED_GATE_OPERANDS(sg) + node->left;
+                for (int32 k = 0; k < node->right; ++k)
+                {
+                    if (k > 0)
+                    {
+                        appendStringInfo(buf, " %s ", condition_operator_string(node->tag));
+                    }
+                    appendStringInfo(buf, "#%d", operands[k] + 1);
+                }
+                break;
+            }
+            appendStringInfo(buf, "#%d %s #%d", node->left + 1, condition_operator_string(node->tag),
+                             node->right + 1);
+            break;
+        default:
+            appendStringInfoString(buf, "UNRECOGNISED_GATE");
+        }
+    }
+}
+
+#endif
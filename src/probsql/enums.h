@@ -50,11 +50,17 @@ typedef enum
     BASE_VARIABLE,
     COMPOSITE_VARIABLE,
     CONDITION,
-    PLACEHOLDER_TRUE // Used for the trivial condition
+    PLACEHOLDER_TRUE, // Used for the trivial condition
+    PLACEHOLDER_FALSE // Used for conditions that can never hold
 } gate_type;
 
 bool is_prob_type(gate_type g)
 {
     return g == BASE_VARIABLE || g == COMPOSITE_VARIABLE;
 }
+
+bool is_placeholder_type(gate_type g)
+{
+    return g == PLACEHOLDER_TRUE || g == PLACEHOLDER_FALSE;
+}
 #endif
\ No newline at end of file
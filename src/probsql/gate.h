@@ -3,7 +3,70 @@
 #define GATE_H
 #include "enums.h"
 #include "structs.h"
+#include "support.h"
+#include "arena.h"
 #include "postgres.h"
+#include "miscadmin.h"
+#include "utils/timestamp.h"
+#include <math.h>
+
+/**
+ * @brief Create a fresh identity for a base variable. Ids are a random
+ * per-backend prefix followed by a per-backend counter, so they never repeat.
+ *
+ * @return pg_uuid_t The new id
+ */
+pg_uuid_t new_variable_id()
+{
+    static uint64 prefix = 0;
+    static uint64 counter = 0;
+
+    if (counter == 0)
+    {
+        if (!pg_strong_random(&prefix, sizeof(prefix)))
+        {
+            prefix = ((uint64)MyProcPid << 32) ^ (uint64)GetCurrentTimestamp();
+        }
+    }
+    ++counter;
+
+    pg_uuid_t id;
+    memcpy(id.data, &prefix, sizeof(uint64));
+    memcpy(id.data + sizeof(uint64), &counter, sizeof(uint64));
+    return id;
+}
+
+/**
+ * @brief Check the parameters of a new base variable. None may be NaN, and the
+ * standard deviation of a Gaussian or the rate of a Poisson may not be negative,
+ * or the evaluators would produce NaN probabilities from them.
+ *
+ * @param tag The distribution
+ * @param parameters Its parameters
+ */
+void check_base_variable_parameters(distribution_type tag, base_variable_parameters parameters)
+{
+    if (tag == GAUSSIAN)
+    {
+        const gaussian_parameters params = parameters.gaussian_parameters;
+        if (isnan(params.mean) || isnan(params.stddev) || params.stddev < 0)
+        {
+            ereport(ERROR,
+                    errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("Invalid parameters for a Gaussian: mean %g, stddev %g", params.mean, params.stddev));
+        }
+    }
+    else
+    {
+        const double lambda = parameters.poisson_parameters.lambda;
+        if (isnan(lambda) || lambda < 0)
+        {
+            ereport(ERROR,
+                    errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("Invalid parameter for a Poisson: lambda %g", lambda));
+        }
+    }
+}
 
 /**
  * @brief Create a new Gate representing a Gaussian distribution
@@ -14,11 +77,12 @@
  */
 Gate *new_gaussian(double mean, double stddev)
 {
-    Gate *result = (Gate *)palloc(sizeof(Gate));
+    Gate *result = alloc_gates(1);
     result->gate_type = BASE_VARIABLE;
     result->gate_info.base_variable.distribution_type = GAUSSIAN;
     gaussian_parameters params = {mean, stddev};
     result->gate_info.base_variable.base_variable_parameters.gaussian_parameters = params;
+    result->gate_info.base_variable.variable_id = new_variable_id();
     return result;
 }
 
@@ -30,10 +94,11 @@ Gate *new_gaussian(double mean, double stddev)
  */
 Gate *new_poisson(double lambda)
 {
-    Gate *result = (Gate *)palloc(sizeof(Gate));
+    Gate *result = alloc_gates(1);
     result->gate_type = BASE_VARIABLE;
     result->gate_info.base_variable.distribution_type = POISSON;
     result->gate_info.base_variable.base_variable_parameters.poisson_parameters.lambda = lambda;
+    result->gate_info.base_variable.variable_id = new_variable_id();
     return result;
 }
 
@@ -45,7 +110,86 @@ Gate *new_poisson(double lambda)
  */
 Gate *constant(double constant)
 {
-    return new_gaussian(constant, 0);
+    Gate *result = new_gaussian(constant, 0);
+
+    // Constants carry no randomness, so equal constants can always be shared.
+    memset(&result->gate_info.base_variable.variable_id, 0, sizeof(pg_uuid_t));
+    return result;
+}
+
+/**
+ * @brief Create a new Gate representing a condition that always or never holds
+ *
+ * @param value Whether the condition holds
+ * @return Gate* The TRUE or FALSE placeholder gate
+ */
+Gate *truth_gate(bool value)
+{
+    Gate *result = alloc_gates(1);
+    memset(result, 0, sizeof(Gate));
+    result->gate_type = value ? PLACEHOLDER_TRUE : PLACEHOLDER_FALSE;
+    return result;
+}
+
+/**
+ * @brief Check whether a gate always has the same value, i.e. is a Gaussian without spread
+ *
+ * @param gate The gate
+ * @param value Receives the value of the gate, if it is constant
+ * @return bool Whether the gate is constant
+ */
+bool is_constant_gate(Gate *gate, double *value)
+{
+    if (gate->gate_type != BASE_VARIABLE ||
+        gate->gate_info.base_variable.distribution_type != GAUSSIAN ||
+        gate->gate_info.base_variable.base_variable_parameters.gaussian_parameters.stddev != 0)
+    {
+        return false;
+    }
+
+    *value = gate->gate_info.base_variable.base_variable_parameters.gaussian_parameters.mean;
+    return true;
+}
+
+/**
+ * @brief Apply an arithmetic operator to two constants
+ *
+ * @param x The left constant
+ * @param y The right constant
+ * @param opr The operator to apply
+ * @param result Receives the result
+ * @return bool false if the result is not a constant, as for COUNT or a division by zero
+ */
+bool fold_constant_composition(double x, double y, probabilistic_composition opr, double *result)
+{
+    switch (opr)
+    {
+    case PLUS:
+    case SUM:
+        *result = x + y;
+        return true;
+    case MINUS:
+        *result = x - y;
+        return true;
+    case TIMES:
+        *result = x * y;
+        return true;
+    case DIVIDE:
+        if (y == 0)
+        {
+            return false;
+        }
+        *result = x / y;
+        return true;
+    case MAX:
+        *result = Max(x, y);
+        return true;
+    case MIN:
+        *result = Min(x, y);
+        return true;
+    default:
+        return false;
+    }
 }
 
 /**
@@ -66,8 +210,15 @@ Gate *combine_prob_gates(Gate *gate1, Gate *gate2, probabilistic_composition opr
                 errmsg("Detected condition gate instead of prob gate: %s %s", _stringify_gate(gate1), _stringify_gate(gate2)));
     }
 
+    // Optimisation: Arithmetic on constants is done straight away.
+    double x, y, value;
+    if (is_constant_gate(gate1, &x) && is_constant_gate(gate2, &y) && fold_constant_composition(x, y, opr, &value))
+    {
+        return constant(value);
+    }
+
     // Create the result gate
-    Gate *result = (Gate *)palloc(sizeof(Gate));
+    Gate *result = alloc_gates(1);
     result->gate_type = COMPOSITE_VARIABLE;
     result->gate_info.comp_variable.opr = opr;
     result->gate_info.comp_variable.left_gate = gate1;
@@ -103,8 +254,22 @@ Gate *create_condition_from_prob_gates(Gate *gate1, Gate *gate2, condition_type
                 errmsg("Detected boolean condition instead of comparator condition"));
     }
 
+    // Optimisation: Comparisons of constants are decided straight away.
+    double x, y;
+    if (is_constant_gate(gate1, &x) && is_constant_gate(gate2, &y))
+    {
+        support_interval support_x = {x, x};
+        support_interval support_y = {y, y};
+        bool holds;
+
+        if (decide_comparison(opr, support_x, support_y, &holds))
+        {
+            return truth_gate(holds);
+        }
+    }
+
     // Create the result gate
-    Gate *result = (Gate *)palloc(sizeof(Gate));
+    Gate *result = alloc_gates(1);
     result->gate_type = CONDITION;
     condition cdn = {opr, gate1, gate2};
     result->gate_info.condition = cdn;
@@ -139,30 +304,64 @@ Gate *combine_two_conditions(Gate *gate1, Gate *gate2, condition_type opr)
                 errmsg("Detected comparator condition instead of boolean condition: %u", opr));
     }
 
-    // Optimisation: If one is the placeholder true gate, return the other one.
-    if (gate1->gate_type == PLACEHOLDER_TRUE)
+    // Optimisation: TRUE and FALSE either decide the result or drop out, i.e.
+    // X AND TRUE = X, X AND FALSE = FALSE, X OR TRUE = TRUE and X OR FALSE = X.
+    if (is_placeholder_type(gate1->gate_type))
     {
-        return gate2;
+        return (gate1->gate_type == PLACEHOLDER_TRUE) == (opr == AND) ? gate2 : gate1;
     }
-    else if (gate2->gate_type == PLACEHOLDER_TRUE)
+    else if (is_placeholder_type(gate2->gate_type))
+    {
+        return (gate2->gate_type == PLACEHOLDER_TRUE) == (opr == AND) ? gate1 : gate2;
+    }
+
+    // Optimisation: X AND X = X OR X = X.
+    if (gate1 == gate2)
     {
         return gate1;
     }
 
+    // The result is a single gate with all the operands: an AND of ANDs, or an
+    // OR of ORs, takes over their operands.
+    Gate *pair[2] = {gate1, gate2};
+    int count = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        const bool nested = pair[i]->gate_type == CONDITION && pair[i]->gate_info.condition.condition_type == opr;
+        count += nested ? pair[i]->gate_info.condition.num_operands : 1;
+    }
+
+    Gate **operands = alloc_gate_operands(count);
+    count = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        if (pair[i]->gate_type == CONDITION && pair[i]->gate_info.condition.condition_type == opr)
+        {
+            memcpy(&operands[count], pair[i]->gate_info.condition.operands,
+                   pair[i]->gate_info.condition.num_operands * sizeof(Gate *));
+            count += pair[i]->gate_info.condition.num_operands;
+        }
+        else
+        {
+            operands[count++] = pair[i];
+        }
+    }
+
     // Create the result gate
-    Gate *result = (Gate *)palloc(sizeof(Gate));
+    Gate *result = alloc_gates(1);
     result->gate_type = CONDITION;
-    condition cdn = {opr, gate1, gate2};
+    condition cdn = {opr, NULL, NULL, count, operands};
     result->gate_info.condition = cdn;
 
     return result;
 }
 
 /**
- * @brief Switch the condition type of a condition.
+ * @brief Switch the condition type of a condition. The gate itself is left untouched,
+ * because its operands may be shared with other parts of the circuit.
  *
  * @param gate The gate whose condition is to be negated.
- * @return Gate* The same gate but with a different condition
+ * @return Gate* A new gate with the opposite condition
  */
 Gate *negate_condition(Gate *gate)
 {
@@ -174,43 +373,51 @@ Gate *negate_condition(Gate *gate)
                 errmsg("Detected prob gate instead of condition gate = %s", _stringify_gate(gate)));
     }
 
+    // TRUE and FALSE are each other's negation
+    if (is_placeholder_type(gate->gate_type))
+    {
+        return truth_gate(gate->gate_type == PLACEHOLDER_FALSE);
+    }
+
+    check_stack_depth();
+
+    Gate *result = alloc_gates(1);
+    *result = *gate;
+
     if (gate->gate_info.condition.condition_type == LESS_THAN_OR_EQUAL)
     {
-        gate->gate_info.condition.condition_type = MORE_THAN;
+        result->gate_info.condition.condition_type = MORE_THAN;
     }
     else if (gate->gate_info.condition.condition_type == LESS_THAN)
     {
-        gate->gate_info.condition.condition_type = MORE_THAN_OR_EQUAL;
+        result->gate_info.condition.condition_type = MORE_THAN_OR_EQUAL;
     }
     else if (gate->gate_info.condition.condition_type == MORE_THAN_OR_EQUAL)
     {
-        gate->gate_info.condition.condition_type = LESS_THAN;
+        result->gate_info.condition.condition_type = LESS_THAN;
     }
     else if (gate->gate_info.condition.condition_type == MORE_THAN)
     {
-        gate->gate_info.condition.condition_type = LESS_THAN_OR_EQUAL;
+        result->gate_info.condition.condition_type = LESS_THAN_OR_EQUAL;
     }
     else if (gate->gate_info.condition.condition_type == EQUAL_TO)
     {
-        gate->gate_info.condition.condition_type = NOT_EQUAL_TO;
+        result->gate_info.condition.condition_type = NOT_EQUAL_TO;
     }
     else if (gate->gate_info.condition.condition_type == NOT_EQUAL_TO)
     {
-        gate->gate_info.condition.condition_type = EQUAL_TO;
-    }
-    else if (gate->gate_info.condition.condition_type == AND)
-    {
-        // By DeMorgan's law, !(A && B) = !A || !B
-        gate->gate_info.condition.condition_type = OR;
-        gate->gate_info.condition.left_gate = negate_condition(gate->gate_info.condition.left_gate);
-        gate->gate_info.condition.right_gate = negate_condition(gate->gate_info.condition.right_gate);
+        result->gate_info.condition.condition_type = EQUAL_TO;
     }
-    else if (gate->gate_info.condition.condition_type == OR)
+    else if (gate->gate_info.condition.condition_type == AND || gate->gate_info.condition.condition_type == OR)
     {
-        // By DeMorgan's law, !(A || B) = !A && !B
-        gate->gate_info.condition.condition_type = AND;
-        gate->gate_info.condition.left_gate = negate_condition(gate->gate_info.condition.left_gate);
-        gate->gate_info.condition.right_gate = negate_condition(gate->gate_info.condition.right_gate);
+        // By DeMorgan's law, !(A && B && ...) = !A || !B || ... and !(A || B || ...) = !A && !B && ...
+        const int count = gate->gate_info.condition.num_operands;
+        result->gate_info.condition.condition_type = gate->gate_info.condition.condition_type == AND ? OR : AND;
+        result->gate_info.condition.operands = alloc_gate_operands(count);
+        for (int i = 0; i < count; ++i)
+        {
+            result->gate_info.condition.operands[i] = negate_condition(gate->gate_info.condition.operands[i]);
+        }
     }
     else
     {
@@ -220,6 +427,6 @@ Gate *negate_condition(Gate *gate)
                 errmsg("Unrecognised condition type"));
     }
 
-    return gate;
+    return result;
 }
 #endif
\ No newline at end of file
@@ -1,9 +0,0 @@
-// Use this file to get the size of Gate, when it changes
-#include <stdbool.h>
-#include "structs.h"
-#include <stdio.h>
-
-int main() {
-    printf("gate type: %lu", sizeof(Gate));
-    return 0;
-}
\ No newline at end of file
@@ -0,0 +1,146 @@
+// Methods for indexing gates with GiST, by the interval that each gate is
+// likely to fall in.
+#ifndef INDEX_H
+#define INDEX_H
+#include "support.h"
+
+#include "postgres.h"
+#include "access/gist.h"
+#include "access/stratnum.h"
+#include <math.h>
+
+// Strategy numbers of the GiST operator class: the likely-comparison operators
+// ?<, ?<=, ?=, ?>= and ?>, in this order.
+#define LIKELY_LESS_STRATEGY 1
+#define LIKELY_LESS_OR_EQUAL_STRATEGY 2
+#define LIKELY_EQUAL_STRATEGY 3
+#define LIKELY_MORE_OR_EQUAL_STRATEGY 4
+#define LIKELY_MORE_STRATEGY 5
+
+/**
+ * @brief Whether X ? Y can hold while X and Y both stay within their likely
+ * intervals. When it cannot, it holds with a negligible probability. The test
+ * only looks at one end of X's interval, or at both for ?=, so it also holds for
+ * an interval that contains X's, i.e. for the union kept in an inner GiST page.
+ *
+ * @param strategy The comparison, as a strategy number
+ * @param x The likely interval of X
+ * @param y The likely interval of Y
+ * @return bool false if the comparison is negligible
+ */
+bool likely_intervals_may_compare(StrategyNumber strategy, support_interval x, support_interval y)
+{
+    switch (strategy)
+    {
+    case LIKELY_LESS_STRATEGY:
+        return x.lower < y.upper;
+    case LIKELY_LESS_OR_EQUAL_STRATEGY:
+        return x.lower <= y.upper;
+    case LIKELY_EQUAL_STRATEGY:
+        return x.lower <= y.upper && x.upper >= y.lower;
+    case LIKELY_MORE_OR_EQUAL_STRATEGY:
+        return x.upper >= y.lower;
+    case LIKELY_MORE_STRATEGY:
+        return x.upper > y.lower;
+    default:
+        ereport(ERROR,
+                errcode(ERRCODE_INTERNAL_ERROR),
+                errmsg("Unrecognised strategy number %d for gate GiST index", strategy));
+    }
+    return false;
+}
+
+// The smallest interval that holds both intervals.
+static inline support_interval union_intervals(support_interval x, support_interval y)
+{
+    support_interval result = {Min(x.lower, y.lower), Max(x.upper, y.upper)};
+    return result;
+}
+
+// How much longer an interval has to get to hold another one. Ends that are
+// already infinite do not grow.
+static inline double interval_enlargement(support_interval original, support_interval added)
+{
+    double result = 0;
+    if (added.lower < original.lower)
+    {
+        result += original.lower - added.lower;
+    }
+    if (added.upper > original.upper)
+    {
+        result += added.upper - original.upper;
+    }
+    return result;
+}
+
+// An entry of a page being split, with where it is on the page.
+typedef struct
+{
+    OffsetNumber offset;
+    support_interval interval;
+} gist_split_entry;
+
+// Orders entries by lower end, then by upper end.
+static int compare_gist_split_entries(const void *a, const void *b)
+{
+    const support_interval x = ((const gist_split_entry *)a)->interval;
+    const support_interval y = ((const gist_split_entry *)b)->interval;
+
+    if (x.lower != y.lower)
+    {
+        return x.lower < y.lower ? -1 : 1;
+    }
+    if (x.upper != y.upper)
+    {
+        return x.upper < y.upper ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Split the entries of a full GiST page in two halves, the entries with
+ * the lowest intervals on the left. Intervals are one dimensional, so sorting
+ * keeps the two halves from overlapping more than the entries force them to.
+ *
+ * @param entryvec The entries of the page
+ * @param split Receives the split
+ */
+void split_gist_intervals(GistEntryVector *entryvec, GIST_SPLITVEC *split)
+{
+    const OffsetNumber maxoff = entryvec->n - 1;
+    const int count = maxoff - FirstOffsetNumber + 1;
+    gist_split_entry *entries = (gist_split_entry *)palloc(count * sizeof(gist_split_entry));
+
+    for (OffsetNumber i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+    {
+        entries[i - FirstOffsetNumber].offset = i;
+        entries[i - FirstOffsetNumber].interval = *(support_interval *)DatumGetPointer(entryvec->vector[i].key);
+    }
+    qsort(entries, count, sizeof(gist_split_entry), compare_gist_split_entries);
+
+    support_interval *left = (support_interval *)palloc(sizeof(support_interval));
+    support_interval *right = (support_interval *)palloc(sizeof(support_interval));
+    split->spl_left = (OffsetNumber *)palloc(count * sizeof(OffsetNumber));
+    split->spl_right = (OffsetNumber *)palloc(count * sizeof(OffsetNumber));
+    split->spl_nleft = 0;
+    split->spl_nright = 0;
+
+    for (int k = 0; k < count; ++k)
+    {
+        if (k < count / 2)
+        {
+            *left = k == 0 ? entries[k].interval : union_intervals(*left, entries[k].interval);
+            split->spl_left[split->spl_nleft++] = entries[k].offset;
+        }
+        else
+        {
+            *right = k == count / 2 ? entries[k].interval : union_intervals(*right, entries[k].interval);
+            split->spl_right[split->spl_nright++] = entries[k].offset;
+        }
+    }
+
+    split->spl_ldatum = PointerGetDatum(left);
+    split->spl_rdatum = PointerGetDatum(right);
+    pfree(entries);
+}
+#endif
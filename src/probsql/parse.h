@@ -0,0 +1,678 @@
+// Methods for reading a circuit from its textual representation.
+#ifndef PARSE_H
+#define PARSE_H
+#include "enums.h"
+#include "structs.h"
+#include "gate.h"
+#include "serialize.h"
+#include "simplify.h"
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include <ctype.h>
+
+// The kinds of tokens in the text of a gate.
+typedef enum
+{
+    TOKEN_END,
+    TOKEN_NUMBER,    // e.g. 1.5 or 1e-3
+    TOKEN_NAME,      // e.g. gaussian or TRUE
+    TOKEN_REFERENCE, // e.g. #3
+    TOKEN_SYMBOL     // e.g. ( or <=
+} gate_token_type;
+
+typedef struct
+{
+    gate_token_type type;
+
+    // Where the token is in the text.
+    const char *start;
+    int length;
+
+    // The value of a number, or the number of a reference.
+    double number;
+} gate_token;
+
+// An operator as it is written between its operands, e.g. x <= y.
+typedef struct
+{
+    const char *symbol;
+    gate_type gate_type;
+    int32 tag;
+} gate_operator;
+
+static const gate_operator comparison_operators[] = {
+    {"<=", CONDITION, LESS_THAN_OR_EQUAL},
+    {">=", CONDITION, MORE_THAN_OR_EQUAL},
+    {"==", CONDITION, EQUAL_TO},
+    {"!=", CONDITION, NOT_EQUAL_TO},
+    {"<", CONDITION, LESS_THAN},
+    {">", CONDITION, MORE_THAN},
+};
+
+static const gate_operator additive_operators[] = {
+    {"+", COMPOSITE_VARIABLE, PLUS},
+    {"-", COMPOSITE_VARIABLE, MINUS},
+};
+
+static const gate_operator multiplicative_operators[] = {
+    {"*", COMPOSITE_VARIABLE, TIMES},
+    {"/", COMPOSITE_VARIABLE, DIVIDE},
+};
+
+// Aggregates are written as calls instead, e.g. sum(x, y).
+static const gate_operator aggregate_operators[] = {
+    {"max", COMPOSITE_VARIABLE, MAX},
+    {"min", COMPOSITE_VARIABLE, MIN},
+    {"count", COMPOSITE_VARIABLE, COUNT},
+    {"sum", COMPOSITE_VARIABLE, SUM},
+};
+
+// Symbols of two characters. Any other symbol is one character long.
+static const char *const two_character_symbols[] = {"<=", ">=", "==", "!=", "&&", "||"};
+
+/*
+ * The state of a parse. The circuit is built straight into its serialized form,
+ * one gate at a time, so nothing is allocated per gate beyond the builder's
+ * growing array.
+ */
+typedef struct
+{
+    const char *literal;
+    const char *cursor;
+
+    // The next token, not yet consumed.
+    gate_token token;
+
+    GateBuilder builder;
+
+    // The position in the circuit of every numbered gate, #1 first.
+    int32 *references;
+    int32 num_references;
+    int32 capacity;
+} gate_parser;
+
+static void gate_parse_error(gate_parser *parser, const char *expected)
+{
+    ereport(ERROR,
+            errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+            errmsg("invalid input syntax for type gate: \"%s\"", parser->literal),
+            errdetail("Expected %s at character %d.", expected, (int)(parser->token.start - parser->literal) + 1));
+}
+
+// Reads the next token into parser->token.
+static void next_gate_token(gate_parser *parser)
+{
+    const char *p = parser->cursor;
+    while (isspace((unsigned char)*p))
+    {
+        ++p;
+    }
+
+    gate_token *token = &parser->token;
+    token->start = p;
+    token->number = 0;
+
+    if (*p == '\0')
+    {
+        token->type = TOKEN_END;
+        token->length = 0;
+        parser->cursor = p;
+        return;
+    }
+
+    if (*p == '#' && isdigit((unsigned char)p[1]))
+    {
+        char *end;
+        token->type = TOKEN_REFERENCE;
+        token->number = strtol(p + 1, &end, 10);
+        token->length = end - p;
+        parser->cursor = end;
+        return;
+    }
+
+    // Numbers, including the words strtod knows, such as NaN and Infinity. Signs
+    // are left to the parser, so that x-1 is a subtraction.
+    if (*p != '+' && *p != '-')
+    {
+        char *end;
+        const double number = strtod(p, &end);
+        if (end > p && !isalnum((unsigned char)*end) && *end != '_')
+        {
+            token->type = TOKEN_NUMBER;
+            token->number = number;
+            token->length = end - p;
+            parser->cursor = end;
+            return;
+        }
+    }
+
+    if (isalpha((unsigned char)*p) || *p == '_')
+    {
+        const char *end = p;
+        while (isalnum((unsigned char)*end) || *end == '_')
+        {
+            ++end;
+        }
+        token->type = TOKEN_NAME;
+        token->length = end - p;
+        parser->cursor = end;
+        return;
+    }
+
+    token->type = TOKEN_SYMBOL;
+    token->length = 1;
+    for (int i = 0; i < lengthof(two_character_symbols); ++i)
+    {
+        if (strncmp(p, two_character_symbols[i], 2) == 0)
+        {
+            token->length = 2;
+            break;
+        }
+    }
+    parser->cursor = p + token->length;
+}
+
+// Whether the next token is the given symbol.
+static bool gate_token_is(gate_parser *parser, const char *symbol)
+{
+    return parser->token.type == TOKEN_SYMBOL && parser->token.length == strlen(symbol) &&
+           strncmp(parser->token.start, symbol, parser->token.length) == 0;
+}
+
+// Whether the next token is the given name, in any case.
+static bool gate_token_is_name(gate_parser *parser, const char *name)
+{
+    return parser->token.type == TOKEN_NAME && parser->token.length == strlen(name) &&
+           pg_strncasecmp(parser->token.start, name, parser->token.length) == 0;
+}
+
+// Consumes the given symbol, which must come next.
+static void expect_gate_symbol(gate_parser *parser, const char *symbol)
+{
+    if (!gate_token_is(parser, symbol))
+    {
+        gate_parse_error(parser, psprintf("\"%s\"", symbol));
+    }
+    next_gate_token(parser);
+}
+
+// The operator of a table that comes next, if any. It is consumed.
+static const gate_operator *match_gate_operator(gate_parser *parser, const gate_operator *operators, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        if (gate_token_is(parser, operators[i].symbol))
+        {
+            next_gate_token(parser);
+            return &operators[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Add a base variable to the circuit being parsed.
+ *
+ * @param parser The parse
+ * @param tag The distribution
+ * @param parameters Its parameters
+ * @param variable_id Its id, or NULL for a constant, which has the nil id
+ * @return int32 Its position in the circuit
+ */
+static int32 add_parsed_base_variable(gate_parser *parser, int32 tag, base_variable_parameters parameters,
+                                      const pg_uuid_t *variable_id)
+{
+    serialized_gate_node node;
+    memset(&node, 0, sizeof(serialized_gate_node));
+    node.gate_type = BASE_VARIABLE;
+    node.tag = tag;
+    node.left = -1;
+    node.right = -1;
+    node.parameters = parameters;
+    if (variable_id != NULL)
+    {
+        node.variable_id = *variable_id;
+    }
+    return intern_gate_node(&parser->builder, &node);
+}
+
+static int32 add_parsed_constant(gate_parser *parser, double value)
+{
+    base_variable_parameters parameters;
+    memset(&parameters, 0, sizeof(base_variable_parameters));
+    parameters.gaussian_parameters.mean = value;
+    return add_parsed_base_variable(parser, GAUSSIAN, parameters, NULL);
+}
+
+// The value of a hexadecimal digit, or -1 if it is none.
+static int hex_digit_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief The id of a base variable that was just parsed. gate_out writes it after
+ * an @, e.g. gaussian(1, 2)@01234567-89ab-cdef-0123-456789abcdef, and then the
+ * variable is the same as everywhere else the id is written. Without an id, the
+ * variable is a new draw.
+ *
+ * @param parser The parse
+ * @return pg_uuid_t The id
+ */
+static pg_uuid_t parse_variable_id(gate_parser *parser)
+{
+    if (!gate_token_is(parser, "@"))
+    {
+        return new_variable_id();
+    }
+
+    // The id is not made of tokens, so it is read straight from the text after the @.
+    const char *p = parser->cursor;
+    pg_uuid_t id;
+    for (int i = 0; i < UUID_LEN; ++i)
+    {
+        if ((i == 4 || i == 6 || i == 8 || i == 10) && *p == '-')
+        {
+            ++p;
+        }
+
+        const int high = hex_digit_value(p[0]);
+        const int low = high < 0 ? -1 : hex_digit_value(p[1]);
+        if (low < 0)
+        {
+            gate_parse_error(parser, "a variable id after \"@\"");
+        }
+        id.data[i] = (high << 4) | low;
+        p += 2;
+    }
+
+    parser->cursor = p;
+    next_gate_token(parser);
+    return id;
+}
+
+// Adds a gate with two operands, after checking that they are of the right kind.
+static int32 add_parsed_operation(gate_parser *parser, const gate_operator *opr, int32 left, int32 right)
+{
+    const bool operands_are_prob = opr->gate_type == COMPOSITE_VARIABLE || condition_is_comparator(opr->tag);
+    serialized_gate_node *nodes = parser->builder.result->nodes;
+
+    if (is_prob_type(nodes[left].gate_type) != operands_are_prob ||
+        is_prob_type(nodes[right].gate_type) != operands_are_prob)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                errmsg("invalid input syntax for type gate: \"%s\"", parser->literal),
+                errdetail("The operands of \"%s\" must be %s gates.", opr->symbol,
+                          operands_are_prob ? "probability" : "condition"));
+    }
+
+    serialized_gate_node node;
+    memset(&node, 0, sizeof(serialized_gate_node));
+    node.gate_type = opr->gate_type;
+    node.tag = opr->tag;
+    node.left = left;
+    node.right = right;
+    return intern_gate_node(&parser->builder, &node);
+}
+
+// A number with an optional sign, as in the parameters of a distribution.
+static double parse_signed_number(gate_parser *parser)
+{
+    const bool negative = gate_token_is(parser, "-");
+    if (negative || gate_token_is(parser, "+"))
+    {
+        next_gate_token(parser);
+    }
+
+    if (parser->token.type != TOKEN_NUMBER)
+    {
+        gate_parse_error(parser, "a number");
+    }
+
+    const double number = parser->token.number;
+    next_gate_token(parser);
+    return negative ? -number : number;
+}
+
+static int32 parse_gate_disjunction(gate_parser *parser);
+
+// primary := number | #n | ( expression ) | TRUE | FALSE
+//          | gaussian(number, number)[@id] | poisson(number)[@id] | max|min|count|sum(expression, expression)
+static int32 parse_gate_primary(gate_parser *parser)
+{
+    gate_token token = parser->token;
+
+    if (token.type == TOKEN_NUMBER)
+    {
+        next_gate_token(parser);
+        return add_parsed_constant(parser, token.number);
+    }
+
+    if (token.type == TOKEN_REFERENCE)
+    {
+        if (token.number < 1 || token.number > parser->num_references)
+        {
+            gate_parse_error(parser, "a gate that is already defined");
+        }
+        next_gate_token(parser);
+        return parser->references[(int32)token.number - 1];
+    }
+
+    if (gate_token_is(parser, "("))
+    {
+        next_gate_token(parser);
+        const int32 result = parse_gate_disjunction(parser);
+        expect_gate_symbol(parser, ")");
+        return result;
+    }
+
+    if (token.type != TOKEN_NAME)
+    {
+        gate_parse_error(parser, "a gate");
+    }
+
+    if (gate_token_is_name(parser, "TRUE") || gate_token_is_name(parser, "FALSE"))
+    {
+        serialized_gate_node node;
+        set_truth_node(&node, gate_token_is_name(parser, "TRUE"));
+        next_gate_token(parser);
+        return intern_gate_node(&parser->builder, &node);
+    }
+
+    if (gate_token_is_name(parser, "gaussian"))
+    {
+        base_variable_parameters parameters;
+        memset(&parameters, 0, sizeof(base_variable_parameters));
+        next_gate_token(parser);
+        expect_gate_symbol(parser, "(");
+        parameters.gaussian_parameters.mean = parse_signed_number(parser);
+        expect_gate_symbol(parser, ",");
+        parameters.gaussian_parameters.stddev = parse_signed_number(parser);
+        expect_gate_symbol(parser, ")");
+        check_base_variable_parameters(GAUSSIAN, parameters);
+        const pg_uuid_t id = parse_variable_id(parser);
+        return add_parsed_base_variable(parser, GAUSSIAN, parameters, &id);
+    }
+
+    if (gate_token_is_name(parser, "poisson"))
+    {
+        base_variable_parameters parameters;
+        memset(&parameters, 0, sizeof(base_variable_parameters));
+        next_gate_token(parser);
+        expect_gate_symbol(parser, "(");
+        parameters.poisson_parameters.lambda = parse_signed_number(parser);
+        expect_gate_symbol(parser, ")");
+        check_base_variable_parameters(POISSON, parameters);
+        const pg_uuid_t id = parse_variable_id(parser);
+        return add_parsed_base_variable(parser, POISSON, parameters, &id);
+    }
+
+    for (int i = 0; i < lengthof(aggregate_operators); ++i)
+    {
+        if (gate_token_is_name(parser, aggregate_operators[i].symbol))
+        {
+            next_gate_token(parser);
+            expect_gate_symbol(parser, "(");
+            const int32 left = parse_gate_disjunction(parser);
+            expect_gate_symbol(parser, ",");
+            const int32 right = parse_gate_disjunction(parser);
+            expect_gate_symbol(parser, ")");
+            return add_parsed_operation(parser, &aggregate_operators[i], left, right);
+        }
+    }
+
+    gate_parse_error(parser, "a distribution, an aggregate, TRUE or FALSE");
+    return -1;
+}
+
+// unary := - unary | + unary | primary
+static int32 parse_gate_unary(gate_parser *parser)
+{
+    if (gate_token_is(parser, "+"))
+    {
+        next_gate_token(parser);
+        return parse_gate_unary(parser);
+    }
+
+    if (gate_token_is(parser, "-"))
+    {
+        static const gate_operator minus = {"-", COMPOSITE_VARIABLE, MINUS};
+        next_gate_token(parser);
+
+        // Negative numbers stay constants; anything else is 0 - x, as the - operator does.
+        if (parser->token.type == TOKEN_NUMBER)
+        {
+            const double number = parser->token.number;
+            next_gate_token(parser);
+            return add_parsed_constant(parser, -number);
+        }
+
+        const int32 operand = parse_gate_unary(parser);
+        return add_parsed_operation(parser, &minus, add_parsed_constant(parser, 0), operand);
+    }
+
+    return parse_gate_primary(parser);
+}
+
+// multiplicative := unary ((* | /) unary)*
+static int32 parse_gate_multiplicative(gate_parser *parser)
+{
+    int32 result = parse_gate_unary(parser);
+    const gate_operator *opr;
+
+    while ((opr = match_gate_operator(parser, multiplicative_operators, lengthof(multiplicative_operators))) != NULL)
+    {
+        result = add_parsed_operation(parser, opr, result, parse_gate_unary(parser));
+    }
+    return result;
+}
+
+// additive := multiplicative ((+ | -) multiplicative)*
+static int32 parse_gate_additive(gate_parser *parser)
+{
+    int32 result = parse_gate_multiplicative(parser);
+    const gate_operator *opr;
+
+    while ((opr = match_gate_operator(parser, additive_operators, lengthof(additive_operators))) != NULL)
+    {
+        result = add_parsed_operation(parser, opr, result, parse_gate_multiplicative(parser));
+    }
+    return result;
+}
+
+// comparison := additive [(< | <= | > | >= | == | !=) additive]
+static int32 parse_gate_comparison(gate_parser *parser)
+{
+    const int32 result = parse_gate_additive(parser);
+    const gate_operator *opr = match_gate_operator(parser, comparison_operators, lengthof(comparison_operators));
+
+    if (opr == NULL)
+    {
+        return result;
+    }
+    return add_parsed_operation(parser, opr, result, parse_gate_additive(parser));
+}
+
+// The operands of an && or || chain, as they are parsed.
+typedef struct
+{
+    int32 *positions;
+    int count;
+    int capacity;
+} parsed_operands;
+
+static void add_parsed_operand(parsed_operands *operands, int32 position)
+{
+    if (operands->count == operands->capacity)
+    {
+        operands->capacity *= 2;
+        operands->positions = (int32 *)repalloc(operands->positions, operands->capacity * sizeof(int32));
+    }
+    operands->positions[operands->count++] = position;
+}
+
+/**
+ * @brief Parse a chain of operands joined by && or ||, and add it as a single
+ * AND or OR gate with all of them.
+ *
+ * @param parser The parse
+ * @param opr The operator that joins the operands
+ * @param parse_operand Parses one operand
+ * @return int32 The position of the gate, or of the operand if there is only one
+ */
+static int32 parse_gate_junction(gate_parser *parser, const gate_operator *opr, int32 (*parse_operand)(gate_parser *))
+{
+    const int32 first = parse_operand(parser);
+    if (!gate_token_is(parser, opr->symbol))
+    {
+        return first;
+    }
+
+    parsed_operands operands;
+    operands.count = 0;
+    operands.capacity = 4;
+    operands.positions = (int32 *)palloc(operands.capacity * sizeof(int32));
+    add_parsed_operand(&operands, first);
+
+    while (gate_token_is(parser, opr->symbol))
+    {
+        next_gate_token(parser);
+        add_parsed_operand(&operands, parse_operand(parser));
+    }
+
+    for (int i = 0; i < operands.count; ++i)
+    {
+        if (is_prob_type(parser->builder.result->nodes[operands.positions[i]].gate_type))
+        {
+            ereport(ERROR,
+                    errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                    errmsg("invalid input syntax for type gate: \"%s\"", parser->literal),
+                    errdetail("The operands of \"%s\" must be condition gates.", opr->symbol));
+        }
+    }
+
+    const int32 result = intern_junction_node(&parser->builder, opr->tag, operands.positions, operands.count);
+    pfree(operands.positions);
+    return result;
+}
+
+// conjunction := comparison (&& comparison)*
+static int32 parse_gate_conjunction(gate_parser *parser)
+{
+    static const gate_operator and_operator = {"&&", CONDITION, AND};
+    return parse_gate_junction(parser, &and_operator, parse_gate_comparison);
+}
+
+// disjunction := conjunction (|| conjunction)*
+static int32 parse_gate_disjunction(gate_parser *parser)
+{
+    static const gate_operator or_operator = {"||", CONDITION, OR};
+
+    // Every ( nests another disjunction.
+    check_stack_depth();
+
+    return parse_gate_junction(parser, &or_operator, parse_gate_conjunction);
+}
+
+/**
+ * @brief Read a gate from its text, in one pass. The text is either an
+ * expression, as the tree output writes it, or a list of numbered gates, as
+ * the dag and exact outputs write it:
+ *
+ *   (gaussian(1.00, 2.00))+(poisson(3.00)) <= 4 && TRUE
+ *   #1 = gaussian(1.00, 2.00); #2 = #1 + #1; #3 = #2 > 0
+ *   #1 = gaussian(0.001, 0.004)@01234567-89ab-cdef-0123-456789abcdef; #2 = #1 + #1
+ *
+ * Arithmetic binds tighter than comparisons, which bind tighter than && and
+ * then ||. A gaussian(...) or poisson(...) followed by @ and an id is the
+ * variable with that id; without one it is a new draw. In a list, gates that
+ * refer to the same number share it. Numbered gates must come in order, and
+ * the last one is the root.
+ *
+ * The exact output of gate_out, its default, reads back as the same gate,
+ * since it writes parameters in full and variables with their ids. The tree
+ * and dag outputs are for display and round parameters to two decimals.
+ *
+ * @param literal The text
+ * @return SerializedGate* The circuit
+ */
+SerializedGate *parse_gate(const char *literal)
+{
+    gate_parser parser;
+    parser.literal = literal;
+    parser.cursor = literal;
+    parser.num_references = 0;
+    parser.capacity = 16;
+    parser.references = (int32 *)palloc(parser.capacity * sizeof(int32));
+    init_gate_builder(&parser.builder, 16);
+
+    int32 root;
+    next_gate_token(&parser);
+
+    if (parser.token.type == TOKEN_REFERENCE)
+    {
+        // #1 = expression; #2 = expression; ... with an optional ; at the end
+        for (;;)
+        {
+            if (parser.token.type != TOKEN_REFERENCE || parser.token.number != parser.num_references + 1)
+            {
+                gate_parse_error(&parser, psprintf("#%d", parser.num_references + 1));
+            }
+            next_gate_token(&parser);
+            expect_gate_symbol(&parser, "=");
+            root = parse_gate_disjunction(&parser);
+
+            if (parser.num_references == parser.capacity)
+            {
+                parser.capacity *= 2;
+                parser.references = (int32 *)repalloc(parser.references, parser.capacity * sizeof(int32));
+            }
+            parser.references[parser.num_references++] = root;
+
+            if (!gate_token_is(&parser, ";"))
+            {
+                break;
+            }
+            next_gate_token(&parser);
+            if (parser.token.type == TOKEN_END)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        root = parse_gate_disjunction(&parser);
+    }
+
+    if (parser.token.type != TOKEN_END)
+    {
+        gate_parse_error(&parser, "the end of the gate");
+    }
+
+    // Drop the numbered gates that the root does not use. A single expression
+    // uses every gate it has, unless an && or || took over the operands of another.
+    SerializedGate *result;
+    if (parser.num_references > 0)
+    {
+        SerializedGate *built = finish_gate_builder(&parser.builder);
+        result = extract_serialized_subgate(built, root);
+        pfree(built);
+    }
+    else
+    {
+        result = finish_gate_builder_at(&parser.builder, root);
+    }
+
+    pfree(parser.references);
+    return result;
+}
+#endif
@@ -0,0 +1,554 @@
+// Methods for computing the exact probability of a condition gate.
+#ifndef PROBABILITY_H
+#define PROBABILITY_H
+#include "enums.h"
+#include "structs.h"
+#include "serialize.h"
+
+#include "postgres.h"
+#include <math.h>
+
+// What is known about the value of a probability gate.
+typedef enum
+{
+    // The gate always has the same value.
+    CONSTANT_VALUE,
+    // The gate is a linear combination of base variables plus a constant.
+    LINEAR_VALUE,
+    // Anything else, e.g. the product of two random variables.
+    NONLINEAR_VALUE
+} value_kind;
+
+// Everything the exact evaluator knows about each gate of a serialized circuit,
+// indexed by position.
+typedef struct
+{
+    SerializedGate *sg;
+
+    // For probability gates: the kind of value, and the value itself if it is constant.
+    value_kind *kinds;
+    double *values;
+
+    // For condition gates: the probability that the condition holds, or NaN if
+    // it has no closed form.
+    double *probabilities;
+
+    // The lowest position in the subcircuit rooted at each gate. Since operands
+    // come before their parents, a subcircuit lives between these two positions.
+    int32 *lowest;
+
+    // Scratch space for walking subcircuits.
+    double *coefs;
+    int32 *reached;
+} probability_context;
+
+// The difference D = L - R of the two sides of a comparator L ? R, when it is
+// the sum of a Gaussian, a Poisson variable and the negation of another Poisson
+// variable, i.e. D = G + N1 - N2. Constants are folded into the Gaussian.
+typedef struct
+{
+    double mean;
+    double variance;
+    double lambda_plus;
+    double lambda_minus;
+} linear_difference;
+
+// Above this many pairs of values of the two Poisson variables of a difference
+// with a Gaussian part, the difference is left to sampling.
+#define MAX_POISSON_DIFFERENCE_PAIRS 1000000
+
+// The cumulative distribution function of the standard normal distribution.
+double normal_cdf(double x)
+{
+    return 0.5 * erfc(-x / M_SQRT2);
+}
+
+/**
+ * @brief The probabilities of a Poisson variable taking each value in a range that
+ * holds all but a negligible amount of its mass.
+ *
+ * @param lambda The mean of the distribution
+ * @param first Receives the first value of the range
+ * @param count Receives the number of values in the range
+ * @return double* The probability of each value, or NULL if lambda is too large
+ */
+double *poisson_pmf(double lambda, int *first, int *count)
+{
+    if (lambda <= 0)
+    {
+        double *pmf = (double *)palloc(sizeof(double));
+        pmf[0] = 1;
+        *first = 0;
+        *count = 1;
+        return pmf;
+    }
+
+    // Far beyond any realistic count, and too many terms to sum.
+    if (lambda > 1e9)
+    {
+        return NULL;
+    }
+
+    const double spread = 12 * sqrt(lambda) + 20;
+    const int lo = (int)Max(0, floor(lambda - spread));
+    const int hi = (int)ceil(lambda + spread);
+
+    double *pmf = (double *)palloc((hi - lo + 1) * sizeof(double));
+    const double log_lambda = log(lambda);
+    for (int k = lo; k <= hi; ++k)
+    {
+        // Computed in log space, so that large lambdas do not overflow.
+        pmf[k - lo] = exp(k * log_lambda - lambda - lgamma(k + 1.0));
+    }
+
+    *first = lo;
+    *count = hi - lo + 1;
+    return pmf;
+}
+
+/**
+ * @brief Compute P(D < 0) and P(D = 0) for a linear difference.
+ *
+ * @param diff The difference
+ * @param below Receives P(D < 0)
+ * @param at Receives P(D = 0)
+ * @return bool false if the difference is too large to evaluate numerically
+ */
+bool difference_distribution(linear_difference *diff, double *below, double *at)
+{
+    const double stddev = sqrt(diff->variance);
+    *below = 0;
+    *at = 0;
+
+    // Closed form: a Gaussian, or a constant.
+    if (diff->lambda_plus <= 0 && diff->lambda_minus <= 0)
+    {
+        if (stddev > 0)
+        {
+            *below = normal_cdf(-diff->mean / stddev);
+        }
+        else
+        {
+            *below = diff->mean < 0 ? 1 : 0;
+            *at = diff->mean == 0 ? 1 : 0;
+        }
+        return true;
+    }
+
+    // Otherwise, sum over the values M = N1 - N2 of the Poisson part.
+    int plus_first, plus_count, minus_first, minus_count;
+    double *plus = poisson_pmf(diff->lambda_plus, &plus_first, &plus_count);
+    double *minus = poisson_pmf(diff->lambda_minus, &minus_first, &minus_count);
+    if (plus == NULL || minus == NULL)
+    {
+        return false;
+    }
+
+    if (stddev > 0)
+    {
+        // Each value of M needs a normal_cdf, and there are as many of them as there
+        // are pairs of values of N1 and N2 to find their probabilities from.
+        if ((double)plus_count * minus_count > MAX_POISSON_DIFFERENCE_PAIRS)
+        {
+            pfree(plus);
+            pfree(minus);
+            return false;
+        }
+
+        // The distribution of M, from its lowest value up.
+        const int lowest = plus_first - (minus_first + minus_count - 1);
+        const int span = plus_count + minus_count - 1;
+        double *difference = (double *)palloc0(span * sizeof(double));
+        for (int a = 0; a < plus_count; ++a)
+        {
+            for (int b = 0; b < minus_count; ++b)
+            {
+                difference[a - b + minus_count - 1] += plus[a] * minus[b];
+            }
+        }
+
+        for (int k = 0; k < span; ++k)
+        {
+            *below += difference[k] * normal_cdf(-(diff->mean + lowest + k) / stddev);
+        }
+        pfree(difference);
+    }
+    else
+    {
+        // D = mean + N1 - N2 is below 0 when N2 > N1 + mean, and at 0 when N2 = N1 + mean,
+        // so one pass over N1 with the tail sums of N2 is enough.
+        double *tail = (double *)palloc((minus_count + 1) * sizeof(double));
+        tail[minus_count] = 0;
+        for (int b = minus_count - 1; b >= 0; --b)
+        {
+            tail[b] = tail[b + 1] + minus[b];
+        }
+
+        const bool integral = floor(diff->mean) == diff->mean;
+        for (int a = 0; a < plus_count; ++a)
+        {
+            const double bound = plus_first + a + diff->mean - minus_first;
+            const double first_above = floor(bound) + 1;
+            const int b = first_above <= 0 ? 0 : (first_above >= minus_count ? minus_count : (int)first_above);
+            *below += plus[a] * tail[b];
+
+            if (integral && bound >= 0 && bound < minus_count)
+            {
+                *at += plus[a] * minus[(int)bound];
+            }
+        }
+        pfree(tail);
+    }
+
+    pfree(plus);
+    pfree(minus);
+    return true;
+}
+
+/**
+ * @brief Write L - R as a linear difference, by pushing coefficients from the two
+ * operands down to the base variables. Shared operands simply collect the
+ * coefficients of all their parents, so X - X cancels out exactly.
+ *
+ * @param ctx The evaluator state
+ * @param left The position of L
+ * @param right The position of R
+ * @param diff Receives the difference
+ * @return bool false if the difference is not a sum of a Gaussian and two Poissons
+ */
+bool collect_linear_difference(probability_context *ctx, int32 left, int32 right, linear_difference *diff)
+{
+    SerializedGate *sg = ctx->sg;
+    double *coefs = ctx->coefs;
+    const int32 top = Max(left, right);
+    const int32 bottom = Min(ctx->lowest[left], ctx->lowest[right]);
+
+    memset(coefs + bottom, 0, (top - bottom + 1) * sizeof(double));
+    memset(diff, 0, sizeof(linear_difference));
+    coefs[left] += 1;
+    coefs[right] -= 1;
+
+    // Parents always come after their operands, so every coefficient is final by
+    // the time its gate is reached.
+    for (int32 j = top; j >= bottom; --j)
+    {
+        const double c = coefs[j];
+        if (c == 0)
+        {
+            continue;
+        }
+
+        serialized_gate_node *node = &sg->nodes[j];
+        if (ctx->kinds[j] == CONSTANT_VALUE)
+        {
+            diff->mean += c * ctx->values[j];
+            continue;
+        }
+
+        if (node->gate_type == BASE_VARIABLE)
+        {
+            if (node->tag == GAUSSIAN)
+            {
+                const double stddev = node->parameters.gaussian_parameters.stddev;
+                diff->mean += c * node->parameters.gaussian_parameters.mean;
+                diff->variance += c * c * stddev * stddev;
+            }
+            else if (c == 1)
+            {
+                diff->lambda_plus += node->parameters.poisson_parameters.lambda;
+            }
+            else if (c == -1)
+            {
+                diff->lambda_minus += node->parameters.poisson_parameters.lambda;
+            }
+            else
+            {
+                // A scaled Poisson variable is no longer Poisson.
+                return false;
+            }
+            continue;
+        }
+
+        switch (node->tag)
+        {
+        case PLUS:
+        case SUM:
+            coefs[node->left] += c;
+            coefs[node->right] += c;
+            break;
+        case MINUS:
+            coefs[node->left] += c;
+            coefs[node->right] -= c;
+            break;
+        case TIMES:
+            if (ctx->kinds[node->left] == CONSTANT_VALUE)
+            {
+                coefs[node->right] += c * ctx->values[node->left];
+            }
+            else
+            {
+                coefs[node->left] += c * ctx->values[node->right];
+            }
+            break;
+        case DIVIDE:
+            coefs[node->left] += c / ctx->values[node->right];
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Marks a gate in share_random_variables that is reached from more than one subcircuit.
+#define REACHED_FROM_SEVERAL (-1)
+
+/**
+ * @brief Check whether any two of some subcircuits depend on a common random variable.
+ *
+ * @param ctx The evaluator state
+ * @param roots The positions of the subcircuits
+ * @param count The number of subcircuits
+ * @return bool true if some non-constant base variable is reachable from two of them
+ */
+bool share_random_variables(probability_context *ctx, const int32 *roots, int count)
+{
+    SerializedGate *sg = ctx->sg;
+    const int32 *operand_list = SERIALIZED_GATE_OPERANDS(sg);
+    int32 *reached = ctx->reached;
+    int32 top = roots[0];
+    int32 bottom = ctx->lowest[roots[0]];
+
+    for (int k = 1; k < count; ++k)
+    {
+        top = Max(top, roots[k]);
+        bottom = Min(bottom, ctx->lowest[roots[k]]);
+    }
+
+    // Every gate is marked with the subcircuit it is reached from, counting from 1.
+    memset(reached + bottom, 0, (top - bottom + 1) * sizeof(int32));
+    for (int k = 0; k < count; ++k)
+    {
+        reached[roots[k]] = reached[roots[k]] == 0 ? k + 1 : REACHED_FROM_SEVERAL;
+    }
+
+    for (int32 j = top; j >= bottom; --j)
+    {
+        if (reached[j] == 0)
+        {
+            continue;
+        }
+
+        serialized_gate_node *node = &sg->nodes[j];
+        const int32 *operands;
+        const int32 num_operands = gate_node_operands(operand_list, node, &operands);
+
+        if (num_operands == 0)
+        {
+            if (node->gate_type == BASE_VARIABLE && ctx->kinds[j] != CONSTANT_VALUE && reached[j] == REACHED_FROM_SEVERAL)
+            {
+                return true;
+            }
+            continue;
+        }
+
+        for (int32 k = 0; k < num_operands; ++k)
+        {
+            const int32 o = operands[k];
+            reached[o] = reached[o] == 0 || reached[o] == reached[j] ? reached[j] : REACHED_FROM_SEVERAL;
+        }
+    }
+
+    return false;
+}
+
+// Works out the kind of value of a probability gate from its operands.
+void evaluate_prob_gate(probability_context *ctx, int32 i)
+{
+    serialized_gate_node *node = &ctx->sg->nodes[i];
+
+    if (node->gate_type == BASE_VARIABLE)
+    {
+        // A Gaussian without spread is a constant.
+        if (node->tag == GAUSSIAN && node->parameters.gaussian_parameters.stddev == 0)
+        {
+            ctx->kinds[i] = CONSTANT_VALUE;
+            ctx->values[i] = node->parameters.gaussian_parameters.mean;
+        }
+        else
+        {
+            ctx->kinds[i] = LINEAR_VALUE;
+        }
+        return;
+    }
+
+    const value_kind left = ctx->kinds[node->left];
+    const value_kind right = ctx->kinds[node->right];
+    const double x = ctx->values[node->left];
+    const double y = ctx->values[node->right];
+
+    if (left == CONSTANT_VALUE && right == CONSTANT_VALUE &&
+        fold_constant_composition(x, y, node->tag, &ctx->values[i]))
+    {
+        ctx->kinds[i] = CONSTANT_VALUE;
+        return;
+    }
+
+    if (left == NONLINEAR_VALUE || right == NONLINEAR_VALUE)
+    {
+        ctx->kinds[i] = NONLINEAR_VALUE;
+        return;
+    }
+
+    switch (node->tag)
+    {
+    case PLUS:
+    case MINUS:
+    case SUM:
+        ctx->kinds[i] = LINEAR_VALUE;
+        break;
+    case TIMES:
+        ctx->kinds[i] = (left == CONSTANT_VALUE || right == CONSTANT_VALUE) ? LINEAR_VALUE : NONLINEAR_VALUE;
+        break;
+    case DIVIDE:
+        ctx->kinds[i] = (right == CONSTANT_VALUE && y != 0) ? LINEAR_VALUE : NONLINEAR_VALUE;
+        break;
+    default:
+        ctx->kinds[i] = NONLINEAR_VALUE;
+    }
+}
+
+// Works out the probability of a condition gate from its operands.
+void evaluate_condition_gate(probability_context *ctx, int32 i)
+{
+    serialized_gate_node *node = &ctx->sg->nodes[i];
+
+    if (is_placeholder_type(node->gate_type))
+    {
+        ctx->probabilities[i] = node->gate_type == PLACEHOLDER_TRUE;
+        return;
+    }
+
+    ctx->probabilities[i] = NAN;
+
+    if (condition_is_comparator(node->tag))
+    {
+        linear_difference diff;
+        double below, at;
+
+        if (ctx->kinds[node->left] == NONLINEAR_VALUE || ctx->kinds[node->right] == NONLINEAR_VALUE ||
+            !collect_linear_difference(ctx, node->left, node->right, &diff) ||
+            !difference_distribution(&diff, &below, &at))
+        {
+            return;
+        }
+
+        switch (node->tag)
+        {
+        case LESS_THAN:
+            ctx->probabilities[i] = below;
+            break;
+        case LESS_THAN_OR_EQUAL:
+            ctx->probabilities[i] = below + at;
+            break;
+        case MORE_THAN:
+            ctx->probabilities[i] = 1 - below - at;
+            break;
+        case MORE_THAN_OR_EQUAL:
+            ctx->probabilities[i] = 1 - below;
+            break;
+        case EQUAL_TO:
+            ctx->probabilities[i] = at;
+            break;
+        case NOT_EQUAL_TO:
+            ctx->probabilities[i] = 1 - at;
+            break;
+        }
+
+        // Keep rounding errors of the sums inside [0, 1]
+        ctx->probabilities[i] = Min(1, Max(0, ctx->probabilities[i]));
+        return;
+    }
+
+    // An AND or OR: independent conditions multiply, and dependent ones have no
+    // closed form. Operands are never repeated, so each one counts once.
+    const int32 *operands = SERIALIZED_GATE_OPERANDS(ctx->sg) + node->left;
+    double product = 1;
+
+    for (int32 k = 0; k < node->right; ++k)
+    {
+        const double p = ctx->probabilities[operands[k]];
+        if (isnan(p))
+        {
+            return;
+        }
+        product *= node->tag == AND ? p : 1 - p;
+    }
+
+    if (share_random_variables(ctx, operands, node->right))
+    {
+        return;
+    }
+
+    ctx->probabilities[i] = node->tag == AND ? product : 1 - product;
+}
+
+/**
+ * @brief Compute the probability that a condition gate holds, using closed forms:
+ * linear combinations of Gaussians are Gaussian, sums of Poissons are Poisson,
+ * and conditions on disjoint sets of variables are independent. Comparisons that
+ * mix Gaussians and Poissons are summed numerically over the Poisson values.
+ *
+ * @param sg The serialized condition gate
+ * @param result Receives the probability
+ * @return bool false if some part of the circuit has no closed form
+ */
+bool exact_probability(SerializedGate *sg, double *result)
+{
+    const int32 n = sg->num_nodes;
+    probability_context ctx;
+    ctx.sg = sg;
+    ctx.kinds = (value_kind *)palloc(n * sizeof(value_kind));
+    ctx.values = (double *)palloc0(n * sizeof(double));
+    ctx.probabilities = (double *)palloc(n * sizeof(double));
+    ctx.lowest = (int32 *)palloc(n * sizeof(int32));
+    ctx.coefs = (double *)palloc(n * sizeof(double));
+    ctx.reached = (int32 *)palloc(n * sizeof(int32));
+
+    // Operands always come first, so one pass in storage order sees every
+    // operand before the gates that use it.
+    for (int32 i = 0; i < n; ++i)
+    {
+        serialized_gate_node *node = &sg->nodes[i];
+
+        const int32 *operands;
+        const int32 num_operands = gate_node_operands(SERIALIZED_GATE_OPERANDS(sg), node, &operands);
+        ctx.lowest[i] = i;
+        for (int32 k = 0; k < num_operands; ++k)
+        {
+            ctx.lowest[i] = Min(ctx.lowest[i], ctx.lowest[operands[k]]);
+        }
+
+        if (is_prob_type(node->gate_type))
+        {
+            evaluate_prob_gate(&ctx, i);
+        }
+        else
+        {
+            evaluate_condition_gate(&ctx, i);
+        }
+    }
+
+    *result = ctx.probabilities[n - 1];
+
+    pfree(ctx.kinds);
+    pfree(ctx.values);
+    pfree(ctx.probabilities);
+    pfree(ctx.lowest);
+    pfree(ctx.coefs);
+    pfree(ctx.reached);
+
+    return !isnan(*result);
+}
+#endif
@@ -2,45 +2,140 @@
 CREATE TYPE gate;
 
 -- Declare SQL wrappers around C functions
+-- Every gaussian(...) or poisson(...) that gate_in reads without an @id is a new
+-- draw, so it is VOLATILE.
 CREATE FUNCTION gate_in(cstring)
     RETURNS gate 
     AS 'MODULE_PATHNAME', 'gate_in' 
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
 
 
+-- The text depends on probsql.gate_output, so it is STABLE. By default it is
+-- exact, and reads back as the same gate.
 CREATE FUNCTION gate_out(gate)
     RETURNS cstring
     AS 'MODULE_PATHNAME', 'gate_out'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
 
--- Define the gate type
+CREATE FUNCTION gate_recv(internal)
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'gate_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_send(gate)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'gate_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Define the gate type. A gate holds its whole circuit, so it is variable-length.
 CREATE TYPE gate (
-    internallength = 32,
+    internallength = VARIABLE,
     input = gate_in,
-    output = gate_out
+    output = gate_out,
+    receive = gate_recv,
+    send = gate_send,
+    alignment = double,
+    storage = extended
 );
 
--- Provide a way for constants to get coerced into gates.
+-- Print a gate, cutting off long or deep circuits with "...". 0 means no limit.
+CREATE FUNCTION gate_to_text(gate, max_length int DEFAULT 0, max_depth int DEFAULT 0)
+    RETURNS text
+    AS 'MODULE_PATHNAME', 'gate_to_text'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Print a gate as numbered gates, each written once, e.g.
+-- #1 = gaussian(1.00, 2.00); #2 = #1 + #1. This is for display: parameters are
+-- rounded and variables are not named, so gate_in reads it as new draws.
+CREATE FUNCTION gate_out_dag(gate)
+    RETURNS text
+    AS 'MODULE_PATHNAME', 'gate_out_dag'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Planner support. Gate comparisons never filter rows, since the planner turns
+-- them into conditions, and building a gate costs more the larger its operands.
+CREATE FUNCTION gate_restrict_sel(internal, oid, internal, integer)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'gate_restrict_sel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_join_sel(internal, oid, internal, smallint, internal)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'gate_join_sel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_predicate_support(internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'gate_predicate_support'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_operation_support(internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'gate_operation_support'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Provide a way for constants to get coerced into gates. The casts do not go
+-- through gate_in, which is VOLATILE, so that constants in queries are folded.
+CREATE FUNCTION constant_gate(float8)
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'constant_gate'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION constant_gate(numeric)
+    RETURNS gate
+    AS 'SELECT constant_gate($1::float8)'
+    LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION constant_gate(int)
+    RETURNS gate
+    AS 'SELECT constant_gate($1::float8)'
+    LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
+
 CREATE CAST (numeric AS gate)
-    WITH INOUT
+    WITH FUNCTION constant_gate(numeric)
     AS IMPLICIT;
 
 CREATE CAST (int AS gate)
-    WITH INOUT
+    WITH FUNCTION constant_gate(int)
     AS IMPLICIT;
 
--- Define arithmetic functions for the now-defined gate
+-- Create base variables straight from numbers, e.g. from the columns of a
+-- staging table. Every call is a new draw, so these are VOLATILE.
+CREATE FUNCTION gaussian(mean float8, stddev float8)
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'gaussian_gate'
+    LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION poisson(lambda float8)
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'poisson_gate'
+    LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+-- One new variable per array element. NULL elements give NULL gates.
+CREATE FUNCTION gaussian_array(means float8[], stddevs float8[])
+    RETURNS SETOF gate
+    AS 'MODULE_PATHNAME', 'gaussian_array'
+    LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION poisson_array(lambdas float8[])
+    RETURNS SETOF gate
+    AS 'MODULE_PATHNAME', 'poisson_array'
+    LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+-- Define arithmetic functions for the now-defined gate. arithmetic_var and the
+-- other generic functions take the operator by name; the operators use the
+-- dedicated functions below.
 CREATE FUNCTION arithmetic_var(gate, gate, cstring)
     RETURNS gate
     AS 'MODULE_PATHNAME', 'arithmetic_var'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE FUNCTION add_prob_var(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT arithmetic_var(g1, g2, 'PLUS')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'add_prob_var'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR + (
     leftarg = gate,
@@ -49,11 +144,10 @@ CREATE OPERATOR + (
 );
 
 CREATE FUNCTION sub_prob_var(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT arithmetic_var(g1, g2, 'MINUS')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'sub_prob_var'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR - (
     leftarg = gate,
@@ -62,11 +156,10 @@ CREATE OPERATOR - (
 );
 
 CREATE FUNCTION unary_minus(g gate)
-    RETURNS gate AS
-    $$
-        SELECT sub_prob_var(0::gate, g);
-    $$ 
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'unary_minus'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR - (
     rightarg = gate,
@@ -74,11 +167,10 @@ CREATE OPERATOR - (
 );
 
 CREATE FUNCTION times_prob_var(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT arithmetic_var(g1, g2, 'TIMES')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'times_prob_var'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR * (
     leftarg = gate,
@@ -87,11 +179,10 @@ CREATE OPERATOR * (
 );
 
 CREATE FUNCTION div_prob_var(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT arithmetic_var(g1, g2, 'DIVIDE')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'div_prob_var'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR / (
     leftarg = gate,
@@ -138,18 +229,41 @@ CREATE OPERATOR / (
 --     stype = gate
 -- );
 
-CREATE FUNCTION sum_prob_var(_state gate, _value gate)
-    RETURNS gate AS
-    $$
-        SELECT arithmetic_var(_state, _value, 'SUM');
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+-- prob_sum keeps its running sum in memory and can be split across parallel workers.
+CREATE FUNCTION prob_sum_transition(internal, gate)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'prob_sum_transition'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION prob_sum_combine(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'prob_sum_combine'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION prob_sum_serialize(internal)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'prob_sum_serialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION prob_sum_deserialize(bytea, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'prob_sum_deserialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION prob_sum_final(internal)
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'prob_sum_final'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
 
 CREATE AGGREGATE prob_sum (gate)
 (
-    sfunc = sum_prob_var,
-    stype = gate,
-    initcond = '0'
+    sfunc = prob_sum_transition,
+    stype = internal,
+    finalfunc = prob_sum_final,
+    combinefunc = prob_sum_combine,
+    serialfunc = prob_sum_serialize,
+    deserialfunc = prob_sum_deserialize,
+    parallel = safe
 );
 
 
@@ -167,139 +281,464 @@ CREATE AGGREGATE sum_num (numeric) (
 
 -- Define conditioning functions for the now-defined gate
 CREATE FUNCTION return_true(gate, gate) -- for WHERE CLAUSE
-    RETURNS boolean AS
-    $$
-        SELECT true;
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'return_true'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_predicate_support;
 
 CREATE FUNCTION create_condition_from_var_and_var(gate, gate, cstring)
     RETURNS gate
     AS 'MODULE_PATHNAME', 'create_condition_from_var_and_var'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 
 CREATE FUNCTION less_than_or_equal(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT create_condition_from_var_and_var(g1, g2, 'LESS_THAN_OR_EQUAL')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'less_than_or_equal'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR <= (
     leftarg = gate,
     rightarg = gate,
-    function = return_true
+    function = return_true,
+    restrict = gate_restrict_sel,
+    join = gate_join_sel
 );
 
 CREATE FUNCTION less_than(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT create_condition_from_var_and_var(g1, g2, 'LESS_THAN')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'less_than'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR < (
     leftarg = gate,
     rightarg = gate,
-    function = return_true
+    function = return_true,
+    restrict = gate_restrict_sel,
+    join = gate_join_sel
 );
 
 CREATE FUNCTION more_than_or_equal(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT create_condition_from_var_and_var(g1, g2, 'MORE_THAN_OR_EQUAL')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'more_than_or_equal'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR >= (
     leftarg = gate,
     rightarg = gate,
-    function = return_true
+    function = return_true,
+    restrict = gate_restrict_sel,
+    join = gate_join_sel
 );
 
 CREATE FUNCTION more_than(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT create_condition_from_var_and_var(g1, g2, 'MORE_THAN')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'more_than'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR > (
     leftarg = gate,
     rightarg = gate,
-    function = return_true
+    function = return_true,
+    restrict = gate_restrict_sel,
+    join = gate_join_sel
 );
 
 CREATE FUNCTION equal_to(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT create_condition_from_var_and_var(g1, g2, 'EQUAL_TO')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'equal_to'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR = (
     leftarg = gate,
     rightarg = gate,
-    function = return_true
+    function = return_true,
+    restrict = gate_restrict_sel,
+    join = gate_join_sel
 );
 
 CREATE FUNCTION not_equal_to(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT create_condition_from_var_and_var(g1, g2, 'NOT_EQUAL_TO')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'not_equal_to'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE OPERATOR != (
     leftarg = gate,
     rightarg = gate,
-    function = return_true
+    function = return_true,
+    restrict = gate_restrict_sel,
+    join = gate_join_sel
 );
 
 CREATE FUNCTION combine_condition(gate, gate, cstring)
     RETURNS gate
     AS 'MODULE_PATHNAME', 'combine_condition'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 CREATE FUNCTION and_gate(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT combine_condition(g1, g2, 'AND')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'and_condition_gate'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
 
 CREATE FUNCTION or_gate(g1 gate, g2 gate)
-    RETURNS gate AS
-    $$
-        SELECT combine_condition(g1, g2, 'OR')
-    $$
-    LANGUAGE SQL IMMUTABLE STRICT;
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'or_condition_gate'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
+
+-- The conjunction of any number of conditions, each distinct one used once.
+-- The planner ANDs the conditions of a query's tables with this.
+CREATE FUNCTION and_all(VARIADIC conditions gate[])
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'and_all'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- The disjunction of any number of conditions, each distinct one used once.
+CREATE FUNCTION or_all(VARIADIC conditions gate[])
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'or_all'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 
 CREATE FUNCTION negate_condition(gate)
     RETURNS gate 
     AS 'MODULE_PATHNAME', 'negate_condition_gate'
-    LANGUAGE C IMMUTABLE STRICT;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT gate_operation_support;
 
--- Operator class for Postgres to implement DISTINCT
--- Ref: https://stackoverflow.com/questions/34971181/creating-custom-equality-operator-for-postgresql-type-point-for-distinct-cal
+-- Fold constants, merge sums of independent variables and decide trivial
+-- conditions. Merged variables are new draws, independent of the originals.
+CREATE FUNCTION simplify(gate)
+    RETURNS gate
+    AS 'MODULE_PATHNAME', 'simplify_gate'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Evaluate the probability that a condition gate holds.
+CREATE FUNCTION probability(gate)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'probability'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Check that a condition gate holds with at least the given probability.
+-- Also used as a row filter when probsql.min_probability is set.
+CREATE FUNCTION prob_at_least(gate, float8)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'prob_at_least'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Check that two gates can be equal with at least the given probability, from
+-- their supports and moments alone. Used as a join filter for gate equalities.
+CREATE FUNCTION gates_may_be_equal(gate, gate, float8)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gates_may_be_equal'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Bound the probability of a condition gate without evaluating it.
+CREATE FUNCTION probability_bounds(gate, OUT lower float8, OUT upper float8)
+    RETURNS record
+    AS 'MODULE_PATHNAME', 'probability_bounds_gate'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Estimate the probability of a condition gate, or the expected value of any
+-- gate, by sampling. The same seed always gives the same estimate.
+CREATE FUNCTION probability_mc(gate, samples int DEFAULT 100000, seed int DEFAULT 0)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'probability_mc'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION expectation_mc(gate, samples int DEFAULT 100000, seed int DEFAULT 0)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'expectation_mc'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Run a query and return the k rows whose conditions are most probable, most
+-- probable first. The column definition list must match the columns of the
+-- query, cond included.
+CREATE FUNCTION probsql_topk(query text, k int)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'probsql_topk'
+    LANGUAGE C VOLATILE STRICT;
+
+-- Structural comparison of gates, for sorting, DISTINCT and GROUP BY. Two gates
+-- are equal when their circuits compute the same thing from the same variables.
+-- The order itself has no meaning beyond being consistent.
 CREATE FUNCTION gate_compare(gate, gate)
-RETURNS integer LANGUAGE SQL IMMUTABLE AS 
-$$
-    SELECT 0;
-$$;
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'gate_compare'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_struct_lt(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_struct_lt'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_struct_le(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_struct_le'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_struct_eq(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_struct_eq'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_struct_ne(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_struct_ne'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_struct_ge(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_struct_ge'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_struct_gt(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_struct_gt'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR *< (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_struct_lt,
+    commutator = *>,
+    negator = *>=,
+    restrict = scalarltsel,
+    join = scalarltjoinsel
+);
+
+CREATE OPERATOR *<= (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_struct_le,
+    commutator = *>=,
+    negator = *>,
+    restrict = scalarlesel,
+    join = scalarlejoinsel
+);
+
+CREATE OPERATOR *= (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_struct_eq,
+    commutator = *=,
+    negator = *<>,
+    restrict = eqsel,
+    join = eqjoinsel,
+    hashes,
+    merges
+);
+
+CREATE OPERATOR *<> (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_struct_ne,
+    commutator = *<>,
+    negator = *=,
+    restrict = neqsel,
+    join = neqjoinsel
+);
+
+CREATE OPERATOR *>= (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_struct_ge,
+    commutator = *<=,
+    negator = *<,
+    restrict = scalargesel,
+    join = scalargejoinsel
+);
+
+CREATE OPERATOR *> (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_struct_gt,
+    commutator = *<,
+    negator = *<=,
+    restrict = scalargtsel,
+    join = scalargtjoinsel
+);
+
+CREATE FUNCTION gate_hash(gate)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'gate_hash'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_hash_extended(gate, bigint)
+    RETURNS bigint
+    AS 'MODULE_PATHNAME', 'gate_hash_extended'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE OPERATOR CLASS gate_ops
     DEFAULT FOR TYPE gate USING btree AS
-        operator 1 <,
-        operator 2 <=,
-        operator 3 =,
-        operator 4 >=,
-        operator 5 >,
+        operator 1 *<,
+        operator 2 *<=,
+        operator 3 *=,
+        operator 4 *>=,
+        operator 5 *>,
         function 1 gate_compare(gate, gate);
 
+CREATE OPERATOR CLASS gate_hash_ops
+    DEFAULT FOR TYPE gate USING hash AS
+        operator 1 *=,
+        function 1 gate_hash(gate),
+        function 2 gate_hash_extended(gate, bigint);
+
+-- The interval that a gate falls outside of with a negligible probability,
+-- which is what GiST indexes store for gates. Written as [lower, upper].
+CREATE TYPE gate_interval;
+
+CREATE FUNCTION gate_interval_in(cstring)
+    RETURNS gate_interval
+    AS 'MODULE_PATHNAME', 'gate_interval_in'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_interval_out(gate_interval)
+    RETURNS cstring
+    AS 'MODULE_PATHNAME', 'gate_interval_out'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE gate_interval (
+    internallength = 16,
+    input = gate_interval_in,
+    output = gate_interval_out,
+    alignment = double
+);
+
+CREATE FUNCTION likely_interval(gate)
+    RETURNS gate_interval
+    AS 'MODULE_PATHNAME', 'likely_interval'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Likely comparisons: x ?> y is false when x > y holds with a negligible
+-- probability, judging from the likely intervals of x and y. Unlike >, they
+-- filter rows, and a GiST index on a gate column can answer them.
+CREATE FUNCTION gate_may_be_less(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_may_be_less'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_may_be_less_or_equal(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_may_be_less_or_equal'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_may_be_equal(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_may_be_equal'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_may_be_more_or_equal(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_may_be_more_or_equal'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_may_be_more(gate, gate)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_may_be_more'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ?< (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_may_be_less,
+    commutator = ?>,
+    restrict = positionsel,
+    join = positionjoinsel
+);
+
+CREATE OPERATOR ?<= (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_may_be_less_or_equal,
+    commutator = ?>=,
+    restrict = positionsel,
+    join = positionjoinsel
+);
+
+CREATE OPERATOR ?= (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_may_be_equal,
+    commutator = ?=,
+    restrict = areasel,
+    join = areajoinsel
+);
+
+CREATE OPERATOR ?>= (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_may_be_more_or_equal,
+    commutator = ?<=,
+    restrict = positionsel,
+    join = positionjoinsel
+);
+
+CREATE OPERATOR ?> (
+    leftarg = gate,
+    rightarg = gate,
+    function = gate_may_be_more,
+    commutator = ?<,
+    restrict = positionsel,
+    join = positionjoinsel
+);
+
+-- GiST support: gates are indexed by their likely interval.
+CREATE FUNCTION gate_gist_consistent(internal, gate, smallint, oid, internal)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'gate_gist_consistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_gist_union(internal, internal)
+    RETURNS gate_interval
+    AS 'MODULE_PATHNAME', 'gate_gist_union'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_gist_compress(internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'gate_gist_compress'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_gist_penalty(internal, internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'gate_gist_penalty'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_gist_picksplit(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'gate_gist_picksplit'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gate_gist_same(gate_interval, gate_interval, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'gate_gist_same'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS gate_gist_ops
+    DEFAULT FOR TYPE gate USING gist AS
+        operator 1 ?<,
+        operator 2 ?<=,
+        operator 3 ?=,
+        operator 4 ?>=,
+        operator 5 ?>,
+        function 1 gate_gist_consistent(internal, gate, smallint, oid, internal),
+        function 2 gate_gist_union(internal, internal),
+        function 3 gate_gist_compress(internal),
+        function 5 gate_gist_penalty(internal, internal, internal),
+        function 6 gate_gist_picksplit(internal, internal),
+        function 7 gate_gist_same(gate_interval, gate_interval, internal),
+        storage gate_interval;
+
 
 -- Functions for creating/removing a condition column
 CREATE FUNCTION add_condition(_tbl regclass)
@@ -324,10 +763,9 @@ RETURNS gate AS 'MODULE_PATHNAME', 'get_true_gate'
 LANGUAGE C IMMUTABLE STRICT;
 
 
--- Get the Oids of user-defined types/functions for internal use.
+-- Resolve the Oids of user-defined types/functions for internal use.
+-- Backends resolve them on first use, so this only checks the installation.
 CREATE FUNCTION get_oids()
     RETURNS void 
     AS 'MODULE_PATHNAME', 'get_oids'
-    LANGUAGE C IMMUTABLE STRICT;
-
-SELECT get_oids();
\ No newline at end of file
+    LANGUAGE C VOLATILE STRICT;
@@ -1,6 +1,17 @@
 #include <postgres.h>
 #include "stringify.h"
 #include "gate.h"
+#include "serialize.h"
+#include "probability.h"
+#include "sampler.h"
+#include "aggregate.h"
+#include "simplify.h"
+#include "arena.h"
+#include "bounds.h"
+#include "topk.h"
+#include "dag.h"
+#include "parse.h"
+#include "index.h"
 
 #include <fmgr.h>
 #include <optimizer/planner.h>
@@ -16,18 +27,82 @@
 #include <parser/parser.h>
 #include <parser/parse_oper.h>
 #include <catalog/namespace.h>
+#include <utils/guc.h>
+#include <catalog/pg_type.h>
+#include <funcapi.h>
+#include <access/htup_details.h>
+#include <utils/inval.h>
+#include <utils/syscache.h>
+#include <executor/spi.h>
+#include <utils/builtins.h>
+#include <utils/array.h>
+#include <utils/lsyscache.h>
+#include <nodes/supportnodes.h>
+#include <optimizer/cost.h>
 
 #include <string.h>
 
 PG_MODULE_MAGIC;
 
+/*******************************
+ * Debugging
+ ******************************/
+
+// probsql.debug_level: 0 is silent, 1 reports what the extension does, and
+// 2 also dumps the parse trees it rewrites.
+static int probsql_debug_level = 0;
+
+#define PROBSQL_DEBUG_MESSAGES 1
+#define PROBSQL_DEBUG_NODES 2
+
+// Tracing is a single predictable branch when it is off; the message arguments,
+// which may stringify whole circuits, are only evaluated when it is on.
+#define probsql_debug(level, ...)                              \
+    do                                                         \
+    {                                                          \
+        if (unlikely(probsql_debug_level >= (level)))          \
+            ereport(INFO, errmsg(__VA_ARGS__));                \
+    } while (0)
+
+#define probsql_debug_node(title, node)                                    \
+    do                                                                     \
+    {                                                                      \
+        if (unlikely(probsql_debug_level >= PROBSQL_DEBUG_NODES))          \
+            elog_node_display(INFO, title, node, true);                    \
+    } while (0)
+
 /*******************************
  * Gate I/O
  ******************************/
 
+// The ways gate_out can write a circuit.
+typedef enum
+{
+    // As one expression, e.g. (gaussian(1.00, 2.00))+(gaussian(1.00, 2.00))
+    GATE_OUTPUT_TREE,
+
+    // As numbered gates, each written once, e.g. #1 = gaussian(1.00, 2.00); #2 = #1 + #1
+    GATE_OUTPUT_DAG,
+
+    // As numbered gates with exact parameters and variable ids, which gate_in reads back
+    // as the same circuit, e.g. #1 = gaussian(1, 2)@01234567-89ab-cdef-0123-456789abcdef; #2 = #1 + #1
+    GATE_OUTPUT_EXACT
+} gate_output_format;
+
+static const struct config_enum_entry gate_output_options[] = {
+    {"tree", GATE_OUTPUT_TREE, false},
+    {"dag", GATE_OUTPUT_DAG, false},
+    {"exact", GATE_OUTPUT_EXACT, false},
+    {NULL, 0, false}};
+
+// probsql.gate_output. The default is lossless, so that COPY and pg_dump keep gates as they are.
+static int probsql_gate_output = GATE_OUTPUT_EXACT;
+
 // SQL gate functions
 static Oid and_gate = InvalidOid;
 static Oid or_gate = InvalidOid;
+static Oid and_all_oid = InvalidOid;
+static Oid or_all_oid = InvalidOid;
 static Oid negate_condition_oid = InvalidOid;
 static Oid eq = InvalidOid;
 static Oid leq = InvalidOid;
@@ -35,6 +110,8 @@ static Oid lt = InvalidOid;
 static Oid geq = InvalidOid;
 static Oid gt = InvalidOid;
 static Oid neq = InvalidOid;
+static Oid prob_at_least_oid = InvalidOid;
+static Oid gates_may_be_equal_oid = InvalidOid;
 
 // SQL gate operators
 static Oid less_than_comparator = InvalidOid;
@@ -44,6 +121,13 @@ static Oid more_than_or_equal_comparator = InvalidOid;
 static Oid equal_comparator = InvalidOid;
 static Oid not_equal_comparator = InvalidOid;
 
+// Likely-comparison operators, which GiST indexes on gates answer
+static Oid likely_less_than = InvalidOid;
+static Oid likely_less_than_or_equal = InvalidOid;
+static Oid likely_equal = InvalidOid;
+static Oid likely_more_than_or_equal = InvalidOid;
+static Oid likely_more_than = InvalidOid;
+
 // SQL gate aggregators
 static Oid max_agg = InvalidOid;
 static Oid min_agg = InvalidOid;
@@ -53,20 +137,94 @@ static Oid sum_agg = InvalidOid;
 // SQL gate type oid
 static Oid gate_oid = InvalidOid;
 
-// The default gate for a new table
-static Gate *true_gate = NULL;
+// Whether the OIDs above are up to date for this backend. They are looked up on
+// first use and cleared whenever a function, operator or type changes.
+static bool probsql_oids_valid = false;
+
+/**
+ * @brief Append the textual representation of a serialized gate to a buffer. The
+ * gate is rebuilt in the arena of the call, which the next call empties.
+ *
+ * @param fcinfo The call
+ * @param buf The buffer to append to
+ * @param sg The gate
+ * @param max_length The most characters to append, or 0 for no limit
+ * @param max_depth The most levels of the circuit to print, or 0 for no limit
+ */
+static void stringify_serialized_gate(FunctionCallInfo fcinfo, StringInfo buf, SerializedGate *sg,
+                                      int max_length, int max_depth)
+{
+    GateArena *previous = activate_gate_arena(call_gate_arena(fcinfo));
+
+    PG_TRY();
+    {
+        stringify_gate_into(buf, deserialize_gate(sg), max_length, max_depth);
+    }
+    PG_FINALLY();
+    {
+        activate_gate_arena(previous);
+    }
+    PG_END_TRY();
+}
 
 // Returns the textual representation of any gate.
 PG_FUNCTION_INFO_V1(gate_out);
 Datum gate_out(PG_FUNCTION_ARGS)
 {
-    // Pull out the gate from the arguments
-    Gate *gate = (Gate *)PG_GETARG_POINTER(0);
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    if (probsql_gate_output == GATE_OUTPUT_EXACT)
+    {
+        stringify_serialized_gate_dag(&buf, sg, true);
+    }
+    else if (probsql_gate_output == GATE_OUTPUT_DAG)
+    {
+        stringify_serialized_gate_dag(&buf, sg, false);
+    }
+    else
+    {
+        stringify_serialized_gate(fcinfo, &buf, sg, 0, 0);
+    }
+
+    PG_RETURN_CSTRING(buf.data);
+}
+
+// Returns a gate as numbered gates, each written once, whatever probsql.gate_output says.
+PG_FUNCTION_INFO_V1(gate_out_dag);
+Datum gate_out_dag(PG_FUNCTION_ARGS)
+{
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    stringify_serialized_gate_dag(&buf, sg, false);
+
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+// Returns the textual representation of a gate, cut off after max_length
+// characters and max_depth levels of the circuit. 0 means no limit.
+PG_FUNCTION_INFO_V1(gate_to_text);
+Datum gate_to_text(PG_FUNCTION_ARGS)
+{
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    const int32 max_length = PG_GETARG_INT32(1);
+    const int32 max_depth = PG_GETARG_INT32(2);
+    StringInfoData buf;
+
+    if (max_length < 0 || max_depth < 0)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("max_length and max_depth must not be negative"));
+    }
 
-    // Use the helper
-    char *result = _stringify_gate(gate);
+    initStringInfo(&buf);
+    stringify_serialized_gate(fcinfo, &buf, sg, max_length, max_depth);
 
-    PG_RETURN_CSTRING(result);
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
 }
 
 // Creates a gate.
@@ -76,32 +234,162 @@ Datum gate_in(PG_FUNCTION_ARGS)
     // Pull out the distribution and parameters
     char *literal = PG_GETARG_CSTRING(0);
 
-    // Prepare a few variables for any possible pack of params
-    double x, y;
+    PG_RETURN_POINTER(parse_gate(literal));
+}
 
-    // See if the distribution matches any of the ones we can recognise
-    if (sscanf(literal, "gaussian(%lf, %lf)", &x, &y) == 2)
-    {
-        Gate *gate = new_gaussian(x, y);
-        PG_RETURN_POINTER(gate);
-    }
-    else if (sscanf(literal, "poisson(%lf)", &x) == 1)
+// Returns the binary representation of any gate.
+PG_FUNCTION_INFO_V1(gate_send);
+Datum gate_send(PG_FUNCTION_ARGS)
+{
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    PG_RETURN_BYTEA_P(send_serialized_gate(sg));
+}
+
+// Reads a gate from its binary representation.
+PG_FUNCTION_INFO_V1(gate_recv);
+Datum gate_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo)PG_GETARG_POINTER(0);
+    PG_RETURN_POINTER(recv_serialized_gate(buf));
+}
+
+/*******************************
+ * Gate Construction
+ ******************************/
+
+// A Gaussian gate, after checking its parameters.
+static SerializedGate *checked_gaussian(double mean, double stddev)
+{
+    base_variable_parameters parameters;
+    memset(&parameters, 0, sizeof(base_variable_parameters));
+    parameters.gaussian_parameters.mean = mean;
+    parameters.gaussian_parameters.stddev = stddev;
+    check_base_variable_parameters(GAUSSIAN, parameters);
+    return new_serialized_base_variable(GAUSSIAN, parameters);
+}
+
+// A Poisson gate, after checking its parameter.
+static SerializedGate *checked_poisson(double lambda)
+{
+    base_variable_parameters parameters;
+    memset(&parameters, 0, sizeof(base_variable_parameters));
+    parameters.poisson_parameters.lambda = lambda;
+    check_base_variable_parameters(POISSON, parameters);
+    return new_serialized_base_variable(POISSON, parameters);
+}
+
+// Creates a new Gaussian variable from numbers, without going through text.
+PG_FUNCTION_INFO_V1(gaussian_gate);
+Datum gaussian_gate(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(checked_gaussian(PG_GETARG_FLOAT8(0), PG_GETARG_FLOAT8(1)));
+}
+
+// Creates a new Poisson variable from a number, without going through text.
+PG_FUNCTION_INFO_V1(poisson_gate);
+Datum poisson_gate(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(checked_poisson(PG_GETARG_FLOAT8(0)));
+}
+
+// Creates a constant from a number. Constants are no draw of anything, so unlike
+// gate_in this always gives the same gate, and casts from numbers can be folded.
+PG_FUNCTION_INFO_V1(constant_gate);
+Datum constant_gate(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(serialize_gate(constant(PG_GETARG_FLOAT8(0))));
+}
+
+// The parameters of a batch of variables, kept across the calls of a set-returning function.
+typedef struct
+{
+    int count;
+    Datum *first;
+    bool *first_nulls;
+    Datum *second;
+    bool *second_nulls;
+} parameter_arrays;
+
+// Reads a float8[] as a flat list of values.
+static void deconstruct_float8_array(ArrayType *array, Datum **values, bool **nulls, int *count)
+{
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+
+    get_typlenbyvalalign(FLOAT8OID, &typlen, &typbyval, &typalign);
+    deconstruct_array(array, FLOAT8OID, typlen, typbyval, typalign, values, nulls, count);
+}
+
+/**
+ * @brief Shared body of gaussian_array and poisson_array. Each element of the
+ * arrays gives one new variable; an element that is NULL gives a NULL gate.
+ *
+ * @param fcinfo The call
+ * @param tag The distribution
+ * @return Datum The next gate
+ */
+static Datum base_variable_array_srf(FunctionCallInfo fcinfo, distribution_type tag)
+{
+    FuncCallContext *funcctx;
+
+    if (SRF_IS_FIRSTCALL())
     {
-        Gate *gate = new_poisson(x);
-        PG_RETURN_POINTER(gate);
+        funcctx = SRF_FIRSTCALL_INIT();
+        MemoryContext old_context = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        parameter_arrays *arrays = (parameter_arrays *)palloc0(sizeof(parameter_arrays));
+        deconstruct_float8_array(PG_GETARG_ARRAYTYPE_P(0), &arrays->first, &arrays->first_nulls, &arrays->count);
+
+        if (tag == GAUSSIAN)
+        {
+            int count;
+            deconstruct_float8_array(PG_GETARG_ARRAYTYPE_P(1), &arrays->second, &arrays->second_nulls, &count);
+            if (count != arrays->count)
+            {
+                ereport(ERROR,
+                        errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                        errmsg("There are %d means but %d standard deviations", arrays->count, count));
+            }
+        }
+
+        funcctx->max_calls = arrays->count;
+        funcctx->user_fctx = arrays;
+        MemoryContextSwitchTo(old_context);
     }
-    else if (sscanf(literal, "%lf", &x) == 1)
+
+    funcctx = SRF_PERCALL_SETUP();
+    parameter_arrays *arrays = (parameter_arrays *)funcctx->user_fctx;
+    const int i = funcctx->call_cntr;
+
+    if (i >= arrays->count)
     {
-        Gate *gate = constant(x);
-        PG_RETURN_POINTER(gate);
+        SRF_RETURN_DONE(funcctx);
     }
-    else
+
+    if (arrays->first_nulls[i] || (tag == GAUSSIAN && arrays->second_nulls[i]))
     {
-        // Catchall for unrecognised literals
-        ereport(ERROR,
-                errcode(ERRCODE_CASE_NOT_FOUND),
-                errmsg("Cannot recognise the type of gate: %s", literal));
+        SRF_RETURN_NEXT_NULL(funcctx);
     }
+
+    SerializedGate *result = tag == GAUSSIAN
+                                 ? checked_gaussian(DatumGetFloat8(arrays->first[i]), DatumGetFloat8(arrays->second[i]))
+                                 : checked_poisson(DatumGetFloat8(arrays->first[i]));
+    SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
+}
+
+// Creates one new Gaussian variable per pair of elements of means and stddevs.
+PG_FUNCTION_INFO_V1(gaussian_array);
+Datum gaussian_array(PG_FUNCTION_ARGS)
+{
+    return base_variable_array_srf(fcinfo, GAUSSIAN);
+}
+
+// Creates one new Poisson variable per element of lambdas.
+PG_FUNCTION_INFO_V1(poisson_array);
+Datum poisson_array(PG_FUNCTION_ARGS)
+{
+    return base_variable_array_srf(fcinfo, POISSON);
 }
 
 /*******************************
@@ -111,19 +399,18 @@ Datum gate_in(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(arithmetic_var);
 Datum arithmetic_var(PG_FUNCTION_ARGS)
 {
-    ereport(INFO, errmsg("Entered arithmetic var"));
+    probsql_debug(PROBSQL_DEBUG_MESSAGES, "Entered arithmetic var");
     // Read in arguments
     if (PG_ARGISNULL(0))
     {
         ereport(ERROR, errmsg("First argument is null"));
     }
     
-    Gate *first_operand = (Gate *)PG_GETARG_POINTER(0);
-    // ereport(INFO, errmsg("First operand: %s", _stringify_gate(first_operand)));
-    Gate *second_operand = (Gate *)PG_GETARG_POINTER(1);
-    ereport(INFO, errmsg("Second operand: %s", _stringify_gate(second_operand)));
+    SerializedGate *first_operand = PG_GETARG_SERIALIZED_GATE(0);
+    SerializedGate *second_operand = PG_GETARG_SERIALIZED_GATE(1);
+    probsql_debug(PROBSQL_DEBUG_MESSAGES, "Second operand: %s", _stringify_gate(deserialize_gate(second_operand)));
     char *opr = PG_GETARG_CSTRING(2);
-    ereport(INFO, errmsg("Operator: %s", opr));
+    probsql_debug(PROBSQL_DEBUG_MESSAGES, "Operator: %s", opr);
 
     // Determine the type of composition
     probabilistic_composition comp;
@@ -169,9 +456,8 @@ Datum arithmetic_var(PG_FUNCTION_ARGS)
     }
 
     // Create the new gate
-    Gate *new_gate = combine_prob_gates(first_operand, second_operand, comp);
-    ereport(INFO,
-            errmsg("Created: %s", _stringify_gate(new_gate)));
+    SerializedGate *new_gate = combine_serialized_prob_gates(first_operand, second_operand, comp);
+    probsql_debug(PROBSQL_DEBUG_MESSAGES, "Created: %s", _stringify_gate(deserialize_gate(new_gate)));
     PG_RETURN_POINTER(new_gate);
 }
 
@@ -179,8 +465,8 @@ PG_FUNCTION_INFO_V1(create_condition_from_var_and_var);
 Datum create_condition_from_var_and_var(PG_FUNCTION_ARGS)
 {
     // Read in arguments
-    Gate *first_gate = (Gate *)PG_GETARG_POINTER(0);
-    Gate *second_gate = (Gate *)PG_GETARG_POINTER(1);
+    SerializedGate *first_gate = PG_GETARG_SERIALIZED_GATE(0);
+    SerializedGate *second_gate = PG_GETARG_SERIALIZED_GATE(1);
     char *comparator = PG_GETARG_CSTRING(2);
 
     // Determine the type of comparator
@@ -207,62 +493,745 @@ Datum create_condition_from_var_and_var(PG_FUNCTION_ARGS)
     }
     else if (strcmp(comparator, "NOT_EQUAL_TO") == 0)
     {
-        cond = NOT_EQUAL_TO;
+        cond = NOT_EQUAL_TO;
+    }
+    else
+    {
+        // Catchall for unrecognised comparator codes
+        ereport(ERROR,
+                errcode(ERRCODE_CASE_NOT_FOUND),
+                errmsg("Cannot recognise the type of comparator"));
+    }
+
+    // Return result
+    SerializedGate *new_gate = create_serialized_condition(first_gate, second_gate, cond);
+    PG_RETURN_POINTER(new_gate);
+}
+
+PG_FUNCTION_INFO_V1(combine_condition);
+Datum combine_condition(PG_FUNCTION_ARGS)
+{
+    // Read in arguments
+    SerializedGate *first_gate = PG_GETARG_SERIALIZED_GATE(0);
+    SerializedGate *second_gate = PG_GETARG_SERIALIZED_GATE(1);
+    char *combiner = PG_GETARG_CSTRING(2);
+
+    // Determine the combiner in use
+    condition_type cond;
+    if (strcmp(combiner, "AND") == 0)
+    {
+        cond = AND;
+    }
+    else if (strcmp(combiner, "OR") == 0)
+    {
+        cond = OR;
+    }
+    else
+    {
+        // Catchall for unrecognised comparator codes
+        ereport(ERROR,
+                errcode(ERRCODE_CASE_NOT_FOUND),
+                errmsg("Cannot recognise the type of combiner"));
+    }
+    // Return result
+    SerializedGate *new_gate = combine_two_serialized_conditions(first_gate, second_gate, cond);
+    PG_RETURN_POINTER(new_gate);
+}
+
+// The operators below each have their own entry point, so that nothing is
+// looked up by name per row.
+static Datum compose_prob_gates(FunctionCallInfo fcinfo, probabilistic_composition opr)
+{
+    SerializedGate *first_gate = PG_GETARG_SERIALIZED_GATE(0);
+    SerializedGate *second_gate = PG_GETARG_SERIALIZED_GATE(1);
+    PG_RETURN_POINTER(combine_serialized_prob_gates(first_gate, second_gate, opr));
+}
+
+static Datum compare_prob_gates(FunctionCallInfo fcinfo, condition_type cond)
+{
+    SerializedGate *first_gate = PG_GETARG_SERIALIZED_GATE(0);
+    SerializedGate *second_gate = PG_GETARG_SERIALIZED_GATE(1);
+    PG_RETURN_POINTER(create_serialized_condition(first_gate, second_gate, cond));
+}
+
+static Datum combine_condition_gates(FunctionCallInfo fcinfo, condition_type cond)
+{
+    SerializedGate *first_gate = PG_GETARG_SERIALIZED_GATE(0);
+    SerializedGate *second_gate = PG_GETARG_SERIALIZED_GATE(1);
+    PG_RETURN_POINTER(combine_two_serialized_conditions(first_gate, second_gate, cond));
+}
+
+// g1 + g2
+PG_FUNCTION_INFO_V1(add_prob_var);
+Datum add_prob_var(PG_FUNCTION_ARGS)
+{
+    return compose_prob_gates(fcinfo, PLUS);
+}
+
+// g1 - g2
+PG_FUNCTION_INFO_V1(sub_prob_var);
+Datum sub_prob_var(PG_FUNCTION_ARGS)
+{
+    return compose_prob_gates(fcinfo, MINUS);
+}
+
+// g1 * g2
+PG_FUNCTION_INFO_V1(times_prob_var);
+Datum times_prob_var(PG_FUNCTION_ARGS)
+{
+    return compose_prob_gates(fcinfo, TIMES);
+}
+
+// g1 / g2
+PG_FUNCTION_INFO_V1(div_prob_var);
+Datum div_prob_var(PG_FUNCTION_ARGS)
+{
+    return compose_prob_gates(fcinfo, DIVIDE);
+}
+
+// -g, i.e. 0 - g
+PG_FUNCTION_INFO_V1(unary_minus);
+Datum unary_minus(PG_FUNCTION_ARGS)
+{
+    SerializedGate *zero = serialize_gate(constant(0));
+    PG_RETURN_POINTER(combine_serialized_prob_gates(zero, PG_GETARG_SERIALIZED_GATE(0), MINUS));
+}
+
+// g1 <= g2
+PG_FUNCTION_INFO_V1(less_than_or_equal);
+Datum less_than_or_equal(PG_FUNCTION_ARGS)
+{
+    return compare_prob_gates(fcinfo, LESS_THAN_OR_EQUAL);
+}
+
+// g1 < g2
+PG_FUNCTION_INFO_V1(less_than);
+Datum less_than(PG_FUNCTION_ARGS)
+{
+    return compare_prob_gates(fcinfo, LESS_THAN);
+}
+
+// g1 >= g2
+PG_FUNCTION_INFO_V1(more_than_or_equal);
+Datum more_than_or_equal(PG_FUNCTION_ARGS)
+{
+    return compare_prob_gates(fcinfo, MORE_THAN_OR_EQUAL);
+}
+
+// g1 > g2
+PG_FUNCTION_INFO_V1(more_than);
+Datum more_than(PG_FUNCTION_ARGS)
+{
+    return compare_prob_gates(fcinfo, MORE_THAN);
+}
+
+// g1 == g2
+PG_FUNCTION_INFO_V1(equal_to);
+Datum equal_to(PG_FUNCTION_ARGS)
+{
+    return compare_prob_gates(fcinfo, EQUAL_TO);
+}
+
+// g1 != g2
+PG_FUNCTION_INFO_V1(not_equal_to);
+Datum not_equal_to(PG_FUNCTION_ARGS)
+{
+    return compare_prob_gates(fcinfo, NOT_EQUAL_TO);
+}
+
+// Stands in for the comparison operators in WHERE, until the planner turns them into conditions.
+PG_FUNCTION_INFO_V1(return_true);
+Datum return_true(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(true);
+}
+
+// g1 && g2
+PG_FUNCTION_INFO_V1(and_condition_gate);
+Datum and_condition_gate(PG_FUNCTION_ARGS)
+{
+    return combine_condition_gates(fcinfo, AND);
+}
+
+/**
+ * @brief Shared body of and_all and or_all: one AND or OR of all the conditions
+ * of a variadic array, with each distinct condition used once.
+ *
+ * @param fcinfo The call
+ * @param opr AND or OR
+ * @return Datum The new gate, or NULL if any condition is NULL
+ */
+static Datum combine_condition_array(FunctionCallInfo fcinfo, condition_type opr)
+{
+    ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    Datum *values;
+    bool *nulls;
+    int count;
+
+    get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval, &typalign);
+    deconstruct_array(array, ARR_ELEMTYPE(array), typlen, typbyval, typalign, &values, &nulls, &count);
+
+    if (count == 0)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("At least one condition is needed"));
+    }
+
+    SerializedGate **conditions = (SerializedGate **)palloc(count * sizeof(SerializedGate *));
+    for (int i = 0; i < count; ++i)
+    {
+        if (nulls[i])
+        {
+            PG_RETURN_NULL();
+        }
+
+        conditions[i] = DatumGetSerializedGate(values[i]);
+        if (is_prob_type(SERIALIZED_GATE_ROOT(conditions[i])->gate_type))
+        {
+            ereport(ERROR,
+                    errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                    errmsg("Detected prob gate instead of condition gate: %s",
+                           _stringify_gate(deserialize_gate(conditions[i]))));
+        }
+    }
+
+    PG_RETURN_POINTER(combine_serialized_conditions(conditions, count, opr));
+}
+
+// g1 && g2 && ...
+PG_FUNCTION_INFO_V1(and_all);
+Datum and_all(PG_FUNCTION_ARGS)
+{
+    return combine_condition_array(fcinfo, AND);
+}
+
+// g1 || g2 || ...
+PG_FUNCTION_INFO_V1(or_all);
+Datum or_all(PG_FUNCTION_ARGS)
+{
+    return combine_condition_array(fcinfo, OR);
+}
+
+// g1 || g2
+PG_FUNCTION_INFO_V1(or_condition_gate);
+Datum or_condition_gate(PG_FUNCTION_ARGS)
+{
+    return combine_condition_gates(fcinfo, OR);
+}
+
+PG_FUNCTION_INFO_V1(negate_condition_gate);
+Datum negate_condition_gate(PG_FUNCTION_ARGS)
+{
+    // Read in argument
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    GateArena *previous = activate_gate_arena(call_gate_arena(fcinfo));
+    SerializedGate *result;
+
+    PG_TRY();
+    {
+        // Perform negation
+        result = serialize_gate(negate_condition(deserialize_gate(sg)));
+    }
+    PG_FINALLY();
+    {
+        activate_gate_arena(previous);
+    }
+    PG_END_TRY();
+
+    PG_RETURN_POINTER(result);
+}
+
+/*******************************
+ * Gate Comparison
+ ******************************/
+// Structural comparison of gates, for sorting, DISTINCT and GROUP BY. Unlike the
+// comparison operators, which build conditions, these compare the circuits themselves.
+PG_FUNCTION_INFO_V1(gate_compare);
+Datum gate_compare(PG_FUNCTION_ARGS)
+{
+    const int result = compare_serialized_gates(PG_GETARG_SERIALIZED_GATE(0), PG_GETARG_SERIALIZED_GATE(1));
+    PG_RETURN_INT32(result < 0 ? -1 : (result > 0 ? 1 : 0));
+}
+
+PG_FUNCTION_INFO_V1(gate_struct_lt);
+Datum gate_struct_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(compare_serialized_gates(PG_GETARG_SERIALIZED_GATE(0), PG_GETARG_SERIALIZED_GATE(1)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(gate_struct_le);
+Datum gate_struct_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(compare_serialized_gates(PG_GETARG_SERIALIZED_GATE(0), PG_GETARG_SERIALIZED_GATE(1)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(gate_struct_eq);
+Datum gate_struct_eq(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(compare_serialized_gates(PG_GETARG_SERIALIZED_GATE(0), PG_GETARG_SERIALIZED_GATE(1)) == 0);
+}
+
+PG_FUNCTION_INFO_V1(gate_struct_ne);
+Datum gate_struct_ne(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(compare_serialized_gates(PG_GETARG_SERIALIZED_GATE(0), PG_GETARG_SERIALIZED_GATE(1)) != 0);
+}
+
+PG_FUNCTION_INFO_V1(gate_struct_ge);
+Datum gate_struct_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(compare_serialized_gates(PG_GETARG_SERIALIZED_GATE(0), PG_GETARG_SERIALIZED_GATE(1)) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(gate_struct_gt);
+Datum gate_struct_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(compare_serialized_gates(PG_GETARG_SERIALIZED_GATE(0), PG_GETARG_SERIALIZED_GATE(1)) > 0);
+}
+
+// Hash of a gate, consistent with gate_struct_eq.
+PG_FUNCTION_INFO_V1(gate_hash);
+Datum gate_hash(PG_FUNCTION_ARGS)
+{
+    probsqlHashKey key;
+    serialized_gate_key(PG_GETARG_SERIALIZED_GATE(0), &key);
+    PG_RETURN_INT32(hash_bytes((const unsigned char *)&key, sizeof(probsqlHashKey)));
+}
+
+PG_FUNCTION_INFO_V1(gate_hash_extended);
+Datum gate_hash_extended(PG_FUNCTION_ARGS)
+{
+    probsqlHashKey key;
+    serialized_gate_key(PG_GETARG_SERIALIZED_GATE(0), &key);
+    PG_RETURN_INT64(hash_bytes_extended((const unsigned char *)&key, sizeof(probsqlHashKey), PG_GETARG_INT64(1)));
+}
+
+/*******************************
+ * Gate Indexing
+ ******************************/
+// Reads an interval written as [lower, upper]. Either end may be -inf or inf.
+PG_FUNCTION_INFO_V1(gate_interval_in);
+Datum gate_interval_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);
+    support_interval *result = (support_interval *)palloc(sizeof(support_interval));
+    int length = -1;
+
+    sscanf(str, " [ %lf , %lf ] %n", &result->lower, &result->upper, &length);
+
+    if (length < 0 || str[length] != '\0' || !(result->lower <= result->upper))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                errmsg("invalid input syntax for type gate_interval: \"%s\"", str));
+    }
+
+    PG_RETURN_POINTER(result);
+}
+
+PG_FUNCTION_INFO_V1(gate_interval_out);
+Datum gate_interval_out(PG_FUNCTION_ARGS)
+{
+    support_interval *interval = (support_interval *)PG_GETARG_POINTER(0);
+    PG_RETURN_CSTRING(psprintf("[%.2f, %.2f]", interval->lower, interval->upper));
+}
+
+// Returns the interval that a gate is indexed by, which it falls outside of with a negligible probability.
+PG_FUNCTION_INFO_V1(likely_interval);
+Datum likely_interval(PG_FUNCTION_ARGS)
+{
+    support_interval *result = (support_interval *)palloc(sizeof(support_interval));
+    *result = serialized_gate_likely_interval(PG_GETARG_SERIALIZED_GATE(0));
+    PG_RETURN_POINTER(result);
+}
+
+// Shared body of the likely-comparison operators: whether X ? Y holds with more than a
+// negligible probability, judging from the likely intervals of X and Y.
+static bool gates_may_compare(FunctionCallInfo fcinfo, StrategyNumber strategy)
+{
+    return likely_intervals_may_compare(strategy,
+                                        serialized_gate_likely_interval(PG_GETARG_SERIALIZED_GATE(0)),
+                                        serialized_gate_likely_interval(PG_GETARG_SERIALIZED_GATE(1)));
+}
+
+PG_FUNCTION_INFO_V1(gate_may_be_less);
+Datum gate_may_be_less(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(gates_may_compare(fcinfo, LIKELY_LESS_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(gate_may_be_less_or_equal);
+Datum gate_may_be_less_or_equal(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(gates_may_compare(fcinfo, LIKELY_LESS_OR_EQUAL_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(gate_may_be_equal);
+Datum gate_may_be_equal(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(gates_may_compare(fcinfo, LIKELY_EQUAL_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(gate_may_be_more_or_equal);
+Datum gate_may_be_more_or_equal(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(gates_may_compare(fcinfo, LIKELY_MORE_OR_EQUAL_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(gate_may_be_more);
+Datum gate_may_be_more(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(gates_may_compare(fcinfo, LIKELY_MORE_STRATEGY));
+}
+
+// The query of an index scan and its likely interval, kept in fn_extra so that the
+// interval is worked out once per scan rather than once per index entry.
+typedef struct
+{
+    SerializedGate *query;
+    support_interval interval;
+} gist_query_cache;
+
+// GiST consistent: whether the entries under a key may satisfy key ? query. The
+// leaf keys are exactly the intervals the operators test, so there is no recheck.
+PG_FUNCTION_INFO_V1(gate_gist_consistent);
+Datum gate_gist_consistent(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *)PG_GETARG_POINTER(0);
+    SerializedGate *query = PG_GETARG_SERIALIZED_GATE(1);
+    StrategyNumber strategy = (StrategyNumber)PG_GETARG_UINT16(2);
+    bool *recheck = (bool *)PG_GETARG_POINTER(4);
+
+    gist_query_cache *cache = (gist_query_cache *)fcinfo->flinfo->fn_extra;
+    if (cache == NULL || VARSIZE(cache->query) != VARSIZE(query) ||
+        memcmp(cache->query, query, VARSIZE(query)) != 0)
+    {
+        if (cache == NULL)
+        {
+            cache = (gist_query_cache *)MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(gist_query_cache));
+            fcinfo->flinfo->fn_extra = cache;
+        }
+        else
+        {
+            pfree(cache->query);
+        }
+
+        cache->query = (SerializedGate *)MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, VARSIZE(query));
+        memcpy(cache->query, query, VARSIZE(query));
+        cache->interval = serialized_gate_likely_interval(query);
+    }
+
+    *recheck = false;
+    PG_RETURN_BOOL(likely_intervals_may_compare(strategy, *(support_interval *)DatumGetPointer(entry->key),
+                                                cache->interval));
+}
+
+// GiST union: the interval that holds every entry's.
+PG_FUNCTION_INFO_V1(gate_gist_union);
+Datum gate_gist_union(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *)PG_GETARG_POINTER(0);
+    int *size = (int *)PG_GETARG_POINTER(1);
+    support_interval *result = (support_interval *)palloc(sizeof(support_interval));
+
+    *result = *(support_interval *)DatumGetPointer(entryvec->vector[0].key);
+    for (int i = 1; i < entryvec->n; ++i)
+    {
+        *result = union_intervals(*result, *(support_interval *)DatumGetPointer(entryvec->vector[i].key));
+    }
+
+    *size = sizeof(support_interval);
+    PG_RETURN_POINTER(result);
+}
+
+// GiST compress: gates are stored in the index as their likely interval.
+PG_FUNCTION_INFO_V1(gate_gist_compress);
+Datum gate_gist_compress(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *)PG_GETARG_POINTER(0);
+
+    if (!entry->leafkey)
+    {
+        PG_RETURN_POINTER(entry);
+    }
+
+    support_interval *interval = (support_interval *)palloc(sizeof(support_interval));
+    *interval = serialized_gate_likely_interval(DatumGetSerializedGate(entry->key));
+
+    GISTENTRY *result = (GISTENTRY *)palloc(sizeof(GISTENTRY));
+    gistentryinit(*result, PointerGetDatum(interval), entry->rel, entry->page, entry->offset, false);
+    PG_RETURN_POINTER(result);
+}
+
+// GiST penalty: how much longer a key gets when an entry is added under it.
+PG_FUNCTION_INFO_V1(gate_gist_penalty);
+Datum gate_gist_penalty(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *original = (GISTENTRY *)PG_GETARG_POINTER(0);
+    GISTENTRY *added = (GISTENTRY *)PG_GETARG_POINTER(1);
+    float *penalty = (float *)PG_GETARG_POINTER(2);
+
+    *penalty = (float)interval_enlargement(*(support_interval *)DatumGetPointer(original->key),
+                                           *(support_interval *)DatumGetPointer(added->key));
+    PG_RETURN_POINTER(penalty);
+}
+
+PG_FUNCTION_INFO_V1(gate_gist_picksplit);
+Datum gate_gist_picksplit(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *)PG_GETARG_POINTER(0);
+    GIST_SPLITVEC *split = (GIST_SPLITVEC *)PG_GETARG_POINTER(1);
+
+    split_gist_intervals(entryvec, split);
+    PG_RETURN_POINTER(split);
+}
+
+PG_FUNCTION_INFO_V1(gate_gist_same);
+Datum gate_gist_same(PG_FUNCTION_ARGS)
+{
+    support_interval *x = (support_interval *)PG_GETARG_POINTER(0);
+    support_interval *y = (support_interval *)PG_GETARG_POINTER(1);
+    bool *result = (bool *)PG_GETARG_POINTER(2);
+
+    *result = x->lower == y->lower && x->upper == y->upper;
+    PG_RETURN_POINTER(result);
+}
+
+/*******************************
+ * Gate Aggregation
+ ******************************/
+// Adds a row to the running state of prob_sum.
+PG_FUNCTION_INFO_V1(prob_sum_transition);
+Datum prob_sum_transition(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    if (!AggCheckCallContext(fcinfo, &aggcontext))
+    {
+        ereport(ERROR, errmsg("prob_sum_transition called in non-aggregate context"));
+    }
+
+    prob_sum_state *state = PG_ARGISNULL(0) ? NULL : (prob_sum_state *)PG_GETARG_POINTER(0);
+
+    // Detoast in the per-row context; the state keeps what it needs in its own arena.
+    SerializedGate *value = PG_ARGISNULL(1) ? NULL : PG_GETARG_SERIALIZED_GATE(1);
+    MemoryContext old_context = MemoryContextSwitchTo(aggcontext);
+
+    if (state == NULL)
+    {
+        state = new_prob_sum_state();
+    }
+    if (value != NULL)
+    {
+        prob_sum_state_add(state, value);
+    }
+
+    MemoryContextSwitchTo(old_context);
+    PG_RETURN_POINTER(state);
+}
+
+// Merges the partial states of two parallel workers.
+PG_FUNCTION_INFO_V1(prob_sum_combine);
+Datum prob_sum_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    if (!AggCheckCallContext(fcinfo, &aggcontext))
+    {
+        ereport(ERROR, errmsg("prob_sum_combine called in non-aggregate context"));
+    }
+
+    prob_sum_state *state1 = PG_ARGISNULL(0) ? NULL : (prob_sum_state *)PG_GETARG_POINTER(0);
+    prob_sum_state *state2 = PG_ARGISNULL(1) ? NULL : (prob_sum_state *)PG_GETARG_POINTER(1);
+
+    if (state2 == NULL)
+    {
+        PG_RETURN_POINTER(state1);
+    }
+
+    // The result has to live in the aggregate context, and state2 may not.
+    MemoryContext old_context = MemoryContextSwitchTo(aggcontext);
+    if (state1 == NULL)
+    {
+        state1 = new_prob_sum_state();
+    }
+    prob_sum_state_merge(state1, state2);
+    MemoryContextSwitchTo(old_context);
+
+    PG_RETURN_POINTER(state1);
+}
+
+PG_FUNCTION_INFO_V1(prob_sum_serialize);
+Datum prob_sum_serialize(PG_FUNCTION_ARGS)
+{
+    if (!AggCheckCallContext(fcinfo, NULL))
+    {
+        ereport(ERROR, errmsg("prob_sum_serialize called in non-aggregate context"));
+    }
+
+    prob_sum_state *state = (prob_sum_state *)PG_GETARG_POINTER(0);
+    PG_RETURN_BYTEA_P(serialize_prob_sum_state(state));
+}
+
+PG_FUNCTION_INFO_V1(prob_sum_deserialize);
+Datum prob_sum_deserialize(PG_FUNCTION_ARGS)
+{
+    if (!AggCheckCallContext(fcinfo, NULL))
+    {
+        ereport(ERROR, errmsg("prob_sum_deserialize called in non-aggregate context"));
+    }
+
+    bytea *data = PG_GETARG_BYTEA_P(0);
+    PG_RETURN_POINTER(deserialize_prob_sum_state(data));
+}
+
+// Returns the sum of all rows.
+PG_FUNCTION_INFO_V1(prob_sum_final);
+Datum prob_sum_final(PG_FUNCTION_ARGS)
+{
+    prob_sum_state *state = PG_ARGISNULL(0) ? NULL : (prob_sum_state *)PG_GETARG_POINTER(0);
+    PG_RETURN_GATE(prob_sum_state_result(state));
+}
+
+// Returns a smaller circuit with the same distribution.
+PG_FUNCTION_INFO_V1(simplify_gate);
+Datum simplify_gate(PG_FUNCTION_ARGS)
+{
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    PG_RETURN_POINTER(simplify_serialized_gate(sg));
+}
+
+/*******************************
+ * Gate Evaluation
+ ******************************/
+/**
+ * @brief The probability that a serialized condition gate holds, in closed form
+ * where there is one and by sampling otherwise.
+ *
+ * @param sg The serialized condition gate
+ * @return double The probability
+ */
+static double condition_probability(SerializedGate *sg)
+{
+    if (is_prob_type(SERIALIZED_GATE_ROOT(sg)->gate_type))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected prob gate instead of condition gate: %s", _stringify_gate(deserialize_gate(sg))));
+    }
+
+    return evaluate_probability(sg);
+}
+
+// Returns the probability that a condition gate holds.
+PG_FUNCTION_INFO_V1(probability);
+Datum probability(PG_FUNCTION_ARGS)
+{
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    PG_RETURN_FLOAT8(condition_probability(sg));
+}
+
+// Returns whether a condition gate holds with at least the given probability,
+// refining the probability only until it is clearly on one side of the threshold.
+// This is the filter that the planner adds for probsql.min_probability.
+PG_FUNCTION_INFO_V1(prob_at_least);
+Datum prob_at_least(PG_FUNCTION_ARGS)
+{
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    float8 threshold = PG_GETARG_FLOAT8(1);
+
+    if (is_prob_type(SERIALIZED_GATE_ROOT(sg)->gate_type))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected prob gate instead of condition gate: %s", _stringify_gate(deserialize_gate(sg))));
     }
-    else
+
+    PG_RETURN_BOOL(probability_at_least(sg, threshold));
+}
+
+// Returns whether two probability gates can be equal with at least the given probability,
+// judging only from the support and moments of each. It never builds X == Y, so it is cheap
+// enough to run on every pair of rows of a join: the planner adds it as a join filter for
+// gate equalities, so that pairs that cannot match are dropped before their condition is built.
+PG_FUNCTION_INFO_V1(gates_may_be_equal);
+Datum gates_may_be_equal(PG_FUNCTION_ARGS)
+{
+    SerializedGate *x = PG_GETARG_SERIALIZED_GATE(0);
+    SerializedGate *y = PG_GETARG_SERIALIZED_GATE(1);
+    float8 threshold = PG_GETARG_FLOAT8(2);
+
+    // Conditions compared with = are kept; there is nothing to bound them with.
+    if (!is_prob_type(SERIALIZED_GATE_ROOT(x)->gate_type) || !is_prob_type(SERIALIZED_GATE_ROOT(y)->gate_type))
     {
-        // Catchall for unrecognised comparator codes
-        ereport(ERROR,
-                errcode(ERRCODE_CASE_NOT_FOUND),
-                errmsg("Cannot recognise the type of comparator"));
+        PG_RETURN_BOOL(true);
     }
 
-    // Return result
-    Gate *new_gate = create_condition_from_prob_gates(first_gate, second_gate, cond);
-    PG_RETURN_POINTER(new_gate);
+    const double upper = equality_probability_upper_bound(x, y);
+    PG_RETURN_BOOL(upper > 0 && upper >= threshold);
 }
 
-PG_FUNCTION_INFO_V1(combine_condition);
-Datum combine_condition(PG_FUNCTION_ARGS)
+// Returns cheap lower and upper bounds on the probability that a condition gate holds.
+PG_FUNCTION_INFO_V1(probability_bounds_gate);
+Datum probability_bounds_gate(PG_FUNCTION_ARGS)
 {
-    // Read in arguments
-    Gate *first_gate = (Gate *)PG_GETARG_POINTER(0);
-    Gate *second_gate = (Gate *)PG_GETARG_POINTER(1);
-    char *combiner = PG_GETARG_CSTRING(2);
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
 
-    // Determine the combiner in use
-    condition_type cond;
-    if (strcmp(combiner, "AND") == 0)
+    if (is_prob_type(SERIALIZED_GATE_ROOT(sg)->gate_type))
     {
-        cond = AND;
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected prob gate instead of condition gate: %s", _stringify_gate(deserialize_gate(sg))));
     }
-    else if (strcmp(combiner, "OR") == 0)
+
+    TupleDesc tupdesc;
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
     {
-        cond = OR;
+        ereport(ERROR,
+                errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("Function returning record called in context that cannot accept type record"));
     }
-    else
+
+    double lower, upper;
+    probability_bounds(sg, &lower, &upper);
+
+    Datum values[2] = {Float8GetDatum(lower), Float8GetDatum(upper)};
+    bool nulls[2] = {false, false};
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+// Estimates the probability that a condition gate holds by sampling.
+PG_FUNCTION_INFO_V1(probability_mc);
+Datum probability_mc(PG_FUNCTION_ARGS)
+{
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    int32 samples = PG_GETARG_INT32(1);
+    int32 seed = PG_GETARG_INT32(2);
+
+    if (is_prob_type(SERIALIZED_GATE_ROOT(sg)->gate_type))
     {
-        // Catchall for unrecognised comparator codes
         ereport(ERROR,
-                errcode(ERRCODE_CASE_NOT_FOUND),
-                errmsg("Cannot recognise the type of combiner"));
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected prob gate instead of condition gate: %s", _stringify_gate(deserialize_gate(sg))));
     }
-    // Return result
-    Gate *new_gate = combine_two_conditions(first_gate, second_gate, AND);
-    PG_RETURN_POINTER(new_gate);
+
+    PG_RETURN_FLOAT8(sample_mean(sg, samples, (uint64)seed));
 }
 
-PG_FUNCTION_INFO_V1(negate_condition_gate);
-Datum negate_condition_gate(PG_FUNCTION_ARGS)
+// Estimates the expected value of a gate by sampling.
+PG_FUNCTION_INFO_V1(expectation_mc);
+Datum expectation_mc(PG_FUNCTION_ARGS)
 {
-    // Read in argument
-    Gate *gate = (Gate *)PG_GETARG_POINTER(0);
+    SerializedGate *sg = PG_GETARG_SERIALIZED_GATE(0);
+    int32 samples = PG_GETARG_INT32(1);
+    int32 seed = PG_GETARG_INT32(2);
 
-    // Perform negation
-    gate = negate_condition(gate);
-    PG_RETURN_POINTER(gate);
+    PG_RETURN_FLOAT8(sample_mean(sg, samples, (uint64)seed));
 }
 
+// Looks up a function of the extension by name, or InvalidOid if there is none.
 static Oid get_func_oid(char *s)
 {
     FuncCandidateList fcl = FuncnameGetCandidates(
@@ -272,61 +1241,113 @@ static Oid get_func_oid(char *s)
         false,
         false,
         false,
-        false);
+        true);
 
-    if (fcl == NULL || fcl->oid == InvalidOid)
+    if (fcl == NULL)
     {
-        ereport(ERROR, errmsg("%s func_oid not found", s));
+        return InvalidOid;
     }
 
     return fcl->oid;
 }
 
+// Looks up an operator on gates by name, or InvalidOid if there is none.
 static Oid find_oper_oid(char *op_name, bool isPrefix)
 {
-    Oid operatorObjectId = OpernameGetOprid(list_make1(makeString(op_name)), isPrefix ? InvalidOid : gate_oid, gate_oid);
-    if (operatorObjectId == InvalidOid)
+    return OpernameGetOprid(list_make1(makeString(op_name)), isPrefix ? InvalidOid : gate_oid, gate_oid);
+}
+
+/**
+ * @brief Make sure that the OIDs of the extension's type, functions and operators
+ * are known in this backend. They are looked up once and then cached until a
+ * catalog change invalidates them.
+ *
+ * @return bool Whether they were all found. If not, the extension is not (fully)
+ * installed in this database, and queries should be left alone.
+ */
+static bool resolve_probsql_oids(void)
+{
+    if (probsql_oids_valid)
+    {
+        return OidIsValid(gate_oid);
+    }
+
+    // Create a node that holds the type name of a gate
+    TypeName *typename = makeTypeNameFromNameList(list_make1(makeString("gate")));
+    gate_oid = LookupTypeNameOid(NULL, typename, true);
+
+    if (OidIsValid(gate_oid))
     {
-        ereport(ERROR, errmsg("%s oper_oid not found", op_name));
+        // Get all function OIDs (names come from the SQL wrapper)
+        and_gate = get_func_oid("and_gate");
+        or_gate = get_func_oid("or_gate");
+        and_all_oid = get_func_oid("and_all");
+        or_all_oid = get_func_oid("or_all");
+        negate_condition_oid = get_func_oid("negate_condition");
+        eq = get_func_oid("equal_to");
+        leq = get_func_oid("less_than_or_equal");
+        lt = get_func_oid("less_than");
+        geq = get_func_oid("more_than_or_equal");
+        gt = get_func_oid("more_than");
+        neq = get_func_oid("not_equal_to");
+        prob_at_least_oid = get_func_oid("prob_at_least");
+        gates_may_be_equal_oid = get_func_oid("gates_may_be_equal");
+
+        // Get all operator OIDs
+        less_than_comparator = find_oper_oid("<", false);
+        less_than_or_equal_comparator = find_oper_oid("<=", false);
+        more_than_comparator = find_oper_oid(">", false);
+        more_than_or_equal_comparator = find_oper_oid(">=", false);
+        equal_comparator = find_oper_oid("=", false);
+        not_equal_comparator = find_oper_oid("<>", false);
+        likely_less_than = find_oper_oid("?<", false);
+        likely_less_than_or_equal = find_oper_oid("?<=", false);
+        likely_equal = find_oper_oid("?=", false);
+        likely_more_than_or_equal = find_oper_oid("?>=", false);
+        likely_more_than = find_oper_oid("?>", false);
+
+        // While the extension is being created, only some of them exist yet.
+        if (!OidIsValid(and_gate) || !OidIsValid(or_gate) || !OidIsValid(and_all_oid) || !OidIsValid(or_all_oid) ||
+            !OidIsValid(negate_condition_oid) ||
+            !OidIsValid(eq) || !OidIsValid(leq) || !OidIsValid(lt) ||
+            !OidIsValid(geq) || !OidIsValid(gt) || !OidIsValid(neq) || !OidIsValid(prob_at_least_oid) ||
+            !OidIsValid(gates_may_be_equal_oid) ||
+            !OidIsValid(less_than_comparator) || !OidIsValid(less_than_or_equal_comparator) ||
+            !OidIsValid(more_than_comparator) || !OidIsValid(more_than_or_equal_comparator) ||
+            !OidIsValid(equal_comparator) || !OidIsValid(not_equal_comparator) ||
+            !OidIsValid(likely_less_than) || !OidIsValid(likely_less_than_or_equal) || !OidIsValid(likely_equal) ||
+            !OidIsValid(likely_more_than_or_equal) || !OidIsValid(likely_more_than))
+        {
+            gate_oid = InvalidOid;
+        }
     }
-    return operatorObjectId;
+
+    probsql_debug(PROBSQL_DEBUG_MESSAGES, "Gate OID: %u", gate_oid);
+
+    // A miss is cached too, so that databases without the extension do not pay
+    // for the lookups on every query. Creating the extension invalidates it.
+    probsql_oids_valid = true;
+    return OidIsValid(gate_oid);
+}
+
+// Syscache callback that forgets the cached OIDs when the catalog changes.
+static void invalidate_probsql_oids(Datum arg, int cacheid, uint32 hashvalue)
+{
+    probsql_oids_valid = false;
 }
 
+// Resolves the OIDs now, reporting an error if the extension is incomplete.
 PG_FUNCTION_INFO_V1(get_oids);
 Datum get_oids(PG_FUNCTION_ARGS)
 {
-    // Create a node that holds the type name of a gate
-    Value *value = makeString("gate");
-
-    // Convert this node to a list
-    TypeName *typename = makeTypeNameFromNameList(list_make1(value));
-
-    // Set the global value
-    gate_oid = typenameTypeId(NULL, typename);
-    ereport(INFO, errmsg("Gate OID: %u", gate_oid));
-
-    // Also create the default gate for true
-    true_gate = (Gate *)malloc(sizeof(Gate));
-    true_gate->gate_type = PLACEHOLDER_TRUE;
-
-    // Get all function OIDs (names come from the SQL wrapper)
-    and_gate = get_func_oid("and_gate");
-    or_gate = get_func_oid("or_gate");
-    negate_condition_oid = get_func_oid("negate_condition");
-    eq = get_func_oid("equal_to");
-    leq = get_func_oid("less_than_or_equal");
-    lt = get_func_oid("less_than");
-    geq = get_func_oid("more_than_or_equal");
-    gt = get_func_oid("more_than");
-    neq = get_func_oid("not_equal_to");
-
-    // Get all operator OIDs
-    less_than_comparator = find_oper_oid("<", false);
-    less_than_or_equal_comparator = find_oper_oid("<=", false);
-    more_than_comparator = find_oper_oid(">", false);
-    more_than_or_equal_comparator = find_oper_oid(">=", false);
-    equal_comparator = find_oper_oid("=", false);
-    not_equal_comparator = find_oper_oid("<>", false);
+    probsql_oids_valid = false;
+
+    if (!resolve_probsql_oids())
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_UNDEFINED_OBJECT),
+                errmsg("The gate type, functions and operators are not all installed"));
+    }
 
     PG_RETURN_VOID();
 }
@@ -334,7 +1355,9 @@ Datum get_oids(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(get_true_gate);
 Datum get_true_gate(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_POINTER(true_gate);
+    // The default gate for a new table
+    Gate true_gate = {.gate_type = PLACEHOLDER_TRUE};
+    PG_RETURN_GATE(&true_gate);
 }
 
 /**************************
@@ -348,6 +1371,10 @@ static ProcessUtility_hook_type prev_ProcessUtility = NULL;
 // The condition column name
 static char *PROBSQL_CONDITION = "cond";
 
+// probsql.min_probability: rows whose condition holds with a lower probability
+// are filtered out during the scan. 0 keeps every row.
+static double probsql_min_probability = 0;
+
 /*
     Looks out for CREATE TABLE [AS].
     SELECT INTO will be rewritten into CREATE TABLE AS (see docs for CreateTableAsStmt)
@@ -365,8 +1392,12 @@ static void handle_create_table_with_gate(PlannedStmt *query)
     if (tag != T_CreateTableAsStmt && tag != T_CreateStmt)
         return;
 
+    // Without the gate type there is nothing to look for
+    if (!resolve_probsql_oids())
+        return;
+
     // Get the actual form of the statement
-    elog_node_display(INFO, "PlannedStmt inside handle_create_table_with_gate", query, true);
+    probsql_debug_node("PlannedStmt inside handle_create_table_with_gate", query);
 
     // Examine the attribute types
     // Ref: https://doxygen.postgresql.org/explain_8c.html#a640ae0e1984b7e39c4348f1db5717af9
@@ -403,7 +1434,7 @@ static void handle_create_table_with_gate(PlannedStmt *query)
 
                 // Add this column to the table
                 stmt->tableElts = lappend(stmt->tableElts, column);
-                elog_node_display(INFO, "Final create statement", stmt, true);
+                probsql_debug_node("Final create statement", stmt);
                 return; // Unneeded, but speeds up grokking
             }
         }
@@ -414,8 +1445,8 @@ static void handle_create_table_with_gate(PlannedStmt *query)
         Query *query = castNode(Query, stmt->query);                         // The SELECT statement that populates the table
         List *targetList = query->targetList;
 
-        elog_node_display(INFO, "query", query, true);
-        elog_node_display(INFO, "into clause", stmt->into, true);
+        probsql_debug_node("query", query);
+        probsql_debug_node("into clause", stmt->into);
 
         ListCell *lc;
         foreach (lc, targetList)
@@ -424,7 +1455,7 @@ static void handle_create_table_with_gate(PlannedStmt *query)
             if (entry->resjunk)
                 continue; // Not going to be in the final attribute list
 
-            elog_node_display(INFO, "target entry", entry, true);
+            probsql_debug_node("target entry", entry);
 
             // The underlying result could have been from a table, or something like
             // CREATE TABLE tbl AS 2::gate, where a literal was coerced into a gate.
@@ -459,7 +1490,7 @@ static void handle_create_table_with_gate(PlannedStmt *query)
             else
             {
                 // There could be some other Node types that I'm not aware of. Log it:
-                elog_node_display(INFO, "Unrecognised node tag in handle_create_table_with_gate", expr, true);
+                probsql_debug_node("Unrecognised node tag in handle_create_table_with_gate", expr);
             }
         }
     }
@@ -487,6 +1518,29 @@ HasGateWalkerContext *new_gate_walker_context()
     return context;
 }
 
+// The likely comparison that goes with a comparator, e.g. ?< for <, or InvalidOid if there is none.
+static Oid likely_comparison_of(Oid comparator)
+{
+    if (comparator == less_than_comparator)
+        return likely_less_than;
+    if (comparator == less_than_or_equal_comparator)
+        return likely_less_than_or_equal;
+    if (comparator == equal_comparator)
+        return likely_equal;
+    if (comparator == more_than_or_equal_comparator)
+        return likely_more_than_or_equal;
+    if (comparator == more_than_comparator)
+        return likely_more_than;
+    return InvalidOid;
+}
+
+// Whether an operator is one of the gate comparisons <, <=, =, <>, >= and >, which become
+// part of the condition of a row instead of filtering rows.
+static bool is_gate_comparator(Oid opno)
+{
+    return OidIsValid(likely_comparison_of(opno)) || opno == not_equal_comparator;
+}
+
 // We are walking inside the quals, checking the arguments for any gate-gate or gate-literal comparison.
 static bool has_gate_in_condition_walker(Node *node, void *context)
 {
@@ -500,7 +1554,13 @@ static bool has_gate_in_condition_walker(Node *node, void *context)
 
     if (IsA(node, FuncExpr))
     {
-        ereport(INFO, errmsg("Cannot support functional predicates because of the possibility of side-effects"));
+        probsql_debug(PROBSQL_DEBUG_MESSAGES, "Cannot support functional predicates because of the possibility of side-effects");
+    }
+    else if (IsA(node, OpExpr) && castNode(OpExpr, node)->opresulttype != gate_oid &&
+             !is_gate_comparator(castNode(OpExpr, node)->opno))
+    {
+        // Any other operator on gates, such as ?> or *=, returns a real boolean. It stays in
+        // the WHERE clause as a filter, like a comparison of deterministic columns.
     }
     else if (IsA(node, OpExpr))
     {
@@ -545,16 +1605,21 @@ static bool has_gate_in_condition_walker(Node *node, void *context)
                 currContext->node = node;
             }
         }
-        else if (numargs == 2)
+        else
         {
-            // E.g. AND/OR.
-            HasGateWalkerContext *firstChildContext = new_gate_walker_context();
-            Node *firstarg = linitial(boolExpr->args);
-            has_gate_in_condition_walker(firstarg, firstChildContext);
-
-            HasGateWalkerContext *secondChildContext = new_gate_walker_context();
-            Node *secondarg = lsecond(boolExpr->args);
-            has_gate_in_condition_walker(secondarg, secondChildContext);
+            // E.g. AND/OR. The grammar flattens a AND b AND c into one BoolExpr, so there may be any number of
+            // arguments.
+            List *children = NIL;
+            ListCell *lc;
+            foreach (lc, boolExpr->args)
+            {
+                HasGateWalkerContext *childContext = new_gate_walker_context();
+                has_gate_in_condition_walker(lfirst(lc), childContext);
+                if (childContext->node != NULL)
+                {
+                    children = lappend(children, childContext->node);
+                }
+            }
 
             /*
                  For an expr like
@@ -568,24 +1633,19 @@ static bool has_gate_in_condition_walker(Node *node, void *context)
                  )
 
                  where name is a text column, I want to strip off all the deterministic checks.
-                 So if both children return nothing, I return nothing;
+                 So if no child returns something, I return nothing;
                  If only one child returns something, I return that child - e.g. in the OR above;
-                 If both children return something, I return this node.
+                 If more children return something, I return this node with just those children.
             */
-
-            if ((firstChildContext->node == NULL) != (secondChildContext->node == NULL))
+            if (list_length(children) == 1)
             {
-                // One is empty and the other isn't, so just directly return the child
-                currContext->node = firstChildContext->node == NULL ? secondChildContext->node : firstChildContext->node;
+                currContext->node = linitial(children);
             }
-
-            if (firstChildContext->node != NULL && secondChildContext->node != NULL)
+            else if (list_length(children) > 1)
             {
                 // Clone this boolexpr, and set the child arguments to those returned by the childContexts
                 // for copy-on-write + "path compression"
-                BoolExpr *clonedBoolExpr = (BoolExpr *)makeBoolExpr(boolExpr->boolop,
-                                                                    list_make2(firstChildContext->node, secondChildContext->node),
-                                                                    boolExpr->location);
+                BoolExpr *clonedBoolExpr = (BoolExpr *)makeBoolExpr(boolExpr->boolop, children, boolExpr->location);
 
                 currContext->node = castNode(Node, clonedBoolExpr);
             }
@@ -622,7 +1682,7 @@ static bool has_gate_in_condition_walker(Node *node, void *context)
     else
     {
         // Catchall for currently unsupported nodes, such as MinMaxExpr
-        elog_node_display(INFO, "Detected unfamiliar node in where clause tree", node, true);
+        probsql_debug_node("Detected unfamiliar node in where clause tree", node);
     }
 
     return false; // Always return false because we need to traverse the whole tree.
@@ -674,6 +1734,49 @@ static HasGateWalkerContext *handle_select_from_table_with_gate_in_condition(Que
     return context;
 }
 
+/**
+ * @brief Build a call of and_all or or_all over some conditions, i.e. one flat
+ * conjunction or disjunction. Conditions that are calls of the same function are
+ * spliced in, so nested ANDs, or nested ORs, end up as a single call. Repeated
+ * conditions are left in; the function drops them when it runs, once their
+ * values are known.
+ *
+ * @param funcid and_all_oid or or_all_oid
+ * @param conditions The condition expressions
+ * @return FuncExpr* The call
+ */
+static FuncExpr *make_junction_call(Oid funcid, List *conditions)
+{
+    List *operands = NIL;
+    ListCell *lc;
+
+    foreach (lc, conditions)
+    {
+        Node *condition = lfirst(lc);
+        if (IsA(condition, FuncExpr) && castNode(FuncExpr, condition)->funcid == funcid)
+        {
+            ArrayExpr *array = linitial_node(ArrayExpr, castNode(FuncExpr, condition)->args);
+            operands = list_concat(operands, array->elements);
+        }
+        else
+        {
+            operands = lappend(operands, condition);
+        }
+    }
+
+    ArrayExpr *array = makeNode(ArrayExpr);
+    array->array_typeid = get_array_type(gate_oid);
+    array->array_collid = InvalidOid;
+    array->element_typeid = gate_oid;
+    array->elements = operands;
+    array->multidims = false;
+    array->location = -1;
+
+    FuncExpr *result = makeFuncExpr(funcid, gate_oid, list_make1(array), InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
+    result->funcvariadic = true;
+    return result;
+}
+
 /*
     For a quals tree like
 
@@ -687,6 +1790,7 @@ static HasGateWalkerContext *handle_select_from_table_with_gate_in_condition(Que
     SQL operators are replaced with the gate functional counterparts, so that the final node specifies a gate and not a boolean.
 
     Note that AND gates and OR gates can have multiple args, while my probabilistic operators only take 2.
+    They become a single call of and_all or or_all, which build one gate with all the args.
 */
 static Node *convert_sql_ops_to_gate_funcs(Node *node)
 {
@@ -765,25 +1869,11 @@ static Node *convert_sql_ops_to_gate_funcs(Node *node)
         FuncExpr *result;
         if (boolExpr->boolop == AND_EXPR)
         {
-            // Convert the first two args
-            result = makeFuncExpr(and_gate, gate_oid, list_make2(linitial(boolExpr->args), lsecond(boolExpr->args)), InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
-
-            // Then do the rest
-            for_each_from(lc, boolExpr->args, 2)
-            {
-                result = makeFuncExpr(and_gate, gate_oid, list_make2(result, lfirst(lc)), InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
-            }
+            result = make_junction_call(and_all_oid, boolExpr->args);
         }
         else if (boolExpr->boolop == OR_EXPR)
         {
-            // Convert the first two args
-            result = makeFuncExpr(or_gate, gate_oid, list_make2(linitial(boolExpr->args), lsecond(boolExpr->args)), InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
-
-            // Then do the rest
-            for_each_from(lc, boolExpr->args, 2)
-            {
-                result = makeFuncExpr(or_gate, gate_oid, list_make2(result, lfirst(lc)), InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
-            }
+            result = make_junction_call(or_all_oid, boolExpr->args);
         }
         else if (boolExpr->boolop == NOT_EXPR)
         {
@@ -800,11 +1890,54 @@ static Node *convert_sql_ops_to_gate_funcs(Node *node)
     else
     {
         // Catchall for unknown node types
-        elog_node_display(INFO, "Unrecognised node type in convert node to gate", node, true);
+        probsql_debug_node("Unrecognised node type in convert node to gate", node);
         return node;
     }
 }
 
+/**
+ * @brief Collect the gate comparisons that every row of a result must satisfy, i.e.
+ * those of the top-level conjunction of its WHERE clause. Comparisons below an OR
+ * or a NOT may fail without the row going away, so they are not collected. This
+ * has to look at the WHERE clause as written: the walker drops deterministic
+ * checks, so in its tree name = 'a' OR x = y would be x = y alone.
+ *
+ * @param node The WHERE clause
+ * @param comparisons The list to append copies of the comparisons to
+ * @return List* The list
+ */
+static List *collect_required_gate_comparisons(Node *node, List *comparisons)
+{
+    if (node == NULL)
+    {
+        return comparisons;
+    }
+
+    if (IsA(node, OpExpr) && OidIsValid(likely_comparison_of(castNode(OpExpr, node)->opno)))
+    {
+        return lappend(comparisons, copyObject(node));
+    }
+
+    if (IsA(node, BoolExpr) && castNode(BoolExpr, node)->boolop == AND_EXPR)
+    {
+        ListCell *lc;
+        foreach (lc, castNode(BoolExpr, node)->args)
+        {
+            comparisons = collect_required_gate_comparisons(lfirst(lc), comparisons);
+        }
+    }
+
+    return comparisons;
+}
+
+// ANDs a filter into the WHERE clause of a query.
+static void add_query_filter(Query *query, Node *filter)
+{
+    query->jointree->quals = query->jointree->quals == NULL
+                                 ? filter
+                                 : (Node *)makeBoolExpr(AND_EXPR, list_make2(query->jointree->quals, filter), -1);
+}
+
 /*
     This function takes a query node, and an expression tree that tells me how to get the new condition column,
     and I will add a new column def in the result that mirrors this node.
@@ -818,15 +1951,18 @@ static Node *convert_sql_ops_to_gate_funcs(Node *node)
       x1 x2 x3 40
 
     Then I will add a column definition in the query result as follows:
+
+    comparisons are the gate comparisons that every row must satisfy, which also get cheap filters.
 */
-static void construct_condition_column(Query *query, Node *node)
+static void construct_condition_column(Query *query, Node *node, List *comparisons)
 {
     /*  Get the list of all cond columns in the search query's range tables.
         Because I want to AND these columns in the end, I want to keep the reference to the
-        cond columns in a list of Vars.
+        cond columns in a list of Vars. Every reference to a table gets its own Var, even in
+        a self-join: the aliases range over different tuples. When they meet the same tuple,
+        and_all sees the same condition twice and only uses it once.
     */
     List *condition_columns = NIL;
-    List *tables_inspected = NIL; // Stores relids of tables
     List *rtable = query->rtable;
     ListCell *lc;
 
@@ -836,6 +1972,12 @@ static void construct_condition_column(Query *query, Node *node)
         ++table_index;
         RangeTblEntry *rte = castNode(RangeTblEntry, lfirst(lc));
 
+        // Joins list the columns of their inputs again, and subqueries are not supported.
+        if (rte->rtekind != RTE_RELATION)
+        {
+            continue;
+        }
+
         /*
             This logic is brittle in the sense because it assumes that a column named cond is
             the column for the probabilistic condition.
@@ -849,32 +1991,10 @@ static void construct_condition_column(Query *query, Node *node)
             ++column_index;
             if (strcmp(strVal(lfirst(lc2)), PROBSQL_CONDITION) == 0)
             {
-                // If you have seen this relid before, that means this query
-                // is a self-join. Don't double add this condition column.
-                ListCell *lc3;
-                bool skipTable = false;
-                foreach (lc3, tables_inspected)
-                {
-                    Oid prev_seen_relid = lfirst_oid(lc3);
-
-                    if (prev_seen_relid == rte->relid)
-                    {
-                        skipTable = true;
-                        break;
-                    }
-                }
-
-                if (skipTable)
-                {
-                    break;
-                }
-
-                // Add a Var referencing this column to condition_columns
-                // and add the relid of this table to tables_inspected.
-                // Subqueries not supported.
+                // Add a Var referencing this column to condition_columns.
                 Var *var = makeVar(table_index, column_index, gate_oid, -1, InvalidOid, 0);
                 condition_columns = lappend(condition_columns, var);
-                tables_inspected = lappend_oid(tables_inspected, rte->relid);
+                break;
             }
         }
     }
@@ -964,7 +2084,8 @@ static void construct_condition_column(Query *query, Node *node)
             condition_columns = lappend(condition_columns, node); // Conds are Vars, node is some OpExpr or BoolExpr
         }
 
-        // Perform a AND, with SQL's boolean AND as the conjoiner. I do the operator replacement in one shot later.
+        // Perform a AND, with SQL's boolean AND as the conjoiner. I do the operator replacement in one shot later,
+        // which turns it and any ANDs in node into one and_all call.
         Expr *result_condition_expr = makeBoolExpr(
             AND_EXPR,
             condition_columns,
@@ -987,21 +2108,73 @@ static void construct_condition_column(Query *query, Node *node)
         false);
     query->targetList = lappend(query->targetList, targetEntry);
 
-    elog_node_display(INFO, "Final query", query, true);
+    /*
+        In threshold mode, also filter on the probability of the condition, so that rows that are
+        too unlikely are dropped by the scan instead of being shipped to the client. The filter gets
+        its own copy of the condition, because the planner may scribble on either of them.
+    */
+    if (probsql_min_probability > 0)
+    {
+        Const *threshold = makeConst(FLOAT8OID, -1, InvalidOid, sizeof(float8),
+                                     Float8GetDatum(probsql_min_probability), false, FLOAT8PASSBYVAL);
+        Node *filter = (Node *)makeFuncExpr(prob_at_least_oid, BOOLOID,
+                                            list_make2(copyObject(node), threshold),
+                                            InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
+        add_query_filter(query, filter);
+    }
+
+    /*
+        A row can only hold if each of these comparisons can. Pairs of rows whose gates are provably never
+        equal, or equal with a probability below probsql.min_probability, are dropped. This is a cheap check on
+        the two gates alone: for a join on a.x = b.y, the planner runs it on each pair before the condition of
+        the pair is built, instead of returning the whole cross product.
+
+        In threshold mode, every comparison also gets its likely counterpart, e.g. x ?> 100 for x > 100. It only
+        drops rows whose comparison holds with a negligible probability, far below any sensible threshold, and
+        it lets a GiST index on the gate column find the rows instead of a scan of the whole table.
+    */
+    foreach (lc, comparisons)
+    {
+        OpExpr *comparison = lfirst_node(OpExpr, lc);
+        Expr *left = linitial(comparison->args);
+        Expr *right = lsecond(comparison->args);
+
+        if (comparison->opno == equal_comparator)
+        {
+            Const *threshold = makeConst(FLOAT8OID, -1, InvalidOid, sizeof(float8),
+                                         Float8GetDatum(probsql_min_probability), false, FLOAT8PASSBYVAL);
+            Node *filter = (Node *)makeFuncExpr(gates_may_be_equal_oid, BOOLOID,
+                                                list_make3(left, right, threshold),
+                                                InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
+            add_query_filter(query, filter);
+        }
+
+        if (probsql_min_probability > 0)
+        {
+            Node *filter = (Node *)make_opclause(likely_comparison_of(comparison->opno), BOOLOID, false,
+                                                 copyObject(left), copyObject(right), InvalidOid, InvalidOid);
+            add_query_filter(query, filter);
+        }
+    }
+
+    probsql_debug_node("Final query", query);
 }
 
 // Forward declaration of this extension's planner
 static PlannedStmt *prob_planner(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams)
 {
-    if (parse->commandType == CMD_SELECT && parse->rtable)
+    if (parse->commandType == CMD_SELECT && parse->rtable && resolve_probsql_oids())
     {
-        elog_node_display(INFO, "Initial query", parse, true);
+        probsql_debug_node("Initial query", parse);
+
+        // The gate comparisons that every row must satisfy, from the WHERE clause as written.
+        List *comparisons = collect_required_gate_comparisons(parse->jointree ? parse->jointree->quals : NULL, NIL);
 
         // Strip out all the deterministic checks in the WHERE clause, if any.
         HasGateWalkerContext *selectContext = handle_select_from_table_with_gate_in_condition(parse);
 
         // Rewrite the query to generate the new condition column using the context
-        construct_condition_column(parse, selectContext->node); // impl detail: selectContext is always non-null.
+        construct_condition_column(parse, selectContext->node, comparisons); // impl detail: selectContext is always non-null.
     }
 
     // Let the previous planner (if it exists) or the standard planner run
@@ -1039,8 +2212,285 @@ static void probsql_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
     }
 }
 
+/*******************************
+ * Planner Support
+ ******************************/
+
+// The rough cost of building a gate from its operands, in units of cpu_operator_cost:
+// a fixed part for detoasting and writing the result, and a part per gate of the operands.
+#define GATE_OPERATION_BASE_COST 10
+#define GATE_OPERATION_NODE_COST 2
+
+// The number of gates assumed for an operand whose value is not known when planning.
+#define GATE_DEFAULT_OPERAND_NODES 8
+
+// Selectivity of the gate comparison operators. The planner turns them into conditions
+// attached to the row, so they never filter anything out.
+PG_FUNCTION_INFO_V1(gate_restrict_sel);
+Datum gate_restrict_sel(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_FLOAT8(1.0);
+}
+
+PG_FUNCTION_INFO_V1(gate_join_sel);
+Datum gate_join_sel(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_FLOAT8(1.0);
+}
+
+// Support function of return_true: the same selectivity as above, when it is called as a function.
+PG_FUNCTION_INFO_V1(gate_predicate_support);
+Datum gate_predicate_support(PG_FUNCTION_ARGS)
+{
+    Node *rawreq = (Node *)PG_GETARG_POINTER(0);
+
+    if (IsA(rawreq, SupportRequestSelectivity))
+    {
+        SupportRequestSelectivity *req = (SupportRequestSelectivity *)rawreq;
+        req->selectivity = 1.0;
+        PG_RETURN_POINTER(req);
+    }
+
+    PG_RETURN_POINTER(NULL);
+}
+
+/**
+ * @brief Support function of the functions that build gates from other gates.
+ * Their cost grows with the size of their operands, which is known for constant
+ * operands and assumed for the others.
+ */
+PG_FUNCTION_INFO_V1(gate_operation_support);
+Datum gate_operation_support(PG_FUNCTION_ARGS)
+{
+    Node *rawreq = (Node *)PG_GETARG_POINTER(0);
+
+    if (IsA(rawreq, SupportRequestCost))
+    {
+        SupportRequestCost *req = (SupportRequestCost *)rawreq;
+        List *args = NIL;
+        Oid result_type = InvalidOid;
+        double nodes = 0;
+        ListCell *lc;
+
+        if (req->node != NULL && IsA(req->node, FuncExpr))
+        {
+            args = ((FuncExpr *)req->node)->args;
+            result_type = ((FuncExpr *)req->node)->funcresulttype;
+        }
+        else if (req->node != NULL && IsA(req->node, OpExpr))
+        {
+            args = ((OpExpr *)req->node)->args;
+            result_type = ((OpExpr *)req->node)->opresulttype;
+        }
+
+        foreach (lc, args)
+        {
+            // Only the gate operands count, not e.g. the name of the operator.
+            Node *arg = (Node *)lfirst(lc);
+            if (exprType(arg) != result_type)
+            {
+                continue;
+            }
+
+            if (IsA(arg, Const) && !((Const *)arg)->constisnull)
+            {
+                nodes += DatumGetSerializedGate(((Const *)arg)->constvalue)->num_nodes;
+            }
+            else
+            {
+                nodes += GATE_DEFAULT_OPERAND_NODES;
+            }
+        }
+        if (args == NIL)
+        {
+            nodes = 2 * GATE_DEFAULT_OPERAND_NODES;
+        }
+
+        req->startup = 0;
+        req->per_tuple = (GATE_OPERATION_BASE_COST + GATE_OPERATION_NODE_COST * nodes) * cpu_operator_cost;
+        PG_RETURN_POINTER(req);
+    }
+
+    PG_RETURN_POINTER(NULL);
+}
+
+/*******************************
+ * Gate Ranking
+ ******************************/
+
+// Rows fetched from the query at a time.
+#define TOPK_FETCH_SIZE 1000
+
+// Runs a query and returns the k rows whose conditions are most probable, most probable first.
+// Rows are screened with the bounds of their conditions as they arrive, and only the rows that
+// may still make the top k are evaluated.
+PG_FUNCTION_INFO_V1(probsql_topk);
+Datum probsql_topk(PG_FUNCTION_ARGS)
+{
+    char *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    int32 k = PG_GETARG_INT32(1);
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+        !(rsinfo->allowedModes & SFRM_Materialize) || rsinfo->expectedDesc == NULL)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("probsql_topk must be called in FROM with a column definition list"));
+    }
+
+    if (!resolve_probsql_oids())
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_UNDEFINED_OBJECT),
+                errmsg("The gate type, functions and operators are not all installed"));
+    }
+
+    // The rows found have to outlive SPI, and the result has to outlive this call, so
+    // both are kept in the per-query context.
+    MemoryContext per_query = rsinfo->econtext->ecxt_per_query_memory;
+    MemoryContext old_context = MemoryContextSwitchTo(per_query);
+    TupleDesc result_desc = CreateTupleDescCopy(rsinfo->expectedDesc);
+    Tuplestorestate *store = tuplestore_begin_heap(true, false, work_mem);
+    MemoryContextSwitchTo(old_context);
+    topk_state state;
+
+    if (k > 0)
+    {
+        init_topk(&state, k, per_query);
+    }
+
+    SPI_connect();
+
+    SPIPlanPtr plan = SPI_prepare(query, 0, NULL);
+    if (plan == NULL)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_SYNTAX_ERROR),
+                errmsg("Cannot prepare query: %s", query));
+    }
+
+    Portal portal = SPI_cursor_open(NULL, plan, NULL, NULL, false);
+    int condition_attno = 0;
+    bool checked = false;
+
+    while (k > 0)
+    {
+        SPI_cursor_fetch(portal, true, TOPK_FETCH_SIZE);
+        if (SPI_processed == 0)
+        {
+            break;
+        }
+
+        TupleDesc desc = SPI_tuptable->tupdesc;
+
+        // The rows go out as they are, so they must match the column definition list.
+        if (!checked)
+        {
+            bool matches = desc->natts == result_desc->natts;
+            for (int i = 0; matches && i < desc->natts; ++i)
+            {
+                matches = TupleDescAttr(desc, i)->atttypid == TupleDescAttr(result_desc, i)->atttypid;
+                if (TupleDescAttr(desc, i)->atttypid == gate_oid &&
+                    strcmp(NameStr(TupleDescAttr(desc, i)->attname), PROBSQL_CONDITION) == 0)
+                {
+                    condition_attno = i + 1;
+                }
+            }
+
+            if (!matches)
+            {
+                ereport(ERROR,
+                        errcode(ERRCODE_DATATYPE_MISMATCH),
+                        errmsg("The column definition list does not match the columns of the query"));
+            }
+            if (condition_attno == 0)
+            {
+                ereport(ERROR,
+                        errcode(ERRCODE_UNDEFINED_COLUMN),
+                        errmsg("The query has no %s column", PROBSQL_CONDITION));
+            }
+            checked = true;
+        }
+
+        for (uint64 i = 0; i < SPI_processed; ++i)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            bool isnull;
+            Datum condition = SPI_getbinval(tuple, desc, condition_attno, &isnull);
+
+            // A row without a condition cannot be ranked.
+            if (!isnull)
+            {
+                topk_add(&state, tuple, DatumGetSerializedGate(condition));
+            }
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(portal);
+    SPI_finish();
+
+    const int found = k > 0 ? topk_finish(&state) : 0;
+    for (int i = 0; i < found; ++i)
+    {
+        tuplestore_puttuple(store, state.candidates[i].tuple);
+    }
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = store;
+    rsinfo->setDesc = result_desc;
+
+    return (Datum)0;
+}
+
 void _PG_init(void)
 {
+    DefineCustomIntVariable("probsql.debug_level",
+                            "Sets how much the extension reports about what it does.",
+                            "0 is silent, 1 reports messages, 2 also dumps rewritten parse trees.",
+                            &probsql_debug_level,
+                            0,
+                            0,
+                            PROBSQL_DEBUG_NODES,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomRealVariable("probsql.min_probability",
+                             "Filters out rows whose condition holds with a lower probability.",
+                             "0 keeps every row.",
+                             &probsql_min_probability,
+                             0,
+                             0,
+                             1,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    DefineCustomEnumVariable("probsql.gate_output",
+                             "Sets how gates are written as text.",
+                             "exact writes every distinct gate once, as #n = ..., with exact parameters and variable ids, "
+                             "so that the text reads back as the same gate. tree writes one expression and dag writes "
+                             "every distinct gate once, both rounded for display.",
+                             &probsql_gate_output,
+                             GATE_OUTPUT_EXACT,
+                             gate_output_options,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    EmitWarningsOnPlaceholders("probsql");
+
+    // Forget the cached OIDs whenever the objects they refer to may have changed
+    CacheRegisterSyscacheCallback(PROCOID, invalidate_probsql_oids, (Datum)0);
+    CacheRegisterSyscacheCallback(OPEROID, invalidate_probsql_oids, (Datum)0);
+    CacheRegisterSyscacheCallback(TYPEOID, invalidate_probsql_oids, (Datum)0);
+
     // Capture the existing planner
     prev_planner = planner_hook;
 
@@ -1061,10 +2511,4 @@ void _PG_fini(void)
 
     // Replace the old utility processor
     ProcessUtility_hook = prev_ProcessUtility;
-
-    if (true_gate)
-    {
-        free(true_gate);
-        true_gate = NULL;
-    }
 }
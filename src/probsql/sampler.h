@@ -0,0 +1,494 @@
+// Methods for estimating the probability or expectation of any gate by sampling.
+#ifndef SAMPLER_H
+#define SAMPLER_H
+#include "enums.h"
+#include "structs.h"
+#include "serialize.h"
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include <math.h>
+
+// Number of samples that every instruction processes at a time.
+#define SAMPLER_BATCH_SIZE 1024
+
+// Number of samples used when probability() has to fall back to sampling.
+#define DEFAULT_MC_SAMPLES 100000
+
+// One step of a compiled circuit. It computes a whole batch of samples of one
+// gate into the register dest, from the registers of its operands.
+typedef struct
+{
+    gate_type gate_type;
+    int32 tag;
+    int32 dest;
+    int32 left;
+    int32 right;
+    base_variable_parameters parameters;
+
+    // The registers of the operands of an AND or OR, instead of left and right.
+    int32 num_operands;
+    int32 *operands;
+} sampler_instruction;
+
+// A circuit compiled for sampling. Registers are reused as soon as the gate
+// they hold has no more readers, so memory grows with the width of the circuit
+// rather than with its size.
+typedef struct
+{
+    int num_instructions;
+    int num_registers;
+    sampler_instruction *instructions;
+
+    // The storage behind the operand registers of the ANDs and ORs.
+    int32 *operand_registers;
+} sampler_program;
+
+// xoshiro256** pseudo-random generator, so that results only depend on the seed.
+typedef struct
+{
+    uint64 s[4];
+} sampler_rng;
+
+static inline uint64 rotate_left(uint64 x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+void sampler_rng_seed(sampler_rng *rng, uint64 seed)
+{
+    // Expand the seed with splitmix64, as recommended for xoshiro.
+    for (int i = 0; i < 4; ++i)
+    {
+        uint64 z = (seed += UINT64CONST(0x9E3779B97F4A7C15));
+        z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+        z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+static inline uint64 sampler_rng_next(sampler_rng *rng)
+{
+    uint64 *s = rng->s;
+    const uint64 result = rotate_left(s[1] * 5, 7) * 9;
+    const uint64 t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotate_left(s[3], 45);
+
+    return result;
+}
+
+// A uniform double in [0, 1).
+static inline double sampler_rng_uniform(sampler_rng *rng)
+{
+    return (sampler_rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Fills out with standard normal samples. Uniforms are drawn first and then
+// transformed in a separate loop, so that the transform vectorises.
+void sample_standard_normal(sampler_rng *rng, double *out, double *scratch, int count)
+{
+    const int pairs = (count + 1) / 2;
+
+    for (int k = 0; k < 2 * pairs; ++k)
+    {
+        scratch[k] = sampler_rng_uniform(rng);
+    }
+
+    // Box-Muller. 1 - u lies in (0, 1], so the logarithm is always finite.
+    for (int k = 0; k < pairs; ++k)
+    {
+        const double r = sqrt(-2.0 * log(1.0 - scratch[2 * k]));
+        const double theta = 2.0 * M_PI * scratch[2 * k + 1];
+        scratch[2 * k] = r * cos(theta);
+        scratch[2 * k + 1] = r * sin(theta);
+    }
+
+    memcpy(out, scratch, count * sizeof(double));
+}
+
+// Draws one Poisson sample.
+double sample_poisson(sampler_rng *rng, double lambda)
+{
+    if (lambda <= 0)
+    {
+        return 0;
+    }
+
+    // Inversion by sequential search is fast for small means.
+    if (lambda < 30)
+    {
+        const double u = sampler_rng_uniform(rng);
+        double p = exp(-lambda);
+        double cumulative = p;
+        int k = 0;
+
+        while (u > cumulative && k < 1000)
+        {
+            ++k;
+            p *= lambda / k;
+            cumulative += p;
+        }
+        return k;
+    }
+
+    // Transformed rejection with squeeze (Hormann's PTRS) for large means.
+    const double slam = sqrt(lambda);
+    const double loglam = log(lambda);
+    const double b = 0.931 + 2.53 * slam;
+    const double a = -0.059 + 0.02483 * b;
+    const double invalpha = 1.1239 + 1.1328 / (b - 3.4);
+    const double vr = 0.9277 - 3.6224 / (b - 2);
+
+    for (;;)
+    {
+        const double u = sampler_rng_uniform(rng) - 0.5;
+        const double v = sampler_rng_uniform(rng);
+        const double us = 0.5 - fabs(u);
+        const double k = floor((2 * a / us + b) * u + lambda + 0.43);
+
+        if (us >= 0.07 && v <= vr)
+        {
+            return k;
+        }
+        if (k < 0 || (us < 0.013 && v > us))
+        {
+            continue;
+        }
+        if (log(v) + log(invalpha) - log(a / (us * us) + b) <= -lambda + k * loglam - lgamma(k + 1))
+        {
+            return k;
+        }
+    }
+}
+
+/**
+ * @brief Compile a serialized circuit into a sampling program. The serialized
+ * form is already in topological order, so compiling only assigns registers.
+ *
+ * @param sg The serialized circuit
+ * @return sampler_program* The program. Its last instruction computes the root.
+ */
+sampler_program *compile_sampler_program(SerializedGate *sg)
+{
+    const int32 n = sg->num_nodes;
+    const int32 *operand_list = SERIALIZED_GATE_OPERANDS(sg);
+    sampler_program *program = (sampler_program *)palloc(sizeof(sampler_program));
+    program->num_instructions = n;
+    program->num_registers = 0;
+    program->instructions = (sampler_instruction *)palloc0(n * sizeof(sampler_instruction));
+
+    // The register lists of the ANDs and ORs, laid out like the operand list.
+    int32 *operand_registers = SERIALIZED_GATE_NUM_OPERANDS(sg) > 0
+                                   ? (int32 *)palloc(SERIALIZED_GATE_NUM_OPERANDS(sg) * sizeof(int32))
+                                   : NULL;
+    program->operand_registers = operand_registers;
+
+    // The last gate that reads each gate. The root is read by the caller.
+    int32 *last_use = (int32 *)palloc(n * sizeof(int32));
+    for (int32 i = 0; i < n; ++i)
+    {
+        const int32 *operands;
+        const int32 count = gate_node_operands(operand_list, &sg->nodes[i], &operands);
+
+        last_use[i] = n;
+        for (int32 k = 0; k < count; ++k)
+        {
+            last_use[operands[k]] = i;
+        }
+    }
+
+    int32 *registers = (int32 *)palloc(n * sizeof(int32));
+    int32 *free_registers = (int32 *)palloc(n * sizeof(int32));
+    int num_free = 0;
+
+    for (int32 i = 0; i < n; ++i)
+    {
+        serialized_gate_node *node = &sg->nodes[i];
+        sampler_instruction *instruction = &program->instructions[i];
+
+        instruction->gate_type = node->gate_type;
+        instruction->tag = node->tag;
+        instruction->parameters = node->parameters;
+
+        const int32 *operands;
+        const int32 count = gate_node_operands(operand_list, node, &operands);
+        if (is_junction_node(node))
+        {
+            instruction->left = -1;
+            instruction->right = -1;
+            instruction->num_operands = count;
+            instruction->operands = &operand_registers[node->left];
+            for (int32 k = 0; k < count; ++k)
+            {
+                instruction->operands[k] = registers[operands[k]];
+            }
+        }
+        else
+        {
+            instruction->left = node->left >= 0 ? registers[node->left] : -1;
+            instruction->right = node->right >= 0 ? registers[node->right] : -1;
+        }
+
+        registers[i] = num_free > 0 ? free_registers[--num_free] : program->num_registers++;
+        instruction->dest = registers[i];
+
+        // Release the registers of operands that nobody reads any more. An operand
+        // may be read twice by the same gate, e.g. x + x, but is released once.
+        for (int32 k = 0; k < count; ++k)
+        {
+            if (last_use[operands[k]] == i)
+            {
+                free_registers[num_free++] = registers[operands[k]];
+                last_use[operands[k]] = -1;
+            }
+        }
+    }
+
+    pfree(last_use);
+    pfree(registers);
+    pfree(free_registers);
+    return program;
+}
+
+// Runs one instruction over a batch of samples.
+void execute_sampler_instruction(sampler_instruction *instruction, double *registers,
+                                 double *scratch, sampler_rng *rng, int count)
+{
+    double *out = registers + (Size)instruction->dest * SAMPLER_BATCH_SIZE;
+    const double *x = instruction->left >= 0 ? registers + (Size)instruction->left * SAMPLER_BATCH_SIZE : NULL;
+    const double *y = instruction->right >= 0 ? registers + (Size)instruction->right * SAMPLER_BATCH_SIZE : NULL;
+
+    switch (instruction->gate_type)
+    {
+    case BASE_VARIABLE:
+        if (instruction->tag == GAUSSIAN)
+        {
+            const double mean = instruction->parameters.gaussian_parameters.mean;
+            const double stddev = instruction->parameters.gaussian_parameters.stddev;
+
+            if (stddev == 0)
+            {
+                for (int k = 0; k < count; ++k)
+                    out[k] = mean;
+            }
+            else
+            {
+                sample_standard_normal(rng, out, scratch, count);
+                for (int k = 0; k < count; ++k)
+                    out[k] = mean + stddev * out[k];
+            }
+        }
+        else
+        {
+            const double lambda = instruction->parameters.poisson_parameters.lambda;
+            for (int k = 0; k < count; ++k)
+                out[k] = sample_poisson(rng, lambda);
+        }
+        break;
+    case COMPOSITE_VARIABLE:
+        switch (instruction->tag)
+        {
+        case PLUS:
+        case SUM:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] + y[k];
+            break;
+        case MINUS:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] - y[k];
+            break;
+        case TIMES:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] * y[k];
+            break;
+        case DIVIDE:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] / y[k];
+            break;
+        case MAX:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] > y[k] ? x[k] : y[k];
+            break;
+        case MIN:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] < y[k] ? x[k] : y[k];
+            break;
+        case COUNT:
+            // The running count grows by one for every row, whatever its value.
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] + 1;
+            break;
+        }
+        break;
+    case CONDITION:
+        // Conditions are sampled as indicators, 1 when they hold and 0 otherwise.
+        switch (instruction->tag)
+        {
+        case LESS_THAN_OR_EQUAL:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] <= y[k];
+            break;
+        case LESS_THAN:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] < y[k];
+            break;
+        case MORE_THAN_OR_EQUAL:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] >= y[k];
+            break;
+        case MORE_THAN:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] > y[k];
+            break;
+        case EQUAL_TO:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] == y[k];
+            break;
+        case NOT_EQUAL_TO:
+            for (int k = 0; k < count; ++k)
+                out[k] = x[k] != y[k];
+            break;
+        case AND:
+        case OR:
+        {
+            // Folded in one operand at a time, each pass over the whole batch.
+            const double *first = registers + (Size)instruction->operands[0] * SAMPLER_BATCH_SIZE;
+            memcpy(out, first, count * sizeof(double));
+
+            for (int32 j = 1; j < instruction->num_operands; ++j)
+            {
+                const double *z = registers + (Size)instruction->operands[j] * SAMPLER_BATCH_SIZE;
+                if (instruction->tag == AND)
+                {
+                    for (int k = 0; k < count; ++k)
+                        out[k] = out[k] * z[k];
+                }
+                else
+                {
+                    for (int k = 0; k < count; ++k)
+                        out[k] = out[k] > z[k] ? out[k] : z[k];
+                }
+            }
+            break;
+        }
+        }
+        break;
+    case PLACEHOLDER_TRUE:
+        for (int k = 0; k < count; ++k)
+            out[k] = 1;
+        break;
+    case PLACEHOLDER_FALSE:
+        for (int k = 0; k < count; ++k)
+            out[k] = 0;
+        break;
+    }
+}
+
+// A compiled circuit together with everything needed to keep drawing samples of it.
+typedef struct
+{
+    sampler_program *program;
+    double *registers;
+    double *scratch;
+
+    // The register of the root gate.
+    const double *result;
+
+    sampler_rng rng;
+} sampler_state;
+
+/**
+ * @brief Prepare to draw samples of a circuit.
+ *
+ * @param state The state to set up
+ * @param sg The serialized circuit
+ * @param seed Seed for the pseudo-random generator
+ */
+void init_sampler(sampler_state *state, SerializedGate *sg, uint64 seed)
+{
+    state->program = compile_sampler_program(sg);
+    state->registers = (double *)palloc((Size)state->program->num_registers * SAMPLER_BATCH_SIZE * sizeof(double));
+    state->scratch = (double *)palloc((SAMPLER_BATCH_SIZE + 1) * sizeof(double));
+    state->result = state->registers +
+                    (Size)state->program->instructions[state->program->num_instructions - 1].dest * SAMPLER_BATCH_SIZE;
+    sampler_rng_seed(&state->rng, seed);
+}
+
+/**
+ * @brief Draw more samples of the root gate. Successive calls continue the same
+ * pseudo-random sequence.
+ *
+ * @param state The sampler
+ * @param samples The number of samples to draw
+ * @return double The sum of the samples
+ */
+double draw_samples(sampler_state *state, int64 samples)
+{
+    sampler_program *program = state->program;
+    double total = 0;
+
+    for (int64 done = 0; done < samples; done += SAMPLER_BATCH_SIZE)
+    {
+        const int count = (int)Min(SAMPLER_BATCH_SIZE, samples - done);
+
+        CHECK_FOR_INTERRUPTS();
+
+        for (int i = 0; i < program->num_instructions; ++i)
+        {
+            execute_sampler_instruction(&program->instructions[i], state->registers, state->scratch, &state->rng, count);
+        }
+
+        for (int k = 0; k < count; ++k)
+        {
+            total += state->result[k];
+        }
+    }
+
+    return total;
+}
+
+void free_sampler(sampler_state *state)
+{
+    pfree(state->registers);
+    pfree(state->scratch);
+    pfree(state->program->instructions);
+    if (state->program->operand_registers != NULL)
+    {
+        pfree(state->program->operand_registers);
+    }
+    pfree(state->program);
+}
+
+/**
+ * @brief Estimate the mean value of a circuit by sampling. For a condition gate
+ * this is the probability that it holds. Every base variable is drawn once per
+ * sample, so shared variables stay correlated.
+ *
+ * @param sg The serialized circuit
+ * @param samples The number of samples to draw
+ * @param seed Seed for the pseudo-random generator
+ * @return double The sample mean of the root gate
+ */
+double sample_mean(SerializedGate *sg, int64 samples, uint64 seed)
+{
+    if (samples <= 0)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Number of samples must be positive: " INT64_FORMAT, samples));
+    }
+
+    sampler_state state;
+    init_sampler(&state, sg, seed);
+    const double total = draw_samples(&state, samples);
+    free_sampler(&state);
+
+    return total / samples;
+}
+#endif
@@ -0,0 +1,1200 @@
+// Methods for converting a circuit to and from its on-disk form.
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+#include "enums.h"
+#include "structs.h"
+#include "stringify.h"
+#include "gate.h"
+#include "support.h"
+#include "hash.h"
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "libpq/pqformat.h"
+#include "utils/hsearch.h"
+
+// The number of bytes needed to store the nodes of a circuit of num_nodes gates.
+#define SERIALIZED_GATE_SIZE(num_nodes) \
+    (offsetof(SerializedGate, nodes) + (num_nodes) * sizeof(serialized_gate_node))
+
+// The operand list of the ANDs and ORs of a circuit, and its length.
+#define SERIALIZED_GATE_OPERANDS(sg) ((int32 *)&(sg)->nodes[(sg)->num_nodes])
+#define SERIALIZED_GATE_NUM_OPERANDS(sg) \
+    ((int32)((VARSIZE(sg) - SERIALIZED_GATE_SIZE((sg)->num_nodes)) / sizeof(int32)))
+
+// The root of a serialized circuit is always the last node.
+#define SERIALIZED_GATE_ROOT(sg) (&(sg)->nodes[(sg)->num_nodes - 1])
+
+// fmgr-style accessors for gate datums.
+#define DatumGetSerializedGate(X) ((SerializedGate *)PG_DETOAST_DATUM(X))
+#define PG_GETARG_SERIALIZED_GATE(n) DatumGetSerializedGate(PG_GETARG_DATUM(n))
+#define PG_GETARG_GATE(n) deserialize_gate(PG_GETARG_SERIALIZED_GATE(n))
+#define PG_RETURN_GATE(g) PG_RETURN_POINTER(serialize_gate(g))
+
+// The two operands of a binary gate are read as a list of two, starting at left.
+StaticAssertDecl(offsetof(serialized_gate_node, right) == offsetof(serialized_gate_node, left) + sizeof(int32),
+                 "the operands of a gate must be adjacent");
+
+// Whether a gate is an AND or an OR, whose operands are in the operand list.
+static inline bool is_junction_node(const serialized_gate_node *node)
+{
+    return node->gate_type == CONDITION && !condition_is_comparator(node->tag);
+}
+
+/**
+ * @brief The operands of a gate of a serialized circuit, whatever its kind.
+ *
+ * @param operand_list The operand list of the circuit
+ * @param node The gate
+ * @param operands Receives the positions of the operands
+ * @return int32 The number of operands
+ */
+static inline int32 gate_node_operands(const int32 *operand_list, serialized_gate_node *node, const int32 **operands)
+{
+    if (is_junction_node(node))
+    {
+        *operands = operand_list + node->left;
+        return node->right;
+    }
+
+    *operands = &node->left;
+    return node->left >= 0 ? 2 : 0;
+}
+
+/************************************************
+ * Hash-consing of gates
+ ************************************************/
+
+// Everything that determines the identity of a gate. Operands are identified
+// by their own uuids, so equal subcircuits get equal uuids wherever they are.
+// The operands of an AND or OR are hashed into left as one list.
+typedef struct
+{
+    gate_type gate_type;
+    int32 tag;
+    base_variable_parameters parameters;
+    pg_uuid_t variable_id;
+    probsqlHashKey left;
+    probsqlHashKey right;
+} gate_identity;
+
+// Builds a serialized circuit in which every distinct subcircuit is stored once.
+typedef struct
+{
+    // The circuit built so far. It grows as nodes are added.
+    SerializedGate *result;
+    int capacity;
+
+    // The operand list of the ANDs and ORs built so far. It is appended to the
+    // circuit when the builder is finished.
+    int32 *operands;
+    int num_operands;
+    int operands_capacity;
+
+    // Set when an AND or OR took over the operands of another, which may be
+    // left without any users.
+    bool has_unused_nodes;
+
+    // The uuid of every node in result, by position.
+    probsqlHashKey *keys;
+
+    // Maps the uuid of every node in result to its position.
+    HTAB *interned;
+} GateBuilder;
+
+void init_gate_builder(GateBuilder *builder, int expected_nodes)
+{
+    HASHCTL ctl;
+
+    builder->capacity = Max(expected_nodes, 4);
+    builder->result = (SerializedGate *)palloc0(SERIALIZED_GATE_SIZE(builder->capacity));
+    builder->result->num_nodes = 0;
+    builder->operands_capacity = 16;
+    builder->operands = (int32 *)palloc(builder->operands_capacity * sizeof(int32));
+    builder->num_operands = 0;
+    builder->has_unused_nodes = false;
+    builder->keys = (probsqlHashKey *)palloc(builder->capacity * sizeof(probsqlHashKey));
+
+    memset(&ctl, 0, sizeof(HASHCTL));
+    ctl.keysize = sizeof(probsqlHashKey);
+    ctl.entrysize = sizeof(probsqlHashEntry);
+    ctl.hcxt = CurrentMemoryContext;
+    builder->interned = hash_create("probsql interned gates", builder->capacity, &ctl,
+                                    HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/**
+ * @brief Work out the uuid of a gate from its contents and the uuids of its operands.
+ *
+ * @param node The gate
+ * @param operand_list The operand list that an AND or OR refers to
+ * @param keys The uuids of the gates that node's operands refer to, by position
+ * @param key Receives the uuid of node
+ */
+void gate_node_key(serialized_gate_node *node, const int32 *operand_list, probsqlHashKey *keys, probsqlHashKey *key)
+{
+    gate_identity identity;
+    memset(&identity, 0, sizeof(gate_identity));
+    identity.gate_type = node->gate_type;
+    identity.tag = node->tag;
+    if (node->gate_type == BASE_VARIABLE)
+    {
+        identity.parameters = node->parameters;
+        identity.variable_id = node->variable_id;
+    }
+
+    if (is_junction_node(node))
+    {
+        probsqlHashKey *operand_keys = (probsqlHashKey *)palloc(node->right * sizeof(probsqlHashKey));
+        for (int32 k = 0; k < node->right; ++k)
+        {
+            operand_keys[k] = keys[operand_list[node->left + k]];
+        }
+        probsql_hash_bytes(operand_keys, node->right * sizeof(probsqlHashKey), &identity.left);
+        pfree(operand_keys);
+    }
+    else
+    {
+        if (node->left >= 0)
+        {
+            identity.left = keys[node->left];
+        }
+        if (node->right >= 0)
+        {
+            identity.right = keys[node->right];
+        }
+    }
+
+    probsql_hash_bytes(&identity, sizeof(gate_identity), key);
+}
+
+// Whether two gates of the circuit being built are the same. Their operands are
+// canonical already, so equal gates have equal operands.
+static bool same_gate_node(GateBuilder *builder, serialized_gate_node *a, serialized_gate_node *b)
+{
+    if (!is_junction_node(a) || !is_junction_node(b))
+    {
+        return memcmp(a, b, sizeof(serialized_gate_node)) == 0;
+    }
+
+    return a->tag == b->tag && a->right == b->right &&
+           memcmp(&builder->operands[a->left], &builder->operands[b->left], a->right * sizeof(int32)) == 0;
+}
+
+/**
+ * @brief Add a gate to the circuit being built, unless an equal gate is already in it.
+ * The operands of node must already be positions in the builder's circuit. ANDs
+ * and ORs are added with intern_junction_node instead.
+ *
+ * @param builder The builder
+ * @param node The gate to add
+ * @return int32 The position of the canonical copy of node
+ */
+int32 intern_gate_node(GateBuilder *builder, serialized_gate_node *node)
+{
+    probsqlHashKey key;
+    gate_node_key(node, builder->operands, builder->keys, &key);
+
+    bool found;
+    probsqlHashEntry *entry = (probsqlHashEntry *)hash_search(builder->interned, &key, HASH_ENTER, &found);
+
+    // Anything but an equal gate is a hash collision, and the gate is simply stored again.
+    if (found && same_gate_node(builder, &builder->result->nodes[entry->position], node))
+    {
+        return entry->position;
+    }
+
+    SerializedGate *result = builder->result;
+    if (result->num_nodes == builder->capacity)
+    {
+        builder->capacity *= 2;
+        result = (SerializedGate *)repalloc(result, SERIALIZED_GATE_SIZE(builder->capacity));
+        builder->keys = (probsqlHashKey *)repalloc(builder->keys, builder->capacity * sizeof(probsqlHashKey));
+        builder->result = result;
+    }
+
+    const int32 position = result->num_nodes++;
+    memcpy(&result->nodes[position], node, sizeof(serialized_gate_node));
+    builder->keys[position] = key;
+    if (!found)
+    {
+        entry->position = position;
+    }
+
+    return position;
+}
+
+// Appends an operand to the list of the AND or OR being built, which starts at
+// start, unless it is in there already.
+static void add_junction_operand(GateBuilder *builder, int32 start, int32 position)
+{
+    for (int32 k = start; k < builder->num_operands; ++k)
+    {
+        if (builder->operands[k] == position)
+        {
+            return;
+        }
+    }
+
+    if (builder->num_operands == builder->operands_capacity)
+    {
+        builder->operands_capacity *= 2;
+        builder->operands = (int32 *)repalloc(builder->operands, builder->operands_capacity * sizeof(int32));
+    }
+    builder->operands[builder->num_operands++] = position;
+}
+
+/**
+ * @brief Add an AND or OR of any number of conditions to the circuit being built,
+ * as a single gate. Operands that are themselves ANDs of an AND, or ORs of an OR,
+ * are replaced by their own operands, and repeated operands are only used once,
+ * so X && (Y && X) becomes the one gate X && Y. TRUE is dropped from an AND and
+ * FALSE from an OR, while FALSE decides an AND and TRUE an OR.
+ *
+ * @param builder The builder
+ * @param tag AND or OR
+ * @param positions The positions of the operands in the builder's circuit
+ * @param count The number of operands, at least one
+ * @return int32 The position of the gate, or of the operand if only one is left
+ */
+int32 intern_junction_node(GateBuilder *builder, condition_type tag, const int32 *positions, int count)
+{
+    const int32 start = builder->num_operands;
+    const gate_type neutral = tag == AND ? PLACEHOLDER_TRUE : PLACEHOLDER_FALSE;
+    const gate_type absorbing = tag == AND ? PLACEHOLDER_FALSE : PLACEHOLDER_TRUE;
+    int32 last_neutral = -1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        serialized_gate_node *operand = &builder->result->nodes[positions[i]];
+
+        if (operand->gate_type == absorbing)
+        {
+            builder->num_operands = start;
+            builder->has_unused_nodes = true;
+            return positions[i];
+        }
+
+        if (operand->gate_type == neutral)
+        {
+            last_neutral = positions[i];
+            builder->has_unused_nodes = true;
+        }
+        else if (is_junction_node(operand) && operand->tag == tag)
+        {
+            // The operand list may move as it grows, so it is read by index.
+            const int32 first = operand->left;
+            const int32 num = operand->right;
+            for (int32 k = 0; k < num; ++k)
+            {
+                add_junction_operand(builder, start, builder->operands[first + k]);
+            }
+            builder->has_unused_nodes = true;
+        }
+        else
+        {
+            add_junction_operand(builder, start, positions[i]);
+        }
+    }
+
+    // Every operand was neutral.
+    if (builder->num_operands == start)
+    {
+        return last_neutral;
+    }
+
+    if (builder->num_operands - start == 1)
+    {
+        builder->num_operands = start;
+        return builder->operands[start];
+    }
+
+    serialized_gate_node node;
+    memset(&node, 0, sizeof(serialized_gate_node));
+    node.gate_type = CONDITION;
+    node.tag = tag;
+    node.left = start;
+    node.right = builder->num_operands - start;
+
+    const int32 position = intern_gate_node(builder, &node);
+
+    // An equal gate was there already, and has its own copy of the operands.
+    if (builder->result->nodes[position].left != start)
+    {
+        builder->num_operands = start;
+    }
+    return position;
+}
+
+/**
+ * @brief Add a gate of another circuit to the circuit being built.
+ *
+ * @param builder The builder
+ * @param sg The other circuit
+ * @param i The position of the gate in sg
+ * @param map The new position of every operand of the gate
+ * @return int32 The new position of the gate
+ */
+int32 intern_mapped_node(GateBuilder *builder, SerializedGate *sg, int32 i, const int32 *map)
+{
+    serialized_gate_node node = sg->nodes[i];
+
+    if (is_junction_node(&node))
+    {
+        const int32 *operands = SERIALIZED_GATE_OPERANDS(sg) + node.left;
+        int32 *mapped = (int32 *)palloc(node.right * sizeof(int32));
+        for (int32 k = 0; k < node.right; ++k)
+        {
+            mapped[k] = map[operands[k]];
+        }
+
+        const int32 position = intern_junction_node(builder, node.tag, mapped, node.right);
+        pfree(mapped);
+        return position;
+    }
+
+    if (node.left >= 0)
+    {
+        node.left = map[node.left];
+    }
+    if (node.right >= 0)
+    {
+        node.right = map[node.right];
+    }
+    return intern_gate_node(builder, &node);
+}
+
+/**
+ * @brief Add a whole serialized circuit to the circuit being built.
+ *
+ * @param builder The builder
+ * @param sg The circuit to add
+ * @param map Receives the new position of every node of sg
+ * @return int32 The new position of the root of sg
+ */
+int32 intern_serialized_gate(GateBuilder *builder, SerializedGate *sg, int32 *map)
+{
+    for (int i = 0; i < sg->num_nodes; ++i)
+    {
+        map[i] = intern_mapped_node(builder, sg, i, map);
+    }
+
+    return map[sg->num_nodes - 1];
+}
+
+// Turns what has been built into a varlena, with the operand list after the nodes.
+// The last node must be the root.
+SerializedGate *finish_gate_builder(GateBuilder *builder)
+{
+    const Size nodes_size = SERIALIZED_GATE_SIZE(builder->result->num_nodes);
+    const Size size = nodes_size + builder->num_operands * sizeof(int32);
+
+    SerializedGate *result = builder->result;
+    if (size > SERIALIZED_GATE_SIZE(builder->capacity))
+    {
+        result = (SerializedGate *)repalloc(result, size);
+    }
+    memcpy((char *)result + nodes_size, builder->operands, builder->num_operands * sizeof(int32));
+    SET_VARSIZE(result, size);
+
+    hash_destroy(builder->interned);
+    pfree(builder->keys);
+    pfree(builder->operands);
+
+    return result;
+}
+
+/**
+ * @brief Copy the part of a circuit that is reachable from one of its gates,
+ * so that the gate becomes the root and no unused gates are left behind.
+ *
+ * @param sg The circuit
+ * @param root The position of the new root
+ * @return SerializedGate* The new circuit
+ */
+SerializedGate *extract_serialized_subgate(SerializedGate *sg, int32 root)
+{
+    const int32 *operand_list = SERIALIZED_GATE_OPERANDS(sg);
+    char *reachable = (char *)palloc0(root + 1);
+    reachable[root] = true;
+
+    for (int32 i = root; i >= 0; --i)
+    {
+        if (reachable[i])
+        {
+            const int32 *operands;
+            const int32 count = gate_node_operands(operand_list, &sg->nodes[i], &operands);
+            for (int32 k = 0; k < count; ++k)
+            {
+                reachable[operands[k]] = true;
+            }
+        }
+    }
+
+    GateBuilder builder;
+    init_gate_builder(&builder, root + 1);
+    int32 *map = (int32 *)palloc((root + 1) * sizeof(int32));
+
+    for (int32 i = 0; i <= root; ++i)
+    {
+        if (reachable[i])
+        {
+            map[i] = intern_mapped_node(&builder, sg, i, map);
+        }
+    }
+
+    pfree(reachable);
+    pfree(map);
+    return finish_gate_builder(&builder);
+}
+
+/**
+ * @brief Finish a builder whose root may not be its last node, or which may hold
+ * gates that nothing uses any more. Only what the root uses is kept.
+ *
+ * @param builder The builder
+ * @param root The position of the root
+ * @return SerializedGate* The circuit
+ */
+SerializedGate *finish_gate_builder_at(GateBuilder *builder, int32 root)
+{
+    const bool compact = builder->has_unused_nodes || root != builder->result->num_nodes - 1;
+    SerializedGate *result = finish_gate_builder(builder);
+
+    if (compact)
+    {
+        SerializedGate *extracted = extract_serialized_subgate(result, root);
+        pfree(result);
+        result = extracted;
+    }
+    return result;
+}
+
+/**
+ * @brief The uuid of the root of a serialized circuit. It only depends on what
+ * the circuit computes, not on the order its gates are stored in, so it identifies
+ * the circuit for comparison and hashing.
+ *
+ * @param sg The serialized circuit
+ * @param key Receives the uuid
+ */
+void serialized_gate_key(SerializedGate *sg, probsqlHashKey *key)
+{
+    probsqlHashKey *keys = (probsqlHashKey *)palloc(sg->num_nodes * sizeof(probsqlHashKey));
+
+    for (int32 i = 0; i < sg->num_nodes; ++i)
+    {
+        gate_node_key(&sg->nodes[i], SERIALIZED_GATE_OPERANDS(sg), keys, &keys[i]);
+    }
+
+    *key = keys[sg->num_nodes - 1];
+    pfree(keys);
+}
+
+/**
+ * @brief A total order on circuits, by the uuids of their roots. Circuits compare
+ * equal exactly when they compute the same thing from the same variables.
+ *
+ * @param sg1 The first circuit
+ * @param sg2 The second circuit
+ * @return int Less than, equal to or greater than 0, as for memcmp
+ */
+int compare_serialized_gates(SerializedGate *sg1, SerializedGate *sg2)
+{
+    // Copies of the same circuit need no hashing.
+    if (VARSIZE(sg1) == VARSIZE(sg2) && memcmp(sg1, sg2, VARSIZE(sg1)) == 0)
+    {
+        return 0;
+    }
+
+    probsqlHashKey key1, key2;
+    serialized_gate_key(sg1, &key1);
+    serialized_gate_key(sg2, &key2);
+    return memcmp(&key1, &key2, sizeof(probsqlHashKey));
+}
+
+/************************************************
+ * Conversion between the two forms of a circuit
+ ************************************************/
+
+// Remembers where a gate of the pointer form ended up in the serialized form,
+// so that gates shared in memory are only visited once.
+typedef struct
+{
+    Gate *gate;
+    int32 position;
+} flattened_gate_entry;
+
+// Adds the circuit rooted at gate to the builder in post-order, and
+// returns the position of gate.
+int32 flatten_gate(Gate *gate, GateBuilder *builder, HTAB *flattened)
+{
+    flattened_gate_entry *entry = (flattened_gate_entry *)hash_search(flattened, &gate, HASH_FIND, NULL);
+    if (entry != NULL)
+    {
+        return entry->position;
+    }
+
+    check_stack_depth();
+
+    serialized_gate_node node;
+    memset(&node, 0, sizeof(serialized_gate_node));
+    node.gate_type = gate->gate_type;
+    node.left = -1;
+    node.right = -1;
+
+    switch (gate->gate_type)
+    {
+    case BASE_VARIABLE:
+        node.tag = gate->gate_info.base_variable.distribution_type;
+        // Only copy the parameters the distribution has, so the rest stays zero.
+        if (node.tag == POISSON)
+        {
+            node.parameters.poisson_parameters = gate->gate_info.base_variable.base_variable_parameters.poisson_parameters;
+        }
+        else
+        {
+            node.parameters = gate->gate_info.base_variable.base_variable_parameters;
+        }
+        node.variable_id = gate->gate_info.base_variable.variable_id;
+        break;
+    case COMPOSITE_VARIABLE:
+        node.tag = gate->gate_info.comp_variable.opr;
+        node.left = flatten_gate(gate->gate_info.comp_variable.left_gate, builder, flattened);
+        node.right = flatten_gate(gate->gate_info.comp_variable.right_gate, builder, flattened);
+        break;
+    case CONDITION:
+        node.tag = gate->gate_info.condition.condition_type;
+        if (!condition_is_comparator(node.tag))
+        {
+            const int count = gate->gate_info.condition.num_operands;
+            int32 *positions = (int32 *)palloc(count * sizeof(int32));
+            for (int k = 0; k < count; ++k)
+            {
+                positions[k] = flatten_gate(gate->gate_info.condition.operands[k], builder, flattened);
+            }
+
+            const int32 position = intern_junction_node(builder, node.tag, positions, count);
+            pfree(positions);
+
+            entry = (flattened_gate_entry *)hash_search(flattened, &gate, HASH_ENTER, NULL);
+            entry->position = position;
+            return position;
+        }
+        node.left = flatten_gate(gate->gate_info.condition.left_gate, builder, flattened);
+        node.right = flatten_gate(gate->gate_info.condition.right_gate, builder, flattened);
+        break;
+    case PLACEHOLDER_TRUE:
+    case PLACEHOLDER_FALSE:
+        break;
+    default:
+        ereport(ERROR,
+                errcode(ERRCODE_DATA_CORRUPTED),
+                errmsg("Unrecognised gate type: %u", gate->gate_type));
+    }
+
+    const int32 position = intern_gate_node(builder, &node);
+
+    entry = (flattened_gate_entry *)hash_search(flattened, &gate, HASH_ENTER, NULL);
+    entry->position = position;
+    return position;
+}
+
+/**
+ * @brief Convert a circuit into a single self-contained varlena. Equal
+ * subcircuits are stored once.
+ *
+ * @param gate The root of the circuit
+ * @return SerializedGate* The circuit, with operands stored as positions instead of pointers
+ */
+SerializedGate *serialize_gate(Gate *gate)
+{
+    GateBuilder builder;
+    init_gate_builder(&builder, 16);
+
+    HASHCTL ctl;
+    memset(&ctl, 0, sizeof(HASHCTL));
+    ctl.keysize = sizeof(Gate *);
+    ctl.entrysize = sizeof(flattened_gate_entry);
+    ctl.hcxt = CurrentMemoryContext;
+    HTAB *flattened = hash_create("probsql flattened gates", 16, &ctl,
+                                  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    const int32 root = flatten_gate(gate, &builder, flattened);
+
+    hash_destroy(flattened);
+    return finish_gate_builder_at(&builder, root);
+}
+
+/**
+ * @brief Build the circuit of a single new base variable directly, without
+ * going through the pointer form or the hash-consing of a GateBuilder.
+ *
+ * @param tag The distribution
+ * @param parameters The parameters of the distribution
+ * @return SerializedGate* The circuit, holding a new draw
+ */
+SerializedGate *new_serialized_base_variable(distribution_type tag, base_variable_parameters parameters)
+{
+    SerializedGate *result = (SerializedGate *)palloc0(SERIALIZED_GATE_SIZE(1));
+    SET_VARSIZE(result, SERIALIZED_GATE_SIZE(1));
+    result->num_nodes = 1;
+
+    serialized_gate_node *node = &result->nodes[0];
+    node->gate_type = BASE_VARIABLE;
+    node->tag = tag;
+    node->left = -1;
+    node->right = -1;
+    node->parameters = parameters;
+    node->variable_id = new_variable_id();
+    return result;
+}
+
+/**
+ * @brief Check that a serialized circuit is well formed, so that it is safe to
+ * walk. Every operand must come before its parent and have the right kind of gate.
+ *
+ * @param sg The serialized circuit
+ */
+void validate_serialized_gate(SerializedGate *sg)
+{
+    if (VARSIZE(sg) < offsetof(SerializedGate, nodes) ||
+        sg->num_nodes <= 0 ||
+        VARSIZE(sg) < SERIALIZED_GATE_SIZE(sg->num_nodes) ||
+        (VARSIZE(sg) - SERIALIZED_GATE_SIZE(sg->num_nodes)) % sizeof(int32) != 0)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_DATA_CORRUPTED),
+                errmsg("Invalid gate size"));
+    }
+
+    const int32 *operand_list = SERIALIZED_GATE_OPERANDS(sg);
+    const int32 num_operands = SERIALIZED_GATE_NUM_OPERANDS(sg);
+
+    for (int i = 0; i < sg->num_nodes; ++i)
+    {
+        serialized_gate_node *node = &sg->nodes[i];
+        bool valid;
+
+        switch (node->gate_type)
+        {
+        case BASE_VARIABLE:
+            valid = node->tag == GAUSSIAN || node->tag == POISSON;
+            break;
+        case COMPOSITE_VARIABLE:
+            valid = node->tag >= PLUS && node->tag <= SUM &&
+                    node->left >= 0 && node->left < i &&
+                    node->right >= 0 && node->right < i &&
+                    is_prob_type(sg->nodes[node->left].gate_type) &&
+                    is_prob_type(sg->nodes[node->right].gate_type);
+            break;
+        case CONDITION:
+            if (node->tag == AND || node->tag == OR)
+            {
+                valid = node->left >= 0 && node->right >= 2 && node->right <= num_operands - node->left;
+                for (int32 k = 0; valid && k < node->right; ++k)
+                {
+                    const int32 operand = operand_list[node->left + k];
+                    valid = operand >= 0 && operand < i && !is_prob_type(sg->nodes[operand].gate_type);
+                }
+                break;
+            }
+            valid = node->tag >= LESS_THAN_OR_EQUAL && node->tag <= NOT_EQUAL_TO &&
+                    node->left >= 0 && node->left < i &&
+                    node->right >= 0 && node->right < i &&
+                    is_prob_type(sg->nodes[node->left].gate_type) &&
+                    is_prob_type(sg->nodes[node->right].gate_type);
+            break;
+        case PLACEHOLDER_TRUE:
+        case PLACEHOLDER_FALSE:
+            valid = true;
+            break;
+        default:
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            ereport(ERROR,
+                    errcode(ERRCODE_DATA_CORRUPTED),
+                    errmsg("Invalid gate at position %d", i));
+        }
+    }
+}
+
+/**
+ * @brief Rebuild the pointer form of a serialized circuit. All gates are
+ * allocated in one block, from the active arena if there is one, and visited
+ * once, in storage order. Shared subcircuits stay shared, i.e. they are the
+ * same Gate in memory.
+ *
+ * @param sg The serialized circuit
+ * @return Gate* The root of the circuit
+ */
+Gate *deserialize_gate(SerializedGate *sg)
+{
+    Gate *gates = alloc_gates(sg->num_nodes);
+    const int32 *operand_list = SERIALIZED_GATE_OPERANDS(sg);
+    const int32 num_operands = SERIALIZED_GATE_NUM_OPERANDS(sg);
+    Gate **operands = num_operands > 0 ? alloc_gate_operands(num_operands) : NULL;
+
+    for (int i = 0; i < sg->num_nodes; ++i)
+    {
+        serialized_gate_node *node = &sg->nodes[i];
+        Gate *gate = &gates[i];
+        gate->gate_type = node->gate_type;
+
+        switch (node->gate_type)
+        {
+        case BASE_VARIABLE:
+            gate->gate_info.base_variable.distribution_type = node->tag;
+            gate->gate_info.base_variable.base_variable_parameters = node->parameters;
+            gate->gate_info.base_variable.variable_id = node->variable_id;
+            break;
+        case COMPOSITE_VARIABLE:
+            gate->gate_info.comp_variable.opr = node->tag;
+            gate->gate_info.comp_variable.left_gate = &gates[node->left];
+            gate->gate_info.comp_variable.right_gate = &gates[node->right];
+            break;
+        case CONDITION:
+            gate->gate_info.condition.condition_type = node->tag;
+            if (is_junction_node(node))
+            {
+                // All the operand lists share one block, laid out as in sg.
+                gate->gate_info.condition.left_gate = NULL;
+                gate->gate_info.condition.right_gate = NULL;
+                gate->gate_info.condition.num_operands = node->right;
+                gate->gate_info.condition.operands = &operands[node->left];
+                for (int32 k = 0; k < node->right; ++k)
+                {
+                    operands[node->left + k] = &gates[operand_list[node->left + k]];
+                }
+            }
+            else
+            {
+                gate->gate_info.condition.left_gate = &gates[node->left];
+                gate->gate_info.condition.right_gate = &gates[node->right];
+                gate->gate_info.condition.num_operands = 0;
+                gate->gate_info.condition.operands = NULL;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return &gates[sg->num_nodes - 1];
+}
+
+/**
+ * @brief Join two serialized circuits under a new root, without rebuilding
+ * either of them. Subcircuits of the second operand that already occur in the
+ * first one are shared instead of copied.
+ *
+ * @param sg1 The left operand
+ * @param sg2 The right operand
+ * @param gate_type The type of the new root
+ * @param tag The operator of the new root
+ * @return SerializedGate* The new circuit
+ */
+SerializedGate *join_serialized_gates(SerializedGate *sg1, SerializedGate *sg2, gate_type gate_type, int32 tag)
+{
+    GateBuilder builder;
+    init_gate_builder(&builder, sg1->num_nodes + sg2->num_nodes + 1);
+
+    int32 *map = (int32 *)palloc(Max(sg1->num_nodes, sg2->num_nodes) * sizeof(int32));
+
+    serialized_gate_node root;
+    memset(&root, 0, sizeof(serialized_gate_node));
+    root.gate_type = gate_type;
+    root.tag = tag;
+    root.left = intern_serialized_gate(&builder, sg1, map);
+    root.right = intern_serialized_gate(&builder, sg2, map);
+
+    // An AND or OR takes over the operands of the ones it is joined with, so
+    // that chains of them stay a single gate.
+    const int32 position = is_junction_node(&root)
+                               ? intern_junction_node(&builder, tag, &root.left, 2)
+                               : intern_gate_node(&builder, &root);
+
+    pfree(map);
+    return finish_gate_builder_at(&builder, position);
+}
+
+/**
+ * @brief AND or OR any number of serialized conditions into one circuit, as a
+ * single gate. Conditions that are the same gate, e.g. the condition of one
+ * tuple reached through two aliases of its table, are only used once, so the
+ * circuit grows with the number of distinct conditions rather than with the
+ * number of operands.
+ *
+ * @param conditions The conditions, at least one
+ * @param count The number of conditions
+ * @param opr AND or OR
+ * @return SerializedGate* The conjunction or disjunction
+ */
+SerializedGate *combine_serialized_conditions(SerializedGate **conditions, int count, condition_type opr)
+{
+    int total_nodes = 1;
+    int max_nodes = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        total_nodes += conditions[i]->num_nodes;
+        max_nodes = Max(max_nodes, conditions[i]->num_nodes);
+    }
+
+    GateBuilder builder;
+    init_gate_builder(&builder, total_nodes);
+
+    int32 *map = (int32 *)palloc(max_nodes * sizeof(int32));
+    int32 *positions = (int32 *)palloc(count * sizeof(int32));
+    for (int i = 0; i < count; ++i)
+    {
+        positions[i] = intern_serialized_gate(&builder, conditions[i], map);
+    }
+
+    const int32 root = intern_junction_node(&builder, opr, positions, count);
+
+    pfree(map);
+    pfree(positions);
+    return finish_gate_builder_at(&builder, root);
+}
+
+/**
+ * @brief Check whether a serialized gate always has the same value
+ *
+ * @param sg The serialized gate
+ * @param value Receives the value of the gate, if it is constant
+ * @return bool Whether the gate is constant
+ */
+bool is_constant_serialized_gate(SerializedGate *sg, double *value)
+{
+    serialized_gate_node *root = SERIALIZED_GATE_ROOT(sg);
+
+    if (root->gate_type != BASE_VARIABLE || root->tag != GAUSSIAN ||
+        root->parameters.gaussian_parameters.stddev != 0)
+    {
+        return false;
+    }
+
+    *value = root->parameters.gaussian_parameters.mean;
+    return true;
+}
+
+/**
+ * @brief Performs some arithmetic operation on two serialized gates, i.e. X + Y
+ *
+ * @param sg1 The first probability gate
+ * @param sg2 The second probability gate
+ * @param opr The operator to apply
+ * @return SerializedGate* The new gate
+ */
+SerializedGate *combine_serialized_prob_gates(SerializedGate *sg1, SerializedGate *sg2, probabilistic_composition opr)
+{
+    // Check that both gates represent probability variables.
+    if (!is_prob_type(SERIALIZED_GATE_ROOT(sg1)->gate_type) || !is_prob_type(SERIALIZED_GATE_ROOT(sg2)->gate_type))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected condition gate instead of prob gate: %s %s",
+                       _stringify_gate(deserialize_gate(sg1)), _stringify_gate(deserialize_gate(sg2))));
+    }
+
+    // Optimisation: Arithmetic on constants is done straight away.
+    double x, y, value;
+    if (is_constant_serialized_gate(sg1, &x) && is_constant_serialized_gate(sg2, &y) &&
+        fold_constant_composition(x, y, opr, &value))
+    {
+        return serialize_gate(constant(value));
+    }
+
+    return join_serialized_gates(sg1, sg2, COMPOSITE_VARIABLE, opr);
+}
+
+/**
+ * @brief Create a condition from two serialized gates. Only comparator conditions
+ * are allowed, like X < Y or X = Y.
+ *
+ * @param sg1 The first probability gate
+ * @param sg2 The second probability gate
+ * @param opr The condition between the two
+ * @return SerializedGate* The new gate
+ */
+SerializedGate *create_serialized_condition(SerializedGate *sg1, SerializedGate *sg2, condition_type opr)
+{
+    // Check that gates are probability gates
+    if (!is_prob_type(SERIALIZED_GATE_ROOT(sg1)->gate_type) || !is_prob_type(SERIALIZED_GATE_ROOT(sg2)->gate_type))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected condition gate instead of prob gate: %s %s",
+                       _stringify_gate(deserialize_gate(sg1)), _stringify_gate(deserialize_gate(sg2))));
+    }
+
+    // Check that the condition is a comparator condition
+    if (!condition_is_comparator(opr))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected boolean condition instead of comparator condition"));
+    }
+
+    // Optimisation: Comparisons that hold for all values of their sides, or for
+    // none, are decided straight away.
+    support_interval *supports1 = serialized_gate_supports(sg1);
+    support_interval *supports2 = serialized_gate_supports(sg2);
+    bool holds;
+    const bool decided = decide_comparison(opr, supports1[sg1->num_nodes - 1], supports2[sg2->num_nodes - 1], &holds);
+
+    pfree(supports1);
+    pfree(supports2);
+
+    if (decided)
+    {
+        return serialize_gate(truth_gate(holds));
+    }
+
+    return join_serialized_gates(sg1, sg2, CONDITION, opr);
+}
+
+/**
+ * @brief Combine two serialized conditions. Only boolean conditions are allowed,
+ * like X AND Y or X OR Y.
+ *
+ * @param sg1 The first condition gate
+ * @param sg2 The second condition gate
+ * @param opr The operator (AND/OR) to combine the two conditions
+ * @return SerializedGate* The new gate
+ */
+SerializedGate *combine_two_serialized_conditions(SerializedGate *sg1, SerializedGate *sg2, condition_type opr)
+{
+    // Check that the gates are condition gates
+    if (is_prob_type(SERIALIZED_GATE_ROOT(sg1)->gate_type) || is_prob_type(SERIALIZED_GATE_ROOT(sg2)->gate_type))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected prob gate instead of condition gate: %s, %s",
+                       _stringify_gate(deserialize_gate(sg1)), _stringify_gate(deserialize_gate(sg2))));
+    }
+
+    // Check that the condition is a boolean condition
+    if (condition_is_comparator(opr))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("Detected comparator condition instead of boolean condition: %u", opr));
+    }
+
+    // Optimisation: TRUE and FALSE either decide the result or drop out, i.e.
+    // X AND TRUE = X, X AND FALSE = FALSE, X OR TRUE = TRUE and X OR FALSE = X.
+    const gate_type type1 = SERIALIZED_GATE_ROOT(sg1)->gate_type;
+    const gate_type type2 = SERIALIZED_GATE_ROOT(sg2)->gate_type;
+    if (is_placeholder_type(type1))
+    {
+        return (type1 == PLACEHOLDER_TRUE) == (opr == AND) ? sg2 : sg1;
+    }
+    else if (is_placeholder_type(type2))
+    {
+        return (type2 == PLACEHOLDER_TRUE) == (opr == AND) ? sg1 : sg2;
+    }
+
+    // Optimisation: X AND X = X OR X = X.
+    if (VARSIZE(sg1) == VARSIZE(sg2) && memcmp(sg1, sg2, VARSIZE(sg1)) == 0)
+    {
+        return sg1;
+    }
+
+    return join_serialized_gates(sg1, sg2, CONDITION, opr);
+}
+
+// The version of the binary form written by send_serialized_gate.
+#define GATE_BINARY_FORMAT_VERSION 2
+
+// Set in the flags of a base variable that has an id, i.e. is not a constant.
+#define GATE_BINARY_HAS_ID 0x01
+
+/**
+ * @brief Write a serialized circuit in binary form. Each gate only carries what
+ * its type needs:
+ * - base variables: the distribution, its parameters as IEEE doubles and, unless
+ *   it is a constant, its id,
+ * - composite variables and comparisons: the operator and the positions of the
+ *   operands,
+ * - ANDs and ORs: the operator, the number of operands and their positions,
+ * - TRUE and FALSE: nothing else.
+ * Integers are in network byte order, so the form is the same on every platform
+ * and nothing is lost.
+ *
+ * @param sg The serialized circuit
+ * @return bytea* The binary form
+ */
+bytea *send_serialized_gate(SerializedGate *sg)
+{
+    static const pg_uuid_t nil_id;
+    StringInfoData buf;
+
+    const int32 *operand_list = SERIALIZED_GATE_OPERANDS(sg);
+
+    pq_begintypsend(&buf);
+    pq_sendbyte(&buf, GATE_BINARY_FORMAT_VERSION);
+    pq_sendint32(&buf, sg->num_nodes);
+
+    for (int i = 0; i < sg->num_nodes; ++i)
+    {
+        serialized_gate_node *node = &sg->nodes[i];
+        pq_sendbyte(&buf, node->gate_type);
+
+        switch (node->gate_type)
+        {
+        case BASE_VARIABLE:
+        {
+            const bool has_id = memcmp(&node->variable_id, &nil_id, sizeof(pg_uuid_t)) != 0;
+            pq_sendbyte(&buf, node->tag);
+            pq_sendbyte(&buf, has_id ? GATE_BINARY_HAS_ID : 0);
+            if (node->tag == GAUSSIAN)
+            {
+                pq_sendfloat8(&buf, node->parameters.gaussian_parameters.mean);
+                pq_sendfloat8(&buf, node->parameters.gaussian_parameters.stddev);
+            }
+            else
+            {
+                pq_sendfloat8(&buf, node->parameters.poisson_parameters.lambda);
+            }
+            if (has_id)
+            {
+                pq_sendbytes(&buf, (char *)node->variable_id.data, UUID_LEN);
+            }
+            break;
+        }
+        case COMPOSITE_VARIABLE:
+        case CONDITION:
+            pq_sendbyte(&buf, node->tag);
+            if (is_junction_node(node))
+            {
+                pq_sendint32(&buf, node->right);
+                for (int32 k = 0; k < node->right; ++k)
+                {
+                    pq_sendint32(&buf, operand_list[node->left + k]);
+                }
+                break;
+            }
+            pq_sendint32(&buf, node->left);
+            pq_sendint32(&buf, node->right);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return pq_endtypsend(&buf);
+}
+
+/**
+ * @brief Read a circuit written by send_serialized_gate.
+ *
+ * @param buf The buffer holding the binary form
+ * @return SerializedGate* The circuit, checked with validate_serialized_gate
+ */
+SerializedGate *recv_serialized_gate(StringInfo buf)
+{
+    const int version = pq_getmsgbyte(buf);
+    if (version != GATE_BINARY_FORMAT_VERSION)
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                errmsg("Unsupported binary gate format version: %d", version));
+    }
+
+    // Every gate takes at least one byte of the message, so a count the rest of the
+    // message cannot hold is rejected before anything is allocated for it.
+    const int num_nodes = pq_getmsgint(buf, 4);
+    if (num_nodes <= 0 || num_nodes > buf->len - buf->cursor ||
+        num_nodes > (MaxAllocSize - offsetof(SerializedGate, nodes)) / sizeof(serialized_gate_node))
+    {
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                errmsg("Invalid number of gates: %d", num_nodes));
+    }
+
+    // The operand list is collected on the side and appended at the end.
+    int num_operands = 0;
+    int operands_capacity = 16;
+    int32 *operands = (int32 *)palloc(operands_capacity * sizeof(int32));
+
+    SerializedGate *result = (SerializedGate *)palloc0(SERIALIZED_GATE_SIZE(num_nodes));
+    result->num_nodes = num_nodes;
+
+    for (int i = 0; i < num_nodes; ++i)
+    {
+        serialized_gate_node *node = &result->nodes[i];
+        node->gate_type = pq_getmsgbyte(buf);
+        node->left = -1;
+        node->right = -1;
+
+        switch (node->gate_type)
+        {
+        case BASE_VARIABLE:
+        {
+            node->tag = pq_getmsgbyte(buf);
+            const int flags = pq_getmsgbyte(buf);
+            if (node->tag == GAUSSIAN)
+            {
+                node->parameters.gaussian_parameters.mean = pq_getmsgfloat8(buf);
+                node->parameters.gaussian_parameters.stddev = pq_getmsgfloat8(buf);
+            }
+            else
+            {
+                node->parameters.poisson_parameters.lambda = pq_getmsgfloat8(buf);
+            }
+            if (flags & GATE_BINARY_HAS_ID)
+            {
+                pq_copymsgbytes(buf, (char *)node->variable_id.data, UUID_LEN);
+            }
+            break;
+        }
+        case COMPOSITE_VARIABLE:
+        case CONDITION:
+            node->tag = pq_getmsgbyte(buf);
+            if (is_junction_node(node))
+            {
+                const int count = pq_getmsgint(buf, 4);
+                // Every operand takes four bytes of the message.
+                if (count < 2 || count > (buf->len - buf->cursor) / 4)
+                {
+                    ereport(ERROR,
+                            errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                            errmsg("Invalid number of operands: %d", count));
+                }
+                if (num_operands + count > operands_capacity)
+                {
+                    operands_capacity = Max(2 * operands_capacity, num_operands + count);
+                    operands = (int32 *)repalloc(operands, operands_capacity * sizeof(int32));
+                }
+
+                node->left = num_operands;
+                node->right = count;
+                for (int k = 0; k < count; ++k)
+                {
+                    operands[num_operands++] = pq_getmsgint(buf, 4);
+                }
+                break;
+            }
+            node->left = pq_getmsgint(buf, 4);
+            node->right = pq_getmsgint(buf, 4);
+            break;
+        default:
+            break;
+        }
+    }
+
+    const Size size = SERIALIZED_GATE_SIZE(num_nodes) + num_operands * sizeof(int32);
+    result = (SerializedGate *)repalloc(result, size);
+    memcpy(SERIALIZED_GATE_OPERANDS(result), operands, num_operands * sizeof(int32));
+    SET_VARSIZE(result, size);
+    pfree(operands);
+
+    validate_serialized_gate(result);
+    return result;
+}
+#endif
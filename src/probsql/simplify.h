@@ -0,0 +1,281 @@
+// Methods for rewriting a circuit into a smaller one with the same distribution.
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+#include "enums.h"
+#include "structs.h"
+#include "gate.h"
+#include "support.h"
+#include "serialize.h"
+#include "hash.h"
+
+#include "postgres.h"
+#include <math.h>
+
+// Sets node to a constant, i.e. a Gaussian without spread and without identity.
+void set_constant_node(serialized_gate_node *node, double value)
+{
+    memset(node, 0, sizeof(serialized_gate_node));
+    node->gate_type = BASE_VARIABLE;
+    node->tag = GAUSSIAN;
+    node->left = -1;
+    node->right = -1;
+    node->parameters.gaussian_parameters.mean = value;
+}
+
+// Sets node to the TRUE or FALSE placeholder.
+void set_truth_node(serialized_gate_node *node, bool value)
+{
+    memset(node, 0, sizeof(serialized_gate_node));
+    node->gate_type = value ? PLACEHOLDER_TRUE : PLACEHOLDER_FALSE;
+    node->left = -1;
+    node->right = -1;
+}
+
+/**
+ * @brief Merge X + Y or X - Y into a single base variable, when X and Y are
+ * independent and the result has a known distribution: Gaussians (constants
+ * included) add up to a Gaussian, and Poissons add up to a Poisson.
+ *
+ * The merged variable is a new draw. Its id is derived from the ids of X and Y,
+ * so merging the same variables always gives the same variable.
+ *
+ * @param x The left operand, a base variable
+ * @param y The right operand, a base variable
+ * @param opr The operator, PLUS, SUM or MINUS
+ * @param result Receives the merged variable
+ * @return bool false if the operands cannot be merged
+ */
+bool merge_base_variables(serialized_gate_node *x, serialized_gate_node *y, probabilistic_composition opr,
+                          serialized_gate_node *result)
+{
+    const bool subtract = opr == MINUS;
+
+    // The same variable twice is not independent of itself.
+    if (x->tag != y->tag || memcmp(&x->variable_id, &y->variable_id, sizeof(pg_uuid_t)) == 0)
+    {
+        return false;
+    }
+
+    memset(result, 0, sizeof(serialized_gate_node));
+    result->gate_type = BASE_VARIABLE;
+    result->tag = x->tag;
+    result->left = -1;
+    result->right = -1;
+
+    if (x->tag == GAUSSIAN)
+    {
+        const gaussian_parameters px = x->parameters.gaussian_parameters;
+        const gaussian_parameters py = y->parameters.gaussian_parameters;
+        result->parameters.gaussian_parameters.mean = subtract ? px.mean - py.mean : px.mean + py.mean;
+        result->parameters.gaussian_parameters.stddev = sqrt(px.stddev * px.stddev + py.stddev * py.stddev);
+    }
+    else
+    {
+        // The difference of two Poissons is not a Poisson.
+        if (subtract)
+        {
+            return false;
+        }
+        result->parameters.poisson_parameters.lambda =
+            x->parameters.poisson_parameters.lambda + y->parameters.poisson_parameters.lambda;
+    }
+
+    pg_uuid_t ids[2] = {x->variable_id, y->variable_id};
+    probsqlHashKey key;
+    probsql_hash_bytes(ids, sizeof(ids), &key);
+    result->variable_id = key.gate_id;
+
+    return true;
+}
+
+/**
+ * @brief Rewrite an AND or OR of a circuit into the circuit being built: TRUE
+ * and FALSE operands are dropped or decide the result, i.e. X AND TRUE = X,
+ * X AND FALSE = FALSE, X OR TRUE = TRUE and X OR FALSE = X, and repeated
+ * operands are used once.
+ *
+ * @param builder The builder of the new circuit
+ * @param sg The old circuit
+ * @param i The position of the AND or OR in sg
+ * @param map The new position of every operand
+ * @return int32 The new position of the gate
+ */
+int32 simplify_junction_node(GateBuilder *builder, SerializedGate *sg, int32 i, const int32 *map)
+{
+    serialized_gate_node *node = &sg->nodes[i];
+    const int32 *operands = SERIALIZED_GATE_OPERANDS(sg) + node->left;
+
+    // The placeholder that decides an AND or OR, and the one that drops out of it.
+    const gate_type absorbing = node->tag == AND ? PLACEHOLDER_FALSE : PLACEHOLDER_TRUE;
+    const gate_type neutral = node->tag == AND ? PLACEHOLDER_TRUE : PLACEHOLDER_FALSE;
+
+    int32 *kept = (int32 *)palloc(node->right * sizeof(int32));
+    int count = 0;
+    int32 result = -1;
+
+    for (int32 k = 0; k < node->right && result < 0; ++k)
+    {
+        const int32 position = map[operands[k]];
+        const gate_type type = builder->result->nodes[position].gate_type;
+
+        if (type == absorbing)
+        {
+            result = position;
+        }
+        else if (type != neutral)
+        {
+            kept[count++] = position;
+        }
+    }
+
+    if (result < 0)
+    {
+        if (count > 0)
+        {
+            result = intern_junction_node(builder, node->tag, kept, count);
+        }
+        else
+        {
+            serialized_gate_node truth;
+            set_truth_node(&truth, neutral == PLACEHOLDER_TRUE);
+            result = intern_gate_node(builder, &truth);
+        }
+    }
+
+    pfree(kept);
+    return result;
+}
+
+/**
+ * @brief Rewrite a circuit into a smaller one with the same distribution, in one
+ * pass in storage order:
+ * - arithmetic on constants is folded,
+ * - sums and differences of independent Gaussians, and sums of independent
+ *   Poissons, are merged into a single variable,
+ * - comparisons whose sides never overlap, or always do, become TRUE or FALSE,
+ * - TRUE and FALSE are dropped from or absorb AND and OR, and repeated operands
+ *   of an AND or OR are dropped.
+ *
+ * Variables are only merged when nothing else in the circuit uses them, so the
+ * result keeps every dependency inside the circuit. Merged variables are new
+ * draws, however, so the result is no longer tied to other gates that use the
+ * original variables.
+ *
+ * @param sg The circuit
+ * @return SerializedGate* The simplified circuit
+ */
+SerializedGate *simplify_serialized_gate(SerializedGate *sg)
+{
+    const int32 n = sg->num_nodes;
+    const int32 *operand_list = SERIALIZED_GATE_OPERANDS(sg);
+
+    // How many gates use each gate as an operand.
+    int32 *uses = (int32 *)palloc0(n * sizeof(int32));
+    for (int32 i = 0; i < n; ++i)
+    {
+        const int32 *operands;
+        const int32 count = gate_node_operands(operand_list, &sg->nodes[i], &operands);
+        for (int32 k = 0; k < count; ++k)
+        {
+            uses[operands[k]]++;
+        }
+    }
+
+    const support_interval indicator_support = {0, 1};
+
+    // Every gate is rewritten into at most one gate, so the new circuit is never
+    // larger than the old one.
+    GateBuilder builder;
+    init_gate_builder(&builder, n);
+    int32 *map = (int32 *)palloc(n * sizeof(int32));
+    support_interval *supports = (support_interval *)palloc(n * sizeof(support_interval));
+
+    for (int32 i = 0; i < n; ++i)
+    {
+        serialized_gate_node node = sg->nodes[i];
+
+        if (is_junction_node(&node))
+        {
+            map[i] = simplify_junction_node(&builder, sg, i, map);
+            supports[map[i]] = indicator_support;
+            continue;
+        }
+
+        if (node.left >= 0)
+        {
+            node.left = map[node.left];
+            node.right = map[node.right];
+        }
+
+        // The operands as they are in the new circuit, which grows below.
+        serialized_gate_node left, right;
+        memset(&left, 0, sizeof(serialized_gate_node));
+        memset(&right, 0, sizeof(serialized_gate_node));
+        if (node.left >= 0)
+        {
+            left = builder.result->nodes[node.left];
+            right = builder.result->nodes[node.right];
+        }
+
+        if (node.gate_type == COMPOSITE_VARIABLE)
+        {
+            double x, y, value;
+            serialized_gate_node merged;
+            const bool constant_left = left.gate_type == BASE_VARIABLE && left.tag == GAUSSIAN &&
+                                       left.parameters.gaussian_parameters.stddev == 0;
+            const bool constant_right = right.gate_type == BASE_VARIABLE && right.tag == GAUSSIAN &&
+                                        right.parameters.gaussian_parameters.stddev == 0;
+            x = left.parameters.gaussian_parameters.mean;
+            y = right.parameters.gaussian_parameters.mean;
+
+            if (constant_left && constant_right && fold_constant_composition(x, y, node.tag, &value))
+            {
+                set_constant_node(&node, value);
+            }
+            else if ((node.tag == PLUS || node.tag == SUM || node.tag == MINUS) &&
+                     left.gate_type == BASE_VARIABLE && right.gate_type == BASE_VARIABLE &&
+                     (constant_left || uses[sg->nodes[i].left] == 1) &&
+                     (constant_right || uses[sg->nodes[i].right] == 1) &&
+                     merge_base_variables(&left, &right, node.tag, &merged))
+            {
+                node = merged;
+            }
+        }
+        else if (node.gate_type == CONDITION && condition_is_comparator(node.tag))
+        {
+            bool holds;
+            if (decide_comparison(node.tag, supports[node.left], supports[node.right], &holds))
+            {
+                set_truth_node(&node, holds);
+            }
+        }
+
+        const int32 position = intern_gate_node(&builder, &node);
+        map[i] = position;
+
+        // The support of the gate as it is now, for the comparisons that use it.
+        serialized_gate_node *rewritten = &builder.result->nodes[position];
+        if (rewritten->gate_type == BASE_VARIABLE)
+        {
+            supports[position] = base_variable_support(rewritten->tag, rewritten->parameters);
+        }
+        else if (rewritten->gate_type == COMPOSITE_VARIABLE)
+        {
+            supports[position] = combine_supports(rewritten->tag, supports[rewritten->left], supports[rewritten->right]);
+        }
+        else
+        {
+            supports[position] = indicator_support;
+        }
+    }
+
+    SerializedGate *rewritten = finish_gate_builder(&builder);
+    SerializedGate *result = extract_serialized_subgate(rewritten, map[n - 1]);
+
+    pfree(uses);
+    pfree(map);
+    pfree(supports);
+    pfree(rewritten);
+    return result;
+}
+#endif
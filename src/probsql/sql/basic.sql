@@ -1,3 +1,4 @@
+SET probsql.gate_output = tree;
 CREATE TABLE test(id SERIAL, gate GATE);
 INSERT INTO test(gate) VALUES ('gaussian(1.0, 2.0)'), ('poisson(3.0)');
 SELECT * FROM test;
@@ -11,4 +12,67 @@ SELECT 'gaussian(1.0, 2.0)'::gate <= 'poisson(3.0)'::gate AS my_cond;
 SELECT 'gaussian(1.0, 2.0)'::gate <> 'poisson(3.0)'::gate AS my_cond;
 SELECT 'gaussian(1.0, 2.0)'::gate <> 2 AS my_cond;
 SELECT ('gaussian(1.0, 2.0)'::gate <> 2) && ('gaussian(1.0, 2.0)'::gate < 'poisson(3.0)'::gate) AS my_cond;
-SELECT !('gaussian(1.0, 2.0)'::gate <> 2) AS my_cond;
\ No newline at end of file
+SELECT !('gaussian(1.0, 2.0)'::gate <> 2) AS my_cond;
+SELECT probability(less_than('gaussian(0.0, 1.0)', 0)) AS p;
+SELECT probability(less_than('poisson(3.0)', 1)) AS p;
+SELECT probability(and_gate(less_than('gaussian(0.0, 1.0)', 0), less_than('poisson(3.0)', 1))) AS p;
+SELECT 2::gate + 3::gate AS const_var;
+SELECT 'poisson(3.0)'::gate >= 0 AS my_cond;
+SELECT simplify('gaussian(1.0, 2.0)'::gate + 'gaussian(3.0, 1.0)'::gate + 2) AS simplified;
+SELECT prob_at_least(less_than('poisson(3.0)', 1), 0.01) AS likely, prob_at_least(less_than('poisson(3.0)', 1), 0.5) AS unlikely;
+SELECT * FROM probability_bounds(less_than('gaussian(0.0, 1.0)', 3));
+CREATE TABLE ranked(id int, g gate);
+INSERT INTO ranked(id, g) VALUES (1, 'gaussian(0.0, 1.0)'), (2, 'gaussian(2.0, 1.0)'), (3, 'gaussian(-2.0, 1.0)');
+SELECT * FROM probsql_topk('SELECT id FROM ranked WHERE g < 0', 2) AS t(id int, cond gate);
+SELECT gate_to_text('gaussian(1.0, 2.0)'::gate + 'poisson(3.0)'::gate, max_depth => 1) AS shallow, gate_to_text('gaussian(1.0, 2.0)'::gate + 'poisson(3.0)'::gate, 12) AS short;
+SELECT gate_out_dag(x + x) AS dag FROM (SELECT 'gaussian(1.0, 2.0)'::gate AS x) s;
+SELECT '#1 = poisson(3.0); #2 = 2; #3 = #1 * #2; #4 = #3 > #1'::gate AS parsed;
+SELECT 'max(gaussian(0, 1), 2) * -1 + 1 <= 0 || FALSE'::gate AS parsed;
+SELECT length(gate_send('poisson(3.0)'::gate)) AS poisson_bytes, length(gate_send(2::gate)) AS constant_bytes;
+SELECT gaussian(1.0, 2.0) AS g, poisson(3) AS p;
+SELECT * FROM gaussian_array(ARRAY[0.0, 1.0], ARRAY[1.0, NULL]) AS g;
+SELECT or_gate(less_than('gaussian(0.0, 1.0)', 0), less_than('poisson(3.0)', 1)) AS my_cond;
+SELECT count(DISTINCT g) AS distinct_gates, count(DISTINCT g + 1) AS distinct_sums FROM (VALUES (2::gate), (2::gate), (3::gate)) v(g);
+SELECT and_all(less_than(x, '1'), less_than(x, '1'), less_than('2', '3'), more_than(x, '3')) AS conj FROM (SELECT 'poisson(3.0)'::gate AS x) s;
+SELECT gate_out_dag(and_gate(and_gate(less_than(x, '1'), less_than(x, '2')), less_than(x, '3'))) AS dag FROM (SELECT 'poisson(3.0)'::gate AS x) s;
+CREATE TABLE arrivals(id int, x gate);
+INSERT INTO arrivals(id, x) VALUES (1, 'poisson(2.0)');
+CREATE TABLE slots(id int, y gate);
+INSERT INTO slots(id, y) VALUES (1, '-1'), (2, '1');
+SELECT a.id AS arrival, s.id AS slot FROM arrivals a, slots s WHERE a.x = s.y;
+SELECT likely_interval('gaussian(1.0, 2.0)'::gate) AS gaussian, likely_interval('poisson(3.0)'::gate) AS poisson;
+CREATE TABLE readings(id int, r gate);
+INSERT INTO readings(id, r) VALUES (1, 'gaussian(90.0, 2.0)'), (2, 'gaussian(120.0, 5.0)'), (3, 'poisson(100.0)');
+CREATE INDEX ON readings USING gist (r);
+SET enable_seqscan = off;
+SELECT id FROM readings WHERE r ?> 110 ORDER BY id;
+RESET enable_seqscan;
+SELECT gate_to_text(prob_sum(g)) AS total FROM (VALUES ('gaussian(1.0, 2.0)'::gate), ('gaussian(3.0, 1.0)'), (2::gate), ('poisson(3.0)'), ('poisson(1.0)'), ('poisson(1.0)'::gate * 2)) v(g);
+SELECT gate_to_text(total) AS total, round(probability(less_than(total, 0))::numeric, 4) AS p FROM (SELECT prob_sum(t.x) AS total FROM (SELECT 'gaussian(1.0, 2.0)'::gate AS x) t, generate_series(1, 2)) q;
+SELECT gate_to_text(prob_sum(g)) AS total FROM (VALUES ('gaussian(0.0, 1.0)'::gate)) v(g) WHERE false;
+CREATE TABLE sums(g gate);
+INSERT INTO sums(g) SELECT gaussian(i, 1.0) FROM generate_series(1, 1000) i;
+INSERT INTO sums(g) SELECT 'gaussian(0.0, 100.0)'::gate FROM generate_series(1, 3);
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+EXPLAIN (COSTS OFF) SELECT prob_sum(g) FROM (SELECT g FROM sums) s;
+SELECT round(probability(less_than(total, 500802))::numeric, 4) AS p FROM (SELECT prob_sum(g) AS total FROM (SELECT g FROM sums) s) q;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+CREATE TABLE triples(id int, x gate, y gate, z gate);
+INSERT INTO triples(id, x, y, z) VALUES (1, 'gaussian(0.0, 1.0)', 'poisson(3.0)', 'gaussian(2.0, 1.0)'), (2, 'gaussian(0.0, 1.0)', 'poisson(3.0)', 'gaussian(2.0, 1.0)');
+SELECT id FROM triples WHERE x < 1 AND id = 1 AND y < 2 AND z < 3;
+SELECT 'gaussian(0, -1)'::gate AS g;
+SELECT 'poisson(-3)'::gate AS p;
+SELECT 'gaussian(NaN, 1)'::gate AS g;
+SET probsql.gate_output = exact;
+SELECT regexp_replace((x + x)::text, '@[0-9a-f-]{36}', '@<id>', 'g') AS exact, 1::gate / 3::gate AS third FROM (SELECT 'gaussian(0.001, 0.004)'::gate AS x) s;
+SELECT x::text::gate *= x AS round_trip FROM (SELECT less_than(('gaussian(0.001, 0.004)'::gate + 'poisson(3.0)'::gate) * 1e-300, 0.1) AS x) s;
+SET probsql.gate_output = tree;
+SELECT round(probability_mc(less_than('gaussian(0.0, 1.0)', 0), 100000, 1)::numeric, 3) AS p;
+SELECT round(expectation_mc('max(gaussian(0.0, 1.0), 0) * poisson(2.0)', 100000, 1)::numeric, 3) AS e;
+SELECT probability_mc(less_than('gaussian(0.0, 1.0)', 0), 0);
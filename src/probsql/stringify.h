@@ -7,188 +7,326 @@
 
 #include "postgres.h"
 #include "fmgr.h"
+#include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
+#include "common/shortest_dec.h"
 
-// Forward declaration for stringify_condition
-char *_stringify_gate(Gate *gate);
+// What is written in place of the parts of a circuit that were cut off.
+#define STRINGIFY_ELLIPSIS "..."
 
-// Returns the textual representation of a base distribution,
+// Something still to be written: either a gate, or a piece of text that goes
+// between the gates.
+typedef struct
+{
+    Gate *gate;
+    const char *text;
+    int depth;
+} stringify_item;
+
+// The explicit stack of a traversal, so that deep circuits do not use up the C stack.
+typedef struct
+{
+    stringify_item *items;
+    int size;
+    int capacity;
+} stringify_stack;
+
+static inline void push_stringify_item(stringify_stack *stack, Gate *gate, const char *text, int depth)
+{
+    if (stack->size == stack->capacity)
+    {
+        stack->capacity *= 2;
+        stack->items = (stringify_item *)repalloc(stack->items, stack->capacity * sizeof(stringify_item));
+    }
+
+    stack->items[stack->size].gate = gate;
+    stack->items[stack->size].text = text;
+    stack->items[stack->size].depth = depth;
+    stack->size++;
+}
+
+// Appends the textual representation of a base distribution,
 // i.e. the name of the distribution and its parameters.
-char *stringify_base_variable(base_variable *base_variable)
+void stringify_base_variable(StringInfo buf, base_variable *base_variable)
 {
     switch (base_variable->distribution_type)
     {
     case GAUSSIAN:
     {
         gaussian_parameters params = base_variable->base_variable_parameters.gaussian_parameters;
-        return psprintf("gaussian(%.2f, %.2f)", params.mean, params.stddev);
+        appendStringInfo(buf, "gaussian(%.2f, %.2f)", params.mean, params.stddev);
+        break;
     }
     case POISSON:
     {
         poisson_parameters params = base_variable->base_variable_parameters.poisson_parameters;
-        return psprintf("poisson(%.2f)", params.lambda);
+        appendStringInfo(buf, "poisson(%.2f)", params.lambda);
+        break;
     }
     default:
-        return "UNRECOGNISED_BASE_VARIABLE";
+        appendStringInfoString(buf, "UNRECOGNISED_BASE_VARIABLE");
     }
 }
 
-// Returns (stringified_left)[ opr ](stringified_right)
-char *combine_nonagg_operands_and_operator(char *stringified_left, char *opr, char *stringified_right)
+// Appends a double as float8out writes it: the shortest text that reads back as
+// the same double.
+static void append_exact_double(StringInfo buf, double value)
 {
-    const int length_of_left_side = strlen(stringified_left);
-    const int length_of_opr = strlen(opr);
-    const int length_of_right_side = strlen(stringified_right);
-    const int length = length_of_left_side +
-                       length_of_opr +
-                       length_of_right_side + 4; // + 4 for the brackets
-
-    char *arr = (char *)palloc(length + 1); // + 1 for the null terminator
-
-    arr[0] = '(';
-    memcpy((void *)arr + 1, (void *)stringified_left, length_of_left_side);
-    arr[length_of_left_side + 1] = ')';
-
-    memcpy((void *)arr + length_of_left_side + 2, (void *)opr, length_of_opr);
-
-    arr[length_of_left_side + 2 + length_of_opr] = '(';
-    memcpy((void *)arr + length_of_left_side + 3 + length_of_opr, (void *)stringified_right, length_of_right_side);
-    arr[length - 1] = ')';
-    arr[length] = '\0';
-
-    return arr;
+    char text[DOUBLE_SHORTEST_DECIMAL_LEN];
+    double_to_shortest_decimal_buf(value, text);
+    appendStringInfoString(buf, text);
 }
 
-// Returns [opr]`(`(left),(right)`)`
-char *combine_aggregate_operands_and_operator(char *opr, char *left, char *right)
+// Appends the id of a variable in the usual form of a uuid, e.g.
+// 01234567-89ab-cdef-0123-456789abcdef.
+static void append_variable_id(StringInfo buf, const pg_uuid_t *variable_id)
 {
-    const int length_of_left = strlen(left);
-    const int length_of_right = strlen(right);
-    const int length_of_opr = strlen(opr);
-    const int length = length_of_opr + length_of_left + length_of_right + 3; // + 3 for the brackets and comma
-
-    char *arr = (char *)palloc(length + 1); // + 1 for the null terminator
-
-    memcpy((void *)arr, (void *)opr, length_of_opr);
-    arr[length_of_opr] = '(';
-    memcpy((void *)arr + length_of_opr + 1, (void *)left, length_of_left);
-    arr[length_of_opr + 1 + length_of_left] = ',';
-    memcpy((void *)arr + length_of_opr + 1 + length_of_left + 1, (void *)right, length_of_right);
-    arr[length - 1] = ')';
-    arr[length] = '\0';
-
-    return arr;
+    for (int i = 0; i < UUID_LEN; ++i)
+    {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+        {
+            appendStringInfoChar(buf, '-');
+        }
+        appendStringInfo(buf, "%02x", variable_id->data[i]);
+    }
 }
 
-char *stringify_condition(condition *condition)
+/**
+ * @brief Append a base distribution so that parse.h reads back the same
+ * variable: parameters are written in full, and the id follows an @, e.g.
+ * gaussian(0.001, 0.004)@01234567-89ab-cdef-0123-456789abcdef. Constants have
+ * the nil id and are written as plain numbers.
+ *
+ * @param buf The buffer to append to
+ * @param base_variable The base variable
+ */
+void stringify_base_variable_exact(StringInfo buf, base_variable *base_variable)
 {
-    // The operator in the condition
-    char *opr;
+    static const pg_uuid_t nil_id;
+    const bool has_id = memcmp(&base_variable->variable_id, &nil_id, sizeof(pg_uuid_t)) != 0;
 
-    switch (condition->condition_type)
+    switch (base_variable->distribution_type)
     {
-    case AND:
-        opr = "&&";
+    case GAUSSIAN:
+    {
+        gaussian_parameters params = base_variable->base_variable_parameters.gaussian_parameters;
+        if (!has_id && params.stddev == 0)
+        {
+            append_exact_double(buf, params.mean);
+            return;
+        }
+        appendStringInfoString(buf, "gaussian(");
+        append_exact_double(buf, params.mean);
+        appendStringInfoString(buf, ", ");
+        append_exact_double(buf, params.stddev);
+        appendStringInfoChar(buf, ')');
         break;
-    case OR:
-        opr = "||";
+    }
+    case POISSON:
+        appendStringInfoString(buf, "poisson(");
+        append_exact_double(buf, base_variable->base_variable_parameters.poisson_parameters.lambda);
+        appendStringInfoChar(buf, ')');
         break;
+    default:
+        appendStringInfoString(buf, "UNRECOGNISED_BASE_VARIABLE");
+        return;
+    }
+
+    if (has_id)
+    {
+        appendStringInfoChar(buf, '@');
+        append_variable_id(buf, &base_variable->variable_id);
+    }
+}
+
+// The symbol of a condition, e.g. && or <=.
+const char *condition_operator_string(condition_type condition_type)
+{
+    switch (condition_type)
+    {
+    case AND:
+        return "&&";
+    case OR:
+        return "||";
     case LESS_THAN_OR_EQUAL:
-        opr = "<=";
-        break;
+        return "<=";
     case LESS_THAN:
-        opr = "<";
-        break;
+        return "<";
     case MORE_THAN_OR_EQUAL:
-        opr = ">=";
-        break;
+        return ">=";
     case MORE_THAN:
-        opr = ">";
-        break;
+        return ">";
     case EQUAL_TO:
-        opr = "==";
-        break;
+        return "==";
     case NOT_EQUAL_TO:
-        opr = "!=";
-        break;
+        return "!=";
     default:
-        opr = "UNRECOGNISED CONDITION";
+        return "UNRECOGNISED CONDITION";
     }
-
-    /**
-     * A condition always takes the form <left gate> <opr> <right gate>
-     */
-    char *stringified_left = _stringify_gate(condition->left_gate);
-    char *stringified_right = _stringify_gate(condition->right_gate);
-    return combine_nonagg_operands_and_operator(stringified_left, opr, stringified_right);
 }
 
-char *stringify_composite_variable(comp_variable *comp_variable)
+// The symbol of a composition, e.g. + or sum.
+const char *composition_operator_string(probabilistic_composition opr)
 {
-    char *opr;
-    switch (comp_variable->opr)
+    switch (opr)
     {
     case PLUS:
-        opr = "+";
-        break;
+        return "+";
     case MINUS:
-        opr = "-";
-        break;
+        return "-";
     case TIMES:
-        opr = "*";
-        break;
+        return "*";
     case DIVIDE:
-        opr = "/";
-        break;
+        return "/";
     case MAX:
-        opr = "max";
-        break;
+        return "max";
     case MIN:
-        opr = "min";
-        break;
+        return "min";
     case COUNT:
-        opr = "count";
-        break;
+        return "count";
     case SUM:
-        opr = "sum";
-        break;
+        return "sum";
     default:
-        opr = "UNKNOWN OPR";
+        return "UNKNOWN OPR";
     }
+}
+
+/**
+ * @brief Append the textual representation of a gate to a buffer. Operands are
+ * written as (left)[ opr ](right), or as [opr]((left),(right)) for aggregates.
+ * ANDs and ORs are written as (a)[ opr ](b)[ opr ](c), with all their operands.
+ *
+ * The circuit is walked with an explicit stack, so the time taken is linear in
+ * the length of the output and deep circuits are safe to print.
+ *
+ * @param buf The buffer to append to
+ * @param gate The gate
+ * @param max_length If positive, the most characters to append. Longer output is
+ * cut off and ends in "...".
+ * @param max_depth If positive, the most levels of the circuit to print. Deeper
+ * gates are written as "...".
+ */
+void stringify_gate_into(StringInfo buf, Gate *gate, int max_length, int max_depth)
+{
+    const int limit = max_length > 0 ? buf->len + max_length : INT_MAX;
+
+    stringify_stack stack;
+    stack.capacity = 64;
+    stack.size = 0;
+    stack.items = (stringify_item *)palloc(stack.capacity * sizeof(stringify_item));
+    push_stringify_item(&stack, gate, NULL, 1);
+
+    // Stop as soon as the limit is reached; the rest is not looked at.
+    while (stack.size > 0 && buf->len <= limit)
+    {
+        stringify_item item = stack.items[--stack.size];
 
-    char *stringified_left = _stringify_gate(comp_variable->left_gate);
-    char *stringified_right = _stringify_gate(comp_variable->right_gate);
+        if (item.gate == NULL)
+        {
+            appendStringInfoString(buf, item.text);
+            continue;
+        }
 
-    /**
-     * An aggregate composite variable takes the form: <opr>(<left>,<right>)
-     */
-    if (is_aggregate_comp(comp_variable->opr))
+        if (max_depth > 0 && item.depth > max_depth)
+        {
+            appendStringInfoString(buf, STRINGIFY_ELLIPSIS);
+            continue;
+        }
+
+        Gate *left, *right;
+        const char *opr;
+        bool aggregate = false;
+
+        switch (item.gate->gate_type)
+        {
+        case BASE_VARIABLE:
+            stringify_base_variable(buf, &item.gate->gate_info.base_variable);
+            continue;
+        case PLACEHOLDER_TRUE:
+            appendStringInfoString(buf, "TRUE");
+            continue;
+        case PLACEHOLDER_FALSE:
+            appendStringInfoString(buf, "FALSE");
+            continue;
+        case COMPOSITE_VARIABLE:
+            left = item.gate->gate_info.comp_variable.left_gate;
+            right = item.gate->gate_info.comp_variable.right_gate;
+            opr = composition_operator_string(item.gate->gate_info.comp_variable.opr);
+            aggregate = is_aggregate_comp(item.gate->gate_info.comp_variable.opr);
+            break;
+        case CONDITION:
+            opr = condition_operator_string(item.gate->gate_info.condition.condition_type);
+            if (!condition_is_comparator(item.gate->gate_info.condition.condition_type))
+            {
+                // (<operand>)<opr>(<operand>)<opr>...(<operand>)
+                const condition *cdn = &item.gate->gate_info.condition;
+                appendStringInfoChar(buf, '(');
+                for (int k = cdn->num_operands - 1; k >= 0; --k)
+                {
+                    push_stringify_item(&stack, NULL, ")", 0);
+                    push_stringify_item(&stack, cdn->operands[k], NULL, item.depth + 1);
+                    if (k > 0)
+                    {
+                        push_stringify_item(&stack, NULL, "(", 0);
+                        push_stringify_item(&stack, NULL, opr, 0);
+                    }
+                }
+                continue;
+            }
+            left = item.gate->gate_info.condition.left_gate;
+            right = item.gate->gate_info.condition.right_gate;
+            break;
+        default:
+            appendStringInfoString(buf, "UNRECOGNISED_GATE");
+            continue;
+        }
+
+        // The pieces are pushed last first, so that they come off the stack in order.
+        if (aggregate)
+        {
+            // <opr>(<left>,<right>)
+            appendStringInfoString(buf, opr);
+            appendStringInfoChar(buf, '(');
+            push_stringify_item(&stack, NULL, ")", 0);
+            push_stringify_item(&stack, right, NULL, item.depth + 1);
+            push_stringify_item(&stack, NULL, ",", 0);
+            push_stringify_item(&stack, left, NULL, item.depth + 1);
+        }
+        else
+        {
+            // (<left>)<opr>(<right>)
+            appendStringInfoChar(buf, '(');
+            push_stringify_item(&stack, NULL, ")", 0);
+            push_stringify_item(&stack, right, NULL, item.depth + 1);
+            push_stringify_item(&stack, NULL, "(", 0);
+            push_stringify_item(&stack, NULL, opr, 0);
+            push_stringify_item(&stack, NULL, ")", 0);
+            push_stringify_item(&stack, left, NULL, item.depth + 1);
+        }
+    }
+
+    // Output that ends exactly at the limit is only cut off if something was left over.
+    if (buf->len > limit || (buf->len == limit && stack.size > 0))
     {
-        return combine_aggregate_operands_and_operator(opr, stringified_left, stringified_right);
+        buf->len = limit;
+        buf->data[limit] = '\0';
+        appendStringInfoString(buf, STRINGIFY_ELLIPSIS);
     }
 
-    /**
-     *  A composite variable (that is not aggregate) takes the following form: <left gate> <opr> <right_gate>
-     */
-    return combine_nonagg_operands_and_operator(stringified_left, opr, stringified_right);
+    pfree(stack.items);
 }
 
+/**
+ * @brief The textual representation of a gate, in full.
+ *
+ * @param gate The gate
+ * @return char* The text, palloc'd in the current memory context
+ */
 char *_stringify_gate(Gate *gate)
 {
-    // Depending on the type of gate we have, use the
-    // appropriate stringifier
-    switch (gate->gate_type)
-    {
-    case BASE_VARIABLE:
-        return stringify_base_variable(&(gate->gate_info.base_variable));
-    case COMPOSITE_VARIABLE:
-        return stringify_composite_variable(&(gate->gate_info.comp_variable));
-    case CONDITION:
-        return stringify_condition(&(gate->gate_info.condition));
-    case PLACEHOLDER_TRUE:
-        return "TRUE";
-    default:
-        return "UNRECOGNISED_GATE";
-    }
+    StringInfoData buf;
+    initStringInfo(&buf);
+    stringify_gate_into(&buf, gate, 0, 0);
+    return buf.data;
 }
-#endif
\ No newline at end of file
+#endif
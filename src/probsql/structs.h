@@ -1,6 +1,7 @@
 #ifndef STRUCT_H
 #define STRUCT_H
 #include "enums.h"
+#include "utils/uuid.h"
 /************************************************
  * Parameters for distributions
  ************************************************/
@@ -40,6 +41,12 @@ typedef struct
     // The parameters for this base variable,
     // depending on what type of distribution it has.
     base_variable_parameters base_variable_parameters;
+
+    // Identifies this random variable. Every occurrence of the same id in a
+    // circuit is the same draw, while base variables with different ids are
+    // independent, even if their parameters are equal. Constants have no
+    // randomness and use the nil id.
+    pg_uuid_t variable_id;
 } base_variable;
 
 // Represents a composition of distributions.
@@ -63,6 +70,10 @@ typedef struct
     struct Gate *left_gate;
     // The right operand in this condition, e.g. y in x > y.
     struct Gate *right_gate;
+    // AND and OR take any number of operands, e.g. x, y and z in x && y && z.
+    // They keep them here instead of in left_gate and right_gate.
+    int num_operands;
+    struct Gate **operands;
 } condition;
 
 typedef union
@@ -92,4 +103,46 @@ typedef struct Gate
     gate_info gate_info;
 } Gate;
 
+/************************************************
+ * On-disk form of a circuit
+ ************************************************/
+
+// A gate as it is stored inside a datum. Operands are referenced by their
+// position in the node array instead of by pointer, so the whole circuit
+// can be copied around as one block of memory.
+typedef struct
+{
+    // Same meaning as in Gate.
+    gate_type gate_type;
+
+    // The distribution_type, probabilistic_composition or condition_type
+    // of this gate, depending on its gate_type.
+    int32 tag;
+
+    // Positions of the operands of a composite variable or condition,
+    // or -1 if this gate has none. An AND or OR may have any number of
+    // operands instead: left is where they start in the circuit's operand
+    // list, and right is how many there are.
+    int32 left;
+    int32 right;
+
+    // The parameters and identity of a base variable.
+    base_variable_parameters parameters;
+    pg_uuid_t variable_id;
+} serialized_gate_node;
+
+// The varlena representation of a circuit. Nodes are stored in topological
+// order, i.e. every operand comes before the gates that use it, so the last
+// node is always the root of the circuit. Equal subcircuits are stored once
+// and shared, so the node array describes a DAG rather than a tree.
+//
+// The node array is followed by the operand list of the ANDs and ORs, i.e. the
+// positions of their operands, as int32s up to the end of the varlena.
+typedef struct
+{
+    int32 vl_len_; // varlena header (do not touch directly!)
+    int32 num_nodes;
+    serialized_gate_node nodes[FLEXIBLE_ARRAY_MEMBER];
+} SerializedGate;
+
 #endif
\ No newline at end of file
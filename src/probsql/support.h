@@ -0,0 +1,254 @@
+// Methods for working out the range of values that a gate can take.
+#ifndef SUPPORT_H
+#define SUPPORT_H
+#include "enums.h"
+#include "structs.h"
+
+#include "postgres.h"
+#include <math.h>
+
+// A closed interval that holds every value a probability gate can take.
+// Either end may be infinite.
+typedef struct
+{
+    double lower;
+    double upper;
+} support_interval;
+
+// A likely interval of a base variable leaves out at most this much probability
+// on each side.
+#define LIKELY_INTERVAL_TAIL 1e-12
+
+// P(Z > 7.1) < LIKELY_INTERVAL_TAIL for a standard Gaussian Z.
+#define LIKELY_INTERVAL_GAUSSIAN_SIGMAS 7.1
+
+// The support of a base variable.
+support_interval base_variable_support(int32 distribution_type, base_variable_parameters parameters)
+{
+    support_interval result = {-INFINITY, INFINITY};
+
+    if (distribution_type == GAUSSIAN)
+    {
+        // Without spread, a Gaussian is a constant.
+        if (parameters.gaussian_parameters.stddev == 0)
+        {
+            result.lower = parameters.gaussian_parameters.mean;
+            result.upper = parameters.gaussian_parameters.mean;
+        }
+    }
+    else if (distribution_type == POISSON)
+    {
+        result.lower = 0;
+        result.upper = parameters.poisson_parameters.lambda == 0 ? 0 : INFINITY;
+    }
+
+    return result;
+}
+
+/**
+ * @brief An interval that a base variable falls outside of with a probability of
+ * at most LIKELY_INTERVAL_TAIL on each side: mean +- 7.1 standard deviations for
+ * a Gaussian, and the Chernoff bounds P(X >= l + t) <= exp(-t^2 / (2(l + t))) and
+ * P(X <= l - t) <= exp(-t^2 / 2l) for a Poisson with mean l. Unlike the support,
+ * it is finite.
+ *
+ * @param distribution_type The distribution
+ * @param parameters Its parameters
+ * @return support_interval The interval, within the support
+ */
+support_interval likely_base_variable_interval(int32 distribution_type, base_variable_parameters parameters)
+{
+    support_interval result = base_variable_support(distribution_type, parameters);
+
+    if (distribution_type == GAUSSIAN)
+    {
+        const gaussian_parameters params = parameters.gaussian_parameters;
+        result.lower = Max(result.lower, params.mean - LIKELY_INTERVAL_GAUSSIAN_SIGMAS * params.stddev);
+        result.upper = Min(result.upper, params.mean + LIKELY_INTERVAL_GAUSSIAN_SIGMAS * params.stddev);
+    }
+    else if (distribution_type == POISSON)
+    {
+        const double lambda = parameters.poisson_parameters.lambda;
+        const double log_tail = -log(LIKELY_INTERVAL_TAIL);
+        result.lower = Max(result.lower, lambda - sqrt(2 * log_tail * lambda));
+        result.upper = Min(result.upper, lambda + log_tail + sqrt(log_tail * log_tail + 2 * log_tail * lambda));
+    }
+
+    return result;
+}
+
+/**
+ * @brief The support of an arithmetic gate, from the supports of its operands.
+ * The result holds every value the gate can take, whether its operands are
+ * independent or not, but it may be wider than necessary.
+ *
+ * @param opr The operator of the gate
+ * @param x The support of the left operand
+ * @param y The support of the right operand
+ * @return support_interval The support of the gate
+ */
+support_interval combine_supports(probabilistic_composition opr, support_interval x, support_interval y)
+{
+    support_interval result = {-INFINITY, INFINITY};
+    const bool finite = isfinite(x.lower) && isfinite(x.upper) && isfinite(y.lower) && isfinite(y.upper);
+
+    switch (opr)
+    {
+    case PLUS:
+    case SUM:
+        result.lower = x.lower + y.lower;
+        result.upper = x.upper + y.upper;
+        break;
+    case MINUS:
+        result.lower = x.lower - y.upper;
+        result.upper = x.upper - y.lower;
+        break;
+    case TIMES:
+        // Infinite ends could multiply zero, so they are left unbounded.
+        if (finite)
+        {
+            const double corners[4] = {x.lower * y.lower, x.lower * y.upper, x.upper * y.lower, x.upper * y.upper};
+            result.lower = Min(Min(corners[0], corners[1]), Min(corners[2], corners[3]));
+            result.upper = Max(Max(corners[0], corners[1]), Max(corners[2], corners[3]));
+        }
+        break;
+    case DIVIDE:
+        if (finite && (y.lower > 0 || y.upper < 0))
+        {
+            const double corners[4] = {x.lower / y.lower, x.lower / y.upper, x.upper / y.lower, x.upper / y.upper};
+            result.lower = Min(Min(corners[0], corners[1]), Min(corners[2], corners[3]));
+            result.upper = Max(Max(corners[0], corners[1]), Max(corners[2], corners[3]));
+        }
+        break;
+    case MAX:
+        result.lower = Max(x.lower, y.lower);
+        result.upper = Max(x.upper, y.upper);
+        break;
+    case MIN:
+        result.lower = Min(x.lower, y.lower);
+        result.upper = Min(x.upper, y.upper);
+        break;
+    default:
+        break;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Decide a comparison X ? Y from the supports of its sides alone.
+ *
+ * @param opr The comparator
+ * @param x The support of X
+ * @param y The support of Y
+ * @param result Receives whether the comparison always holds
+ * @return bool false if the comparison holds for some values and fails for others
+ */
+bool decide_comparison(condition_type opr, support_interval x, support_interval y, bool *result)
+{
+    // The support of X - Y. NaN ends make every test below fail.
+    const double lower = x.lower - y.upper;
+    const double upper = x.upper - y.lower;
+
+    switch (opr)
+    {
+    case LESS_THAN:
+        if (upper < 0 || lower >= 0)
+        {
+            *result = upper < 0;
+            return true;
+        }
+        return false;
+    case LESS_THAN_OR_EQUAL:
+        if (upper <= 0 || lower > 0)
+        {
+            *result = upper <= 0;
+            return true;
+        }
+        return false;
+    case MORE_THAN:
+        if (lower > 0 || upper <= 0)
+        {
+            *result = lower > 0;
+            return true;
+        }
+        return false;
+    case MORE_THAN_OR_EQUAL:
+        if (lower >= 0 || upper < 0)
+        {
+            *result = lower >= 0;
+            return true;
+        }
+        return false;
+    case EQUAL_TO:
+    case NOT_EQUAL_TO:
+        if ((lower == 0 && upper == 0) || lower > 0 || upper < 0)
+        {
+            *result = (lower == 0 && upper == 0) == (opr == EQUAL_TO);
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+// The interval of every gate of a serialized circuit, by position: the
+// support, or the likely interval if likely is set. Condition gates are given
+// the support of their indicator, [0, 1].
+static support_interval *serialized_gate_intervals(SerializedGate *sg, bool likely)
+{
+    support_interval *intervals = (support_interval *)palloc(sg->num_nodes * sizeof(support_interval));
+
+    for (int32 i = 0; i < sg->num_nodes; ++i)
+    {
+        serialized_gate_node *node = &sg->nodes[i];
+        support_interval indicator = {0, 1};
+
+        if (node->gate_type == BASE_VARIABLE)
+        {
+            intervals[i] = likely ? likely_base_variable_interval(node->tag, node->parameters)
+                                  : base_variable_support(node->tag, node->parameters);
+        }
+        else if (node->gate_type == COMPOSITE_VARIABLE)
+        {
+            intervals[i] = combine_supports(node->tag, intervals[node->left], intervals[node->right]);
+        }
+        else
+        {
+            intervals[i] = indicator;
+        }
+    }
+
+    return intervals;
+}
+
+/**
+ * @brief The support of every gate of a serialized circuit. Condition gates
+ * are given the support of their indicator, [0, 1].
+ *
+ * @param sg The serialized circuit
+ * @return support_interval* The support of each gate, by position
+ */
+support_interval *serialized_gate_supports(SerializedGate *sg)
+{
+    return serialized_gate_intervals(sg, false);
+}
+
+/**
+ * @brief An interval that a gate falls outside of with a probability of at most
+ * LIKELY_INTERVAL_TAIL on each side per random variable it depends on: while
+ * every base variable stays within its likely interval, the gate stays within
+ * the interval worked out from theirs. This is what gates are indexed by.
+ *
+ * @param sg The serialized gate
+ * @return support_interval The interval of its root
+ */
+support_interval serialized_gate_likely_interval(SerializedGate *sg)
+{
+    support_interval *intervals = serialized_gate_intervals(sg, true);
+    const support_interval result = intervals[sg->num_nodes - 1];
+    pfree(intervals);
+    return result;
+}
+#endif
@@ -0,0 +1,214 @@
+// Methods for finding the rows whose conditions are most probable.
+#ifndef TOPK_H
+#define TOPK_H
+#include "enums.h"
+#include "structs.h"
+#include "serialize.h"
+#include "probability.h"
+#include "sampler.h"
+#include "bounds.h"
+
+#include "postgres.h"
+#include "access/htup_details.h"
+#include "lib/binaryheap.h"
+
+// A row that may still be among the k most probable ones.
+typedef struct
+{
+    HeapTuple tuple;
+
+    // The probability of its condition lies between these. They are equal once
+    // the probability has been evaluated.
+    double lower;
+    double upper;
+    SerializedGate *condition;
+} topk_candidate;
+
+/*
+ * The state of a top-k search. Rows are first screened with the cheap bounds of
+ * their conditions: a row whose upper bound is below the k-th best lower bound
+ * seen so far can never make it, so it is dropped straight away.
+ */
+typedef struct
+{
+    int k;
+
+    // Rows that passed the screening so far, in the state's memory context.
+    topk_candidate *candidates;
+    int num_candidates;
+    int capacity;
+
+    // The k best lower bounds seen so far, smallest first.
+    binaryheap *best_lower;
+
+    MemoryContext context;
+} topk_state;
+
+// Orders the heap of lower bounds so that the smallest comes first.
+static int compare_lower_bounds(Datum a, Datum b, void *arg)
+{
+    const double x = DatumGetFloat8(a);
+    const double y = DatumGetFloat8(b);
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// Orders candidates by decreasing upper bound.
+static int compare_upper_bounds(const void *a, const void *b)
+{
+    const double x = ((const topk_candidate *)a)->upper;
+    const double y = ((const topk_candidate *)b)->upper;
+    return x > y ? -1 : (x < y ? 1 : 0);
+}
+
+/**
+ * @brief Start a top-k search.
+ *
+ * @param state The state to set up
+ * @param k The number of rows to find
+ * @param context The memory context that holds the rows kept for later
+ */
+void init_topk(topk_state *state, int k, MemoryContext context)
+{
+    MemoryContext old = MemoryContextSwitchTo(context);
+
+    state->k = k;
+    state->capacity = Max(2 * k, 64);
+    state->num_candidates = 0;
+    state->candidates = (topk_candidate *)palloc(state->capacity * sizeof(topk_candidate));
+    state->best_lower = binaryheap_allocate(k, compare_lower_bounds, NULL);
+    state->context = context;
+
+    MemoryContextSwitchTo(old);
+}
+
+// The k-th best lower bound so far. Rows that cannot reach it cannot make the top k.
+double topk_threshold(topk_state *state)
+{
+    return state->best_lower->bh_size < state->k ? 0 : DatumGetFloat8(binaryheap_first(state->best_lower));
+}
+
+// Drops the candidates that have fallen below the threshold.
+void topk_prune(topk_state *state)
+{
+    const double threshold = topk_threshold(state);
+    int kept = 0;
+
+    for (int i = 0; i < state->num_candidates; ++i)
+    {
+        topk_candidate *candidate = &state->candidates[i];
+        if (candidate->upper < threshold)
+        {
+            heap_freetuple(candidate->tuple);
+            pfree(candidate->condition);
+        }
+        else
+        {
+            state->candidates[kept++] = *candidate;
+        }
+    }
+
+    state->num_candidates = kept;
+}
+
+/**
+ * @brief Screen a row. It is copied into the state's memory context only if it
+ * may still be among the k most probable rows.
+ *
+ * @param state The search
+ * @param tuple The row
+ * @param condition The condition of the row
+ */
+void topk_add(topk_state *state, HeapTuple tuple, SerializedGate *condition)
+{
+    double lower, upper;
+    probability_bounds(condition, &lower, &upper);
+
+    if (upper < topk_threshold(state))
+    {
+        return;
+    }
+
+    MemoryContext old = MemoryContextSwitchTo(state->context);
+
+    // Raise the threshold with the new lower bound.
+    if (state->best_lower->bh_size < state->k)
+    {
+        binaryheap_add(state->best_lower, Float8GetDatum(lower));
+    }
+    else if (lower > topk_threshold(state))
+    {
+        binaryheap_replace_first(state->best_lower, Float8GetDatum(lower));
+    }
+
+    // Make room, first by dropping the rows that the threshold has overtaken.
+    if (state->num_candidates == state->capacity)
+    {
+        topk_prune(state);
+        if (state->num_candidates > state->capacity / 2)
+        {
+            state->capacity *= 2;
+            state->candidates = (topk_candidate *)repalloc(state->candidates,
+                                                           state->capacity * sizeof(topk_candidate));
+        }
+    }
+
+    topk_candidate *candidate = &state->candidates[state->num_candidates++];
+    candidate->tuple = heap_copytuple(tuple);
+    candidate->lower = lower;
+    candidate->upper = upper;
+    candidate->condition = (SerializedGate *)palloc(VARSIZE(condition));
+    memcpy(candidate->condition, condition, VARSIZE(condition));
+
+    MemoryContextSwitchTo(old);
+}
+
+/**
+ * @brief Finish the search. Candidates are evaluated in order of decreasing
+ * upper bound, and evaluation stops as soon as no remaining candidate can beat
+ * the k-th best probability found.
+ *
+ * @param state The search
+ * @return int The number of rows found, at most k. They are the first candidates
+ * of the state, most probable first, with lower = upper = their probability.
+ */
+int topk_finish(topk_state *state)
+{
+    topk_prune(state);
+    qsort(state->candidates, state->num_candidates, sizeof(topk_candidate), compare_upper_bounds);
+
+    // The best rows so far are kept at the front, most probable first.
+    int found = 0;
+    for (int i = 0; i < state->num_candidates; ++i)
+    {
+        topk_candidate candidate = state->candidates[i];
+
+        if (found == state->k && state->candidates[found - 1].lower >= candidate.upper)
+        {
+            break;
+        }
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (candidate.lower != candidate.upper)
+        {
+            candidate.lower = candidate.upper = evaluate_probability(candidate.condition);
+        }
+
+        if (found == state->k && candidate.lower <= state->candidates[found - 1].lower)
+        {
+            continue;
+        }
+
+        // Insert it into its place among the best rows, pushing out the k-th if need be.
+        int position = found < state->k ? found++ : found - 1;
+        while (position > 0 && state->candidates[position - 1].lower < candidate.lower)
+        {
+            state->candidates[position] = state->candidates[position - 1];
+            --position;
+        }
+        state->candidates[position] = candidate;
+    }
+
+    return found;
+}
+#endif